@@ -0,0 +1,65 @@
+#include "AutoExposure.h"
+
+AutoExposure::AutoExposure()
+{
+	lastChangeTime = 0;
+	_logger = spdlog::stdout_color_mt("AutoExposure");
+}
+
+AutoExposure::~AutoExposure()
+{
+}
+
+bool AutoExposure::Update(const HistogramSnapshot &stats, bool frameSaturated, int currentExposure, int &newExposure) {
+	// Rate limit
+	ULONGLONG now = GetTickCount64();
+	if (now - lastChangeTime < AUTO_EXPOSURE_INTERVAL_MS || stats.sampleCount == 0) {
+		return false;
+	}
+
+	double target = AUTO_EXPOSURE_TARGET * HISTOGRAM_SENSOR_MAX;
+	double high = stats.highValue < 1 ? 1 : stats.highValue;
+	double ratio;
+
+	if (frameSaturated || stats.saturatedFraction > AUTO_EXPOSURE_MAX_SATURATION) {
+		// Saturated frames are thrown away, so back off as fast as allowed
+		ratio = 1.0 / AUTO_EXPOSURE_MAX_STEP;
+	}
+	else if (high > target * (1.0 + AUTO_EXPOSURE_HYSTERESIS) || high < target * (1.0 - AUTO_EXPOSURE_HYSTERESIS)) {
+		// The sensor response is linear in the exposure time
+		ratio = target / high;
+		if (ratio > AUTO_EXPOSURE_MAX_STEP) {
+			ratio = AUTO_EXPOSURE_MAX_STEP;
+		}
+		if (ratio < 1.0 / AUTO_EXPOSURE_MAX_STEP) {
+			ratio = 1.0 / AUTO_EXPOSURE_MAX_STEP;
+		}
+	}
+	else {
+		// Inside the hysteresis band
+		return false;
+	}
+
+	int exposure = (int)(currentExposure * ratio + 0.5);
+	if (exposure < AUTO_EXPOSURE_MIN_MS) {
+		exposure = AUTO_EXPOSURE_MIN_MS;
+	}
+	if (exposure > AUTO_EXPOSURE_MAX_MS) {
+		exposure = AUTO_EXPOSURE_MAX_MS;
+	}
+
+	if (exposure == currentExposure) {
+		// Already at the limit
+		return false;
+	}
+
+	_logger->info("Exposure {0} ms -> {1} ms (high percentile: {2}, saturated: {3:.3f})", currentExposure, exposure, stats.highValue, stats.saturatedFraction);
+
+	lastChangeTime = now;
+	newExposure = exposure;
+	return true;
+}
+
+void AutoExposure::Reset() {
+	lastChangeTime = GetTickCount64();
+}
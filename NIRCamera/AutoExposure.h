@@ -0,0 +1,54 @@
+#pragma once
+
+#include "HistogramEngine.h"
+
+#include <Windows.h>
+#include "spdlog/spdlog.h"
+
+using namespace std;
+
+// Limits of the exposure time in ms (same range as the exposure slider, the imager needs at least 5 ms)
+#define AUTO_EXPOSURE_MIN_MS 5
+#define AUTO_EXPOSURE_MAX_MS 100
+// Target of the high percentile of the histogram, as a fraction of the full scale
+#define AUTO_EXPOSURE_TARGET 0.6
+// The exposure is left alone while the high percentile is within TARGET * (1 +/- HYSTERESIS)
+#define AUTO_EXPOSURE_HYSTERESIS 0.15
+// A frame with more saturated samples than this is treated as over-exposed regardless of the percentile
+#define AUTO_EXPOSURE_MAX_SATURATION 0.01
+// The largest factor by which one adjustment can change the exposure
+#define AUTO_EXPOSURE_MAX_STEP 2.0
+// Minimum time between two adjustments in ms. Reprogramming the sensor stops the frame stream for a while,
+// and the frames already in the pipeline were taken with the old exposure
+#define AUTO_EXPOSURE_INTERVAL_MS 1000
+
+/*
+AutoExposure is a closed-loop controller that keeps the bright part of the image just below saturation.
+It reads the histogram statistics of every frame and decides when and how the imager exposure is changed.
+*/
+class AutoExposure
+{
+public:
+	AutoExposure();
+	~AutoExposure();
+
+	/*
+	Feed the statistics of a frame into the controller.
+	stats: the histogram of the frame
+	frameSaturated: TRUE if the frame is dropped by the saturation detection
+	currentExposure: the exposure (ms) the imager currently uses
+	newExposure: set to the exposure (ms) that should be applied
+	Return TRUE if the exposure should be changed to newExposure
+	*/
+	bool Update(const HistogramSnapshot &stats, bool frameSaturated, int currentExposure, int &newExposure);
+
+	/*
+	Restart the rate limit, e.g. after the exposure has been changed by hand
+	*/
+	void Reset();
+
+private:
+	ULONGLONG lastChangeTime;		// GetTickCount64() of the last adjustment
+
+	std::shared_ptr<spdlog::logger> _logger;
+};
@@ -0,0 +1,242 @@
+#include "Calibrator.h"
+
+#include "opencv2/imgproc.hpp"
+#include "opencv2/cudawarping.hpp"
+
+#include <algorithm>
+
+using namespace cv;
+
+Calibrator::Calibrator(cv::Size imageSize)
+{
+	ImageSize = imageSize;
+	jobState = CALIBRATION_JOB_IDLE;
+	generation = 0;
+	_logger = spdlog::stdout_color_mt("Calibrator");
+}
+
+Calibrator::~Calibrator()
+{
+	JoinJob();
+}
+
+bool Calibrator::StartJob(const cuda::GpuMat &scaledImage) {
+	if (IsBusy()) {
+		return false;
+	}
+
+	// The previous job has finished (otherwise we are busy), join its thread before reusing it
+	JoinJob();
+
+	// Take the snapshot on the caller's thread, the GPU buffer will be overwritten by the next frame
+	Mat snapshot;
+	scaledImage.download(snapshot);
+
+	jobState = CALIBRATION_JOB_RUNNING;
+	job = thread(&Calibrator::RunJob, this, snapshot, (unsigned int)generation);
+	return true;
+}
+
+CalibrationJobResult Calibrator::CollectJob() {
+	int state = jobState;
+	if (state == CALIBRATION_JOB_SUCCEEDED || state == CALIBRATION_JOB_FAILED) {
+		// Report the result only once
+		if (jobState.compare_exchange_strong(state, CALIBRATION_JOB_IDLE)) {
+			return (CalibrationJobResult)state;
+		}
+	}
+	return (CalibrationJobResult)(int)jobState;
+}
+
+bool Calibrator::IsBusy() const {
+	return jobState == CALIBRATION_JOB_RUNNING;
+}
+
+bool Calibrator::IsCalibrated() const {
+	return Current() != NULL;
+}
+
+bool Calibrator::Restore() {
+	Mat PersTranMat;
+	if (!LoadPersTranMat(PersTranMat)) {
+		return false;
+	}
+
+	Publish(PersTranMat);
+	return true;
+}
+
+void Calibrator::Reset() {
+	lock_guard<mutex> lock(publishLock);
+	generation++;
+	atomic_store(&current, shared_ptr<const CalibrationData>());
+}
+
+void Calibrator::CancelJob() {
+	lock_guard<mutex> lock(publishLock);
+	generation++;
+}
+
+void Calibrator::Publish(const Mat &PersTranMat) {
+	shared_ptr<const CalibrationData> data = BuildCalibration(PersTranMat);
+
+	// The tracker and Restore() publish over whatever a running job would find
+	lock_guard<mutex> lock(publishLock);
+	generation++;
+	atomic_store(&current, data);
+}
+
+shared_ptr<const CalibrationData> Calibrator::BuildCalibration(const Mat &PersTranMat) {
+	shared_ptr<CalibrationData> data = make_shared<CalibrationData>();
+	PersTranMat.copyTo(data->PersTranMat);
+
+	// Same mapping as cuda::warpPerspective(src, dst, PersTranMat, size) with the default flags,
+	// so that the pipeline only needs a cuda::remap per frame
+	cuda::buildWarpPerspectiveMaps(data->PersTranMat, false, ImageSize, data->XMap, data->YMap);
+
+	return data;
+}
+
+bool Calibrator::Store(shared_ptr<const CalibrationData> data, unsigned int dataGeneration) {
+	lock_guard<mutex> lock(publishLock);
+	if (dataGeneration != generation) {
+		// Reset(), CancelJob() or Publish() was called while data was being built
+		return false;
+	}
+
+	atomic_store(&current, data);
+	return true;
+}
+
+shared_ptr<const CalibrationData> Calibrator::Current() const {
+	return atomic_load(&current);
+}
+
+void Calibrator::RunJob(Mat snapshot, unsigned int jobGeneration) {
+	Mat PersTranMat;
+	bool success = CircleDetection(snapshot, PersTranMat);
+
+	if (!success) {
+		_logger->warn("Calibration failed: cannot find the four calibration circles.");
+	}
+	else if (Store(BuildCalibration(PersTranMat), jobGeneration)) {
+		// Only a calibration that has been taken over is saved, not one that has been reset or replaced meanwhile
+		SavePersTranMat(PersTranMat);	// Save new perspective transformation matrix into file
+		_logger->info("Calibration complete.");
+	}
+	else {
+		_logger->info("Calibration discarded: the calibration was reset or replaced while it was running.");
+	}
+
+	jobState = success ? CALIBRATION_JOB_SUCCEEDED : CALIBRATION_JOB_FAILED;
+}
+
+void Calibrator::JoinJob() {
+	if (job.joinable()) {
+		job.join();
+	}
+}
+
+/*
+Save the perspective transformation matrix into a file
+*/
+void Calibrator::SavePersTranMat(const Mat &PersTranMat) {
+	FileStorage file("calibrationMat.xml", cv::FileStorage::WRITE);
+
+	// Write to file!
+	file << "PersTransMat" << PersTranMat;
+	file.release();
+}
+
+/*
+Load the perspective transformation matrix from a file
+*/
+bool Calibrator::LoadPersTranMat(Mat &PersTranMat) {
+	FileStorage file;
+	if (file.open("calibrationMat.xml", cv::FileStorage::READ)) {
+		file["PersTransMat"] >> PersTranMat;
+		file.release();
+		return TRUE;
+	}
+	else {
+		return FALSE;
+	}
+}
+
+/*
+Comparator for Circle Detection
+*/
+static bool SortbyXaxis(const Point2f &a, const Point2f &b)
+{
+	return a.x < b.x;
+}
+
+/*
+Perform dectection on the four calibration circles in the image
+Return TRUE if calibration success, FALSE otherwise
+*/
+bool Calibrator::CircleDetection(const Mat &SrcGray, Mat &PersTransMat) {
+	if (SrcGray.empty()) {
+		PersTransMat = Mat::eye(3, 3, CV_64FC1);
+		return false;
+	}
+
+	// Blur the image in order to reduce the noice from original image
+	Mat BlurredDisplay;
+	blur(SrcGray, BlurredDisplay, cv::Size(10, 10));	// blur matrix (10,10) is picked by experiments
+
+	// thresh == 200 is picked by experiments
+	int thresh = 200;
+	const double MAX_BINARY_VALUE = 255;
+	Mat ThresholdDisplay;
+
+	// Perform type 0 threshold (Binary threshold)
+	threshold(BlurredDisplay, ThresholdDisplay, thresh, MAX_BINARY_VALUE, 0);
+
+	// Edge detection with canny
+	Mat CannyOutput;
+	Canny(ThresholdDisplay, CannyOutput, thresh, thresh * 3, 3);	// threshold1 = thresh; threshold2 = thresh * 3 are picked by experiments
+
+	// Find contours
+	std::vector<std::vector<cv::Point>> contours;
+	std::vector<cv::Vec4i> hierarchy;
+	findContours(CannyOutput, contours, hierarchy, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE, Point(0, 0));
+
+	// If the detected contour points are less than 4, then this detection is invalid. Return Identity matrix
+	if (contours.size() < 4) {
+		PersTransMat = Mat::eye(3, 3, CV_64FC1);
+		return false;
+	}
+
+	std::vector<Moments> mu(contours.size());
+	for (int i = 0; i < contours.size(); i++) {
+		mu[i] = moments(contours[i], false);
+	}
+
+	// Find the mass centers of each circle (point); Note the getPerspectiveTransform accept Point2f but not Point2d
+	std::vector<Point2f> mc(contours.size());
+	for (int i = 0; i < contours.size(); i++) {
+		mc[i] = Point2f(float(mu[i].m10 / mu[i].m00), float(mu[i].m01 / mu[i].m00));
+	}
+
+	PersTransMat = MarkersToPerspective(mc);
+
+	return true;
+}
+
+Mat Calibrator::MarkersToPerspective(const std::vector<Point2f> &markers) const {
+	std::vector<Point2f> OrigCoordiate(markers.begin(), next(markers.begin(), 4));
+	std::sort(OrigCoordiate.begin(), OrigCoordiate.end(), SortbyXaxis);
+
+	// Generate Perspective adjusted image
+	float width = (float)ImageSize.width;
+	float height = (float)ImageSize.height;
+	std::vector<Point2f> AdjustCoordiate(4);
+	AdjustCoordiate[0] = Point2f(0, height);
+	AdjustCoordiate[1] = Point2f((float)(ImageSize.width / 4), 0);
+	AdjustCoordiate[2] = Point2f((float)(ImageSize.width / 4 * 3), 0);
+	AdjustCoordiate[3] = Point2f(width, height);
+
+	// Calculate the transformation matrix
+	return getPerspectiveTransform(OrigCoordiate, AdjustCoordiate);
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+#include "opencv2/core/cuda.hpp"
+#include "spdlog/spdlog.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+/*
+A perspective calibration that has been published to the processing pipeline.
+Once published it is never modified, so the pipeline can keep using it while a new one is being built.
+*/
+class CalibrationData {
+public:
+	cv::Mat PersTranMat;			// Perspective Transformation Matrix
+	cv::cuda::GpuMat XMap;			// Remap tables built from PersTranMat (CV_32FC1, one entry per output pixel)
+	cv::cuda::GpuMat YMap;
+};
+
+// The outcome of a background calibration job
+enum CalibrationJobResult {
+	CALIBRATION_JOB_IDLE = 0,		// No job is running and there is no result to collect
+	CALIBRATION_JOB_RUNNING = 1,
+	CALIBRATION_JOB_SUCCEEDED = 2,
+	CALIBRATION_JOB_FAILED = 3,
+};
+
+/*
+Calibrator runs the circle detection off the processing thread.
+The processing thread hands over a snapshot of the scaled image, keeps streaming, and picks up the new
+calibration through Current() once the background job has swapped it in.
+*/
+class Calibrator
+{
+public:
+	/*
+	imageSize: the size of the image that will be calibrated
+	*/
+	Calibrator(cv::Size imageSize);
+	~Calibrator();
+
+	/*
+	Take a snapshot of scaledImage and start a circle detection on it in the background.
+	Return FALSE if a job is already running.
+	*/
+	bool StartJob(const cv::cuda::GpuMat &scaledImage);
+
+	/*
+	Report the state of the background job. A finished job (SUCCEEDED or FAILED) is reported only once,
+	after that CollectJob() returns CALIBRATION_JOB_IDLE until the next job is started.
+	*/
+	CalibrationJobResult CollectJob();
+
+	bool IsBusy() const;
+
+	/*
+	Return TRUE if a calibration is currently published
+	*/
+	bool IsCalibrated() const;
+
+	/*
+	Load the perspective transformation matrix from file and publish it.
+	Return FALSE if the file cannot be loaded.
+	*/
+	bool Restore();
+
+	/*
+	Drop the published calibration. A job that is still running will not publish its result.
+	*/
+	void Reset();
+
+	/*
+	Keep the published calibration, but a job that is still running will not publish (or save) its result
+	*/
+	void CancelJob();
+
+	/*
+	Build the remap tables for PersTranMat and swap the new calibration in atomically.
+	It supersedes a job that is still running, the job will not publish (or save) its result.
+	*/
+	void Publish(const cv::Mat &PersTranMat);
+
+	/*
+	Compute the perspective transformation that maps the four calibration markers to the corners of the
+	adjusted image. markers must contain (at least) four points; only the first four are used.
+	*/
+	cv::Mat MarkersToPerspective(const std::vector<cv::Point2f> &markers) const;
+
+	/*
+	Get the calibration currently in use. NULL means the image is not calibrated.
+	*/
+	shared_ptr<const CalibrationData> Current() const;
+
+private:
+	cv::Size ImageSize;
+
+	shared_ptr<const CalibrationData> current;		// Only accessed by atomic_load/atomic_store
+
+	thread job;
+	atomic<int> jobState;
+	atomic<unsigned int> generation;				// Incremented by Reset(), CancelJob() and Publish() so that a stale job cannot publish
+	mutex publishLock;								// Serializes Store(), Publish(), CancelJob() and Reset()
+
+	std::shared_ptr<spdlog::logger> _logger;
+
+	// Job function running on the background thread
+	void RunJob(cv::Mat snapshot, unsigned int jobGeneration);
+
+	// Wait for the previous job thread (if any)
+	void JoinJob();
+
+	shared_ptr<const CalibrationData> BuildCalibration(const cv::Mat &PersTranMat);
+
+	// Swap data in unless the calibration has been reset or replaced since dataGeneration. Return TRUE if data is published.
+	bool Store(shared_ptr<const CalibrationData> data, unsigned int dataGeneration);
+
+	bool CircleDetection(const cv::Mat &SrcGray, cv::Mat &PersTransMat);
+
+	static void SavePersTranMat(const cv::Mat &PersTranMat);
+	static bool LoadPersTranMat(cv::Mat &PersTranMat);
+};
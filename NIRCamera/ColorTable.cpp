@@ -0,0 +1,31 @@
+#include "ColorTable.h"
+
+ColorTable::ColorTable(int colormap)
+{
+	SetColormap(colormap);
+}
+
+void ColorTable::SetColormap(int colormap) {
+	// Run the colormap once over all the 256 values
+	cv::Mat ramp(1, 256, CV_8UC1);
+	for (int i = 0; i < 256; i++) {
+		ramp.at<UINT8>(0, i) = (UINT8)i;
+	}
+	cv::Mat colors;
+	cv::applyColorMap(ramp, colors, colormap);
+
+	for (int i = 0; i < 256; i++) {
+		cv::Vec3b bgr = colors.at<cv::Vec3b>(0, i);
+		entries[i] = (UINT32)bgr[0] | ((UINT32)bgr[1] << 8) | ((UINT32)bgr[2] << 16);
+	}
+	entries[0] = 0;
+	Colormap = colormap;
+}
+
+int ColorTable::GetColormap() const {
+	return Colormap;
+}
+
+const UINT32 *ColorTable::Entries() const {
+	return entries;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "opencv2/imgproc.hpp"
+
+using namespace std;
+
+/*
+A 256 entry lookup table from 8 bit values to the BGR colors of an OpenCV colormap (COLORMAP_JET, ...),
+for ColorizeRows(). Every entry holds B, G, R in its low 3 bytes (4th byte 0), so that a pixel is one 4 byte load.
+Entry 0 is black: 0 is what the threshold leaves of the background, and it stays black on the display.
+
+applyColorMap() is a 256 entry lookup itself, so the colors are the same as the ones of applyColorMap()
+for every value but 0.
+*/
+class ColorTable
+{
+public:
+	ColorTable(int colormap = cv::COLORMAP_JET);
+
+	// Switch to another OpenCV colormap
+	void SetColormap(int colormap);
+	int GetColormap() const;
+
+	const UINT32 *Entries() const;
+
+private:
+	int Colormap;
+	UINT32 entries[256];
+};
@@ -21,6 +21,12 @@ This .h file contains common functions for the following feature
 
 // List of command
 #define COMM_STREAM "STREAM"
+#define COMM_STREAM_IN_FLIGHT "IN_FLIGHT="		// Option of the STREAM requests, e.g. "STREAM FRAMED IN_FLIGHT=3\n"
+#define COMM_STREAM_INDEXED "STREAM INDEXED"		// 1 byte per pixel, the client colors the pixels with the palette
+#define COMM_MSG_PALETTE 'P'		// STREAM INDEXED message: 'P' and the 256 colors (GB, AR bytes) of the pixel values
+#define COMM_MSG_FRAME 'F'			// STREAM INDEXED message: 'F' and the pixel values of a frame
+#define COMM_PALETTE_LEN 512		// 256 colors of 2 bytes
+#define COMM_STREAM_FRAMED "STREAM FRAMED"			// As STREAM, every frame starts with a StreamFrameHeader
 #define COMM_GET_XRAY_TOTALNUM "GET XRAY TOTALNUM"
 #define COMM_GET_XRAY "GET XRAY"
 #define COMM_EOF	"\n" 
@@ -29,10 +35,29 @@ This .h file contains common functions for the following feature
 #define COMM_INDEX_LEN sizeof(int)		// sizeof(int) == 4 bytes
 #define COMM_ERR_INVALID_INDEX "The required index is not available."
 
+// The header of every frame of STREAM FRAMED, followed by length bytes of HOLO16 pixels (width x height x 2).
+// All fields little endian, the times are microseconds of the same server clock.
+#pragma pack(push, 1)
+struct StreamFrameHeader {
+	UINT32 length;			// Bytes of pixels after the header
+	UINT16 width;
+	UINT16 height;
+	UINT64 sequence;		// Number of the frame since the camera started, a gap means frames that were not sent to this client
+	UINT64 captureTime;		// When the frame was read from the sensor
+	UINT64 sendTime;		// When the server issued the send of the frame
+};
+#pragma pack(pop)
+
+// Frames a STREAM connection may have in flight (sent but not completed), more frames keep the link busy, fewer keep the latency low.
+// Every client picks its own with the IN_FLIGHT= option of its STREAM request (1 to STREAM_MAX_FRAMES_IN_FLIGHT), the default otherwise
+#define STREAM_FRAMES_IN_FLIGHT 2
+#define STREAM_MAX_FRAMES_IN_FLIGHT 4
+
 // Completion Key for the IOCPs
 enum COMPLETION_KEY {
 	COMPLETION_KEY_IO = 0,
 	COMPLETION_KEY_SHUTDOWN = 1,
+	COMPLETION_KEY_WAKE = 2,		// A new frame is published for a parked STREAM connection (the overlapped pointer)
 };
 
 void PRINT_WSAERROR(char *msg);
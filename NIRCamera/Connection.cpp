@@ -1,8 +1,26 @@
 #include "Connection.h"
 
-Connection::Connection(SOCKET Listener, HANDLE IoPort, int Conn_ID) {	
+/*
+QueryPerformanceCounter ticks in microseconds, without overflowing for large tick counts
+*/
+static UINT64 TicksToMicroseconds(INT64 ticks, INT64 ticksPerSecond) {
+	return UINT64(ticks / ticksPerSecond * 1000000 + ticks % ticksPerSecond * 1000000 / ticksPerSecond);
+}
+
+void StreamSource::Publish(const StreamFrame &frame) {
+	lock_guard<mutex> guard(lock);
+	latest = frame;
+}
+
+StreamFrame StreamSource::Latest() {
+	lock_guard<mutex> guard(lock);
+	return latest;
+}
+
+Connection::Connection(SOCKET Listener, HANDLE IoPort, int Conn_ID, StreamSource *Source) {	
 	// Assign Conn_ID to this instance
 	Connection_ID = Conn_ID;
+	ioType = IO_CONNECTION;
 
 	// Clean up all the buffers
 	cleanBuffers();
@@ -11,8 +29,37 @@ Connection::Connection(SOCKET Listener, HANDLE IoPort, int Conn_ID) {
 	buffer = new string();
 	Buffer_wsa.len = 0;
 	Buffer_wsa.buf = NULL;
+	responsePayload.len = 0;
+	responsePayload.buf = NULL;
+	responseBufCount = 0;
 	total_read_len = 0;
 	command = NULL;
+	sentPalette = NULL;
+
+	// Set up streaming
+	source = Source;
+	for (int i = 0; i < STREAM_MAX_FRAMES_IN_FLIGHT; i++) {
+		sends[i].ioType = IO_STREAM_SEND;
+		sends[i].owner = this;
+		sends[i].bufCount = 0;
+		sends[i].pending = false;
+	}
+	sendsPending = 0;
+	streamRecv.ioType = IO_STREAM_RECV;
+	streamRecv.owner = this;
+	streamRecv.buf.len = 0;
+	streamRecv.buf.buf = NULL;
+	streamRecv.flags = 0;
+	streamRecv.pending = false;
+	maxFramesInFlight = STREAM_FRAMES_IN_FLIGHT;
+	lastSentSequence = 0;
+	sentAnyFrame = FALSE;
+	waitingForFrame = FALSE;
+	streamTags[0] = COMM_MSG_PALETTE;
+	streamTags[1] = COMM_MSG_FRAME;
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	ticksPerSecond = frequency.QuadPart;
 
 	// AcceptEx requires the the client socket must be created beforehand.
 	// This minor annoyance can help server handle many short-lived connections. 
@@ -99,7 +146,7 @@ void Connection::IssueReadRequest() {
 /*
 Complete the Read Request
 */
-void Connection::CompleteReadRequest(WSABUF DataToSend) {
+void Connection::CompleteReadRequest() {
 	// Get the total number of bytes read from this I/O
 	DWORD cbTransfer = 0;
 	DWORD dwFlags = 0;
@@ -130,20 +177,30 @@ void Connection::CompleteReadRequest(WSABUF DataToSend) {
 
 	// Because TCP protocol will gaurantee the message from client is comprehensive,
 	// we here can just assume that client complete sending the request (or reach the MAX_HEADER_LEN)
-	IssueSendData(DataToSend);
+	if (IsStreamCommand()) {
+		// Send the latest frame, then every new one. The receive tells when the client goes
+		state = STREAMING;
+		cleanBuffers();
+		IssueStreamRecv();
+		if (state == STREAMING) {
+			IssueStreamSend();
+		}
+	}
+	else {
+		IssueSendData();
+	}
 }
 
-void Connection::IssueSendData(WSABUF DataToSend) {
+void Connection::IssueSendData() {
 	// You can consider using stringstream if the data you send include non-char data like int or other stuffs
 	state = WAIT_SENDDATA;
 	cleanBuffers();
 
-	// Build the sending message (Remember to free the buffer after use)
-	Buffer_wsa = BuildResponseMsg(DataToSend);
-	DWORD BufferCount = 1;
+	// Build the sending message (Remember to free the payload after use)
+	BuildResponseMsg();
 	DWORD Flag = 0;
 
-	int err = WSASend(myClientSocket, &Buffer_wsa, BufferCount, NULL, Flag, this, NULL);
+	int err = WSASend(myClientSocket, responseBufs, responseBufCount, NULL, Flag, this, NULL);
 	if (err == SOCKET_ERROR) {
 		if (WSAGetLastError() != WSA_IO_PENDING) {
 			PRINT_WSAERROR("WSASend error");
@@ -152,24 +209,165 @@ void Connection::IssueSendData(WSABUF DataToSend) {
 	}
 }
 
-void Connection::CompleteSendData(WSABUF DataToSend) {
+void Connection::CompleteSendData() {
 	// Delete the local send buffer
-	delete[] Buffer_wsa.buf;
-	Buffer_wsa.len = 0;
-	Buffer_wsa.buf = NULL;
+	delete[] responsePayload.buf;
+	responsePayload.len = 0;
+	responsePayload.buf = NULL;
+	responseBufCount = 0;
+
+	// The response is complete
+	IssueReset();
+}
 
-	if (command == COMM_STREAM) {
-		// Keep sending stream data to client
-		IssueSendData(DataToSend);
+/*
+Send the latest frame of the source if it is newer than the last one sent and less than
+maxFramesInFlight frames are pending. If it is not newer, park until the next frame is published.
+*/
+void Connection::IssueStreamSend() {
+	if (sendsPending >= maxFramesInFlight) {
+		// The next completing send issues the frame
+		return;
 	}
-	else {
-		IssueReset();
+
+	StreamFrame latest = source->Latest();
+	const FrameRef &data = command == COMM_STREAM_INDEXED ? latest.indexed : latest.holo16;
+	if (data.empty() || (sentAnyFrame && data->sequence == lastSentSequence)) {
+		waitingForFrame = TRUE;
+		return;
+	}
+
+	StreamSend *send = NULL;
+	for (int i = 0; i < STREAM_MAX_FRAMES_IN_FLIGHT && send == NULL; i++) {
+		if (!sends[i].pending) {
+			send = &sends[i];
+		}
+	}
+
+	BuildStreamMsg(send, latest);
+	lastSentSequence = data->sequence;
+	sentAnyFrame = TRUE;
+	send->pending = true;
+	sendsPending++;
+
+	ZeroMemory(static_cast<OVERLAPPED*>(send), sizeof(OVERLAPPED));
+	int err = WSASend(myClientSocket, send->bufs, send->bufCount, NULL, 0, send, NULL);
+	if (err == SOCKET_ERROR) {
+		if (WSAGetLastError() != WSA_IO_PENDING) {
+			PRINT_WSAERROR("WSASend error");
+			// This send will not complete
+			send->pending = false;
+			send->frame = StreamFrame();
+			sendsPending--;
+			IssueReset();
+		}
+	}
+}
+
+void Connection::CompleteStreamSend(StreamSend *send, BOOL succeeded) {
+	// The frames go back to the pool when the last send of them is done
+	send->pending = false;
+	send->bufCount = 0;
+	send->frame = StreamFrame();
+	sendsPending--;
+
+	if (state == STREAMING) {
+		if (succeeded) {
+			IssueStreamSend();
+		}
+		else {
+			PRINT_WSAERROR("Stream send failed with error");
+			IssueReset();
+		}
+	}
+	else if (state == WAIT_STREAMSENDS) {
+		AcceptAfterStreamIo();
+	}
+}
+
+/*
+Issue the zero-byte receive of a STREAM connection. It holds no buffer while it is pending
+*/
+void Connection::IssueStreamRecv() {
+	streamRecv.buf.len = 0;
+	streamRecv.buf.buf = NULL;
+	streamRecv.flags = 0;
+	streamRecv.pending = true;
+
+	ZeroMemory(static_cast<OVERLAPPED*>(&streamRecv), sizeof(OVERLAPPED));
+	int err = WSARecv(myClientSocket, &streamRecv.buf, 1, NULL, &streamRecv.flags, &streamRecv, NULL);
+	if (err == SOCKET_ERROR) {
+		if (WSAGetLastError() != WSA_IO_PENDING) {
+			PRINT_WSAERROR("WSARecv error");
+			// This receive will not complete
+			streamRecv.pending = false;
+			IssueReset();
+		}
+	}
+}
+
+void Connection::CompleteStreamRecv(BOOL succeeded) {
+	streamRecv.pending = false;
+
+	if (state == STREAMING) {
+		if (!succeeded) {
+			PRINT_WSAERROR("Stream receive failed with error");
+			IssueReset();
+			return;
+		}
+
+		// A zero-byte receive completes with no data either way: nothing to read means the client closed
+		u_long available = 0;
+		if (ioctlsocket(myClientSocket, FIONREAD, &available) == SOCKET_ERROR || available == 0) {
+			printConnectionID();
+			printf("Client[%s] disconnected\n", clientIP.c_str());
+			IssueReset();
+			return;
+		}
+
+		// A STREAM client has nothing more to say, drop what it sent (it is buffered, recv does not block)
+		while (available > 0) {
+			int len = recv(myClientSocket, tempReadBuffer, available < READ_BUFFER_LEN ? int(available) : READ_BUFFER_LEN, 0);
+			if (len <= 0) {
+				IssueReset();
+				return;
+			}
+			available -= len;
+		}
+		IssueStreamRecv();
+	}
+	else if (state == WAIT_STREAMSENDS) {
+		AcceptAfterStreamIo();
+	}
+}
+BOOL Connection::IsClientConnected() const {
+	// Called by the pipeline threads (HoloNetwork::GetClientCount) while the workers change the state
+	lock_guard<mutex> guard(lock);
+	return state == WAIT_READREQUEST || state == WAIT_SENDDATA || state == STREAMING;
+}
+
+StreamFormat Connection::GetStreamFormat() const {
+	lock_guard<mutex> guard(lock);
+	if (state != STREAMING) {
+		return STREAM_FORMAT_NONE;
 	}
+	if (command == COMM_STREAM || command == COMM_STREAM_FRAMED) {
+		return STREAM_FORMAT_HOLO16;
+	}
+	if (command == COMM_STREAM_INDEXED) {
+		return STREAM_FORMAT_INDEXED;
+	}
+	return STREAM_FORMAT_NONE;
 }
 
 void Connection::IssueReset() {
 	state = WAIT_RESET;
 
+	// The disconnect does not complete the receive by itself
+	if (streamRecv.pending) {
+		CancelIoEx(reinterpret_cast<HANDLE>(myClientSocket), &streamRecv);
+	}
+
 	// Disconnect the client socket and mark it as reuse for the new connection
 	TransmitFile(myClientSocket, 0, 0, 0, this, 0,
 		TF_DISCONNECT | TF_REUSE_SOCKET);
@@ -187,6 +385,22 @@ void Connection::CompleteReset() {
 
 	// Clean up client profile
 	command = NULL;
+	sentPalette = NULL;
+	sentAnyFrame = FALSE;
+	waitingForFrame = FALSE;
+	maxFramesInFlight = STREAM_FRAMES_IN_FLIGHT;
+
+	// A response that failed does not complete in CompleteSendData
+	delete[] responsePayload.buf;
+	responsePayload.len = 0;
+	responsePayload.buf = NULL;
+	responseBufCount = 0;
+
+	if (sendsPending > 0 || streamRecv.pending) {
+		// The socket is reused by the next accept, the last StreamSend (or the StreamRecv) to complete issues it
+		state = WAIT_STREAMSENDS;
+		return;
+	}
 
 	IssueAccept();
 
@@ -197,10 +411,10 @@ void Connection::CompleteReset() {
 The main handler for this specific connection
 Will be called by the worker thread when the iocp tells the thread that
 this connection's I/O operation is compelte
-
-This function must make a deep copy of the DataToSend
 */
-void Connection::OnIoComplete(WSABUF DataToSend) {
+void Connection::OnIoComplete() {
+	lock_guard<mutex> guard(lock);
+
 	switch (state)
 	{
 	case WAIT_ACCEPT:
@@ -208,11 +422,11 @@ void Connection::OnIoComplete(WSABUF DataToSend) {
 		break;
 
 	case WAIT_READREQUEST:
-		CompleteReadRequest(DataToSend);
+		CompleteReadRequest();
 		break;
 
 	case WAIT_SENDDATA:
-		CompleteSendData(DataToSend);
+		CompleteSendData();
 		break;
 
 	case WAIT_RESET:
@@ -221,6 +435,37 @@ void Connection::OnIoComplete(WSABUF DataToSend) {
 	}
 }
 
+void Connection::OnIoFailed() {
+	lock_guard<mutex> guard(lock);
+	IssueReset();
+}
+
+void Connection::OnStreamSendComplete(StreamSend *send, BOOL succeeded) {
+	lock_guard<mutex> guard(lock);
+	CompleteStreamSend(send, succeeded);
+}
+
+BOOL Connection::NeedsWake() {
+	lock_guard<mutex> guard(lock);
+	if (!waitingForFrame) {
+		return FALSE;
+	}
+	waitingForFrame = FALSE;
+	return TRUE;
+}
+
+void Connection::OnWake() {
+	lock_guard<mutex> guard(lock);
+	if (state == STREAMING) {
+		IssueStreamSend();
+	}
+}
+
+void Connection::OnStreamRecvComplete(BOOL succeeded) {
+	lock_guard<mutex> guard(lock);
+	CompleteStreamRecv(succeeded);
+}
+
 // ---------- Helper Functions ----------
 
 /*
@@ -237,14 +482,11 @@ BOOL Connection::parseHeader(string *buf) {
 
 	string refStr;
 
-	// Check if the command is STREAM
-	refStr.clear();
-	refStr += COMM_STREAM;
-	refStr += COMM_EOF;
-
-	if (buf->length() >= refStr.length() &&
-		buf->compare(0, refStr.length(), refStr.c_str()) == 0) {
-		command = COMM_STREAM;
+	// Check if the command is STREAM INDEXED, STREAM FRAMED or STREAM (the longer names first)
+	// Valid request: "STREAM INDEXED\n" or "STREAM INDEXED IN_FLIGHT=[frames]\n", frames from 1 to STREAM_MAX_FRAMES_IN_FLIGHT
+	if (parseStreamHeader(buf, COMM_STREAM_INDEXED) ||
+		parseStreamHeader(buf, COMM_STREAM_FRAMED) ||
+		parseStreamHeader(buf, COMM_STREAM)) {
 		return TRUE;
 	}
 
@@ -284,41 +526,69 @@ BOOL Connection::parseHeader(string *buf) {
 	return FALSE;
 }
 
+/*
+Check whether buf is the STREAM request name, followed by COMM_EOF or by " IN_FLIGHT=[frames]" and COMM_EOF.
+If it is, the command and the frames in flight of the connection are set
+*/
+BOOL Connection::parseStreamHeader(string *buf, const char *name) {
+	size_t nameLen = strlen(name);
+	size_t end = buf->find(COMM_EOF);
+	if (end == string::npos || end < nameLen || buf->compare(0, nameLen, name) != 0) {
+		return FALSE;
+	}
+
+	int frames = STREAM_FRAMES_IN_FLIGHT;
+	if (end > nameLen) {
+		string option = string(" ") + COMM_STREAM_IN_FLIGHT;
+		if (end - nameLen <= option.length() || buf->compare(nameLen, option.length(), option) != 0) {
+			return FALSE;
+		}
+		string value = buf->substr(nameLen + option.length(), end - nameLen - option.length());
+		char *last = NULL;
+		long parsed = strtol(value.c_str(), &last, 10);
+		if (*last != '\0' || parsed < 1 || parsed > STREAM_MAX_FRAMES_IN_FLIGHT) {
+			return FALSE;
+		}
+		frames = int(parsed);
+	}
+
+	command = (char*)name;
+	maxFramesInFlight = frames;
+	return TRUE;
+}
+
+BOOL Connection::IsStreamCommand() const {
+	return command == COMM_STREAM || command == COMM_STREAM_INDEXED || command == COMM_STREAM_FRAMED;
+}
+
+void Connection::AcceptAfterStreamIo() {
+	if (sendsPending > 0 || streamRecv.pending) {
+		return;
+	}
+
+	IssueAccept();
+	printf("========Connection %d Over========\n", Connection_ID);
+}
+
 /*
 This function will build up the response message server send to client.
 If the client request is invalid, it will generate error message.
 If the client request is valid, it will generate ok message with appropriate data client wants
 
-Input
-	string *buf: a string pointer will the message will be stored
+The message is sent as responseBufs in one gather send: the header in responseHeader and the
+data (if any) in responsePayload, so the data is not copied into the message
 */
-WSABUF Connection::BuildResponseMsg(WSABUF input) {
+void Connection::BuildResponseMsg() {
 	// Use buf to hold the header message
-	string buf;
-	WSABUF msg;
+	string &buf = responseHeader;
+	buf.clear();
+	responsePayload.len = 0;
+	responsePayload.buf = NULL;
 
 	if (command == NULL) {
 		// Invalid client request, send error info
 		buf += COMM_ERROR;
 		buf += COMM_EOF;
-
-		char *result = new char[buf.length()];
-		for (int i = 0; i < buf.length(); i++) {
-			result[i] = buf[i];
-		}
-
-		msg.len = ULONG(buf.length());
-		msg.buf = (CHAR*)result;
-	}
-	else if (command == COMM_STREAM) {
-		// For STREAM, don't send the header OK\n
-		char *result = new char[input.len];
-		for (int i = 0; i < int(input.len); i++) {
-			result[i] = input.buf[i];
-		}
-
-		msg.len = ULONG(input.len);
-		msg.buf = (CHAR*)result;
 	}
 	else if (command == COMM_GET_XRAY_TOTALNUM) {
 		// Valid request
@@ -331,15 +601,6 @@ WSABUF Connection::BuildResponseMsg(WSABUF input) {
 		buf.append((char*)&totalNum, sizeof(int));
 
 		buf += COMM_EOF;
-
-		// Copy data into result
-		char *result = new char[buf.length()];
-		for (int i = 0; i < buf.length(); i++) {
-			result[i] = buf[i];
-		}
-		
-		msg.len = ULONG(buf.length());
-		msg.buf = (CHAR*)result;
 	}
 	else if (command == COMM_GET_XRAY) {
 		// Check if the required idx is valid
@@ -354,6 +615,9 @@ WSABUF Connection::BuildResponseMsg(WSABUF input) {
 			buf += COMM_EOF;
 			buf += COMM_ERR_INVALID_INDEX;
 			buf += COMM_EOF;
+
+			// An empty image
+			delete[] imgData.buf;
 		}
 		else {
 			// Valid request
@@ -362,45 +626,79 @@ WSABUF Connection::BuildResponseMsg(WSABUF input) {
 			buf += COMM_EOF;
 			// Append the ULONG into the buf
 			buf.append((char*)&fileSize, sizeof(fileSize));
-		}
 
-		// Copy data into result
-		char *result = new char[buf.length() + fileSize];
-		for (int i = 0; i < buf.length(); i++) {
-			result[i] = buf[i];
-		}
-		int offset = buf.length();
-		for (int i = 0; i < int(imgData.len); i++) {
-			result[i + offset] = imgData.buf[i];
+			// The image is sent from where it was read, it is deleted when the send completes
+			responsePayload = imgData;
 		}
-
-		msg.len = ULONG(buf.length() + fileSize);
-		msg.buf = (CHAR*)result;
-
-		// Delete the XRay image
-		delete[] imgData.buf;
-		imgData.buf = NULL;
-		imgData.len = 0;
 	}
 	else {
 		// Valid request
 		buf += COMM_OK;
 		buf += COMM_EOF;
+	}
 
-		char *result = new char[buf.length() + input.len];
+	responseBufs[0].len = ULONG(buf.length());
+	responseBufs[0].buf = (CHAR*)buf.data();
+	responseBufCount = 1;
+	if (responsePayload.len > 0) {
+		responseBufs[1] = responsePayload;
+		responseBufCount = 2;
+	}
+}
 
-		for (int i = 0; i < buf.length(); i++) {
-			result[i] = buf[i];
-		}
-		for (int i = 0; i < int(input.len); i++) {
-			result[i + buf.length()] = input.buf[i];
+/*
+Point the buffers of send at the data of frame for the STREAM formats, without the header OK\n.
+Nothing is copied: send keeps frame until it completes, and no one writes a frame once it is published.
+The caller checked that frame has the format of the connection.
+STREAM: the HOLO16 pixels
+STREAM FRAMED: the StreamFrameHeader and the HOLO16 pixels
+STREAM INDEXED: 'P' and the palette (only when it changed since the last send), 'F' and the values
+*/
+void Connection::BuildStreamMsg(StreamSend *send, const StreamFrame &frame) {
+	send->frame = frame;
+	send->bufCount = 0;
+
+	if (command == COMM_STREAM_FRAMED) {
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+
+		StreamFrameHeader &header = send->header;
+		header.length = UINT32(frame.holo16->Size());
+		header.width = UINT16(frame.holo16->width);
+		header.height = UINT16(frame.holo16->height);
+		header.sequence = frame.holo16->sequence;
+		header.captureTime = TicksToMicroseconds(frame.holo16->captureTime, ticksPerSecond);
+		header.sendTime = TicksToMicroseconds(now.QuadPart, ticksPerSecond);
+
+		send->bufs[send->bufCount].len = sizeof(header);
+		send->bufs[send->bufCount].buf = (CHAR*)&header;
+		send->bufCount++;
+		send->bufs[send->bufCount].len = header.length;
+		send->bufs[send->bufCount].buf = frame.holo16->Ptr<CHAR>();
+		send->bufCount++;
+	}
+	else if (command == COMM_STREAM) {
+		send->bufs[send->bufCount].len = ULONG(frame.holo16->Size());
+		send->bufs[send->bufCount].buf = frame.holo16->Ptr<CHAR>();
+		send->bufCount++;
+	}
+	else {
+		if (frame.palette != sentPalette) {
+			send->bufs[send->bufCount].len = 1;
+			send->bufs[send->bufCount].buf = &streamTags[0];
+			send->bufCount++;
+			send->bufs[send->bufCount].len = COMM_PALETTE_LEN;
+			send->bufs[send->bufCount].buf = (CHAR*)frame.palette;
+			send->bufCount++;
+			sentPalette = frame.palette;
 		}
-
-		msg.len = ULONG(buf.length() + input.len);
-		msg.buf = (CHAR*)result;
+		send->bufs[send->bufCount].len = 1;
+		send->bufs[send->bufCount].buf = &streamTags[1];
+		send->bufCount++;
+		send->bufs[send->bufCount].len = ULONG(frame.indexed->Size());
+		send->bufs[send->bufCount].buf = frame.indexed->Ptr<CHAR>();
+		send->bufCount++;
 	}
-
-	return msg;
 }
 
 /*
@@ -9,12 +9,94 @@
 #include <vector>
 #include <assert.h>
 #include <string>
+#include <mutex>
 #include "Common.h"
+#include "Frame.h"
 #include "XRayManager.h"
 
 using namespace std;
 
-class Connection : public OVERLAPPED {
+// The format a connection streams in
+enum StreamFormat {
+	STREAM_FORMAT_NONE = 0,		// Not streaming (yet)
+	STREAM_FORMAT_HOLO16 = 1,	// COMM_STREAM and COMM_STREAM_FRAMED: 2 bytes per pixel
+	STREAM_FORMAT_INDEXED = 2,	// COMM_STREAM_INDEXED: 1 byte per pixel and a palette
+};
+
+/*
+What the workers send to the streaming clients: the latest frame in every format a client asked for.
+The formats no client streams in are empty.
+*/
+class StreamFrame {
+public:
+	FrameRef holo16;			// FRAME_FORMAT_HOLO16
+	FrameRef indexed;			// FRAME_FORMAT_GRAY8, the values before the color encoding
+	const UINT16 *palette;		// The colors of the indexed values, a row of the HoloColorTable (static, never freed)
+
+	StreamFrame() { palette = NULL; }
+
+	bool empty() const { return holo16.empty() && indexed.empty(); }
+};
+
+/*
+The latest published frames, the streaming connections send from it
+*/
+class StreamSource {
+public:
+	void Publish(const StreamFrame &frame);
+	StreamFrame Latest();
+
+private:
+	mutex lock;
+	StreamFrame latest;
+};
+
+class Connection;
+
+/*
+The OVERLAPPED of the I/O of a connection. The worker thread tells by ioType what completed.
+*/
+class ConnectionIo : public OVERLAPPED {
+public:
+	enum IoType {
+		IO_CONNECTION = 0,		// Accept, request, response or reset of the Connection itself
+		IO_STREAM_SEND = 1,		// A StreamSend
+		IO_STREAM_RECV = 2,		// The StreamRecv
+	};
+	IoType ioType;
+};
+
+/*
+One frame a STREAM connection is sending. A connection has up to its frames in flight of them pending.
+*/
+class StreamSend : public ConnectionIo {
+public:
+	enum {
+		MAX_BUFS = 4,			// 'P', palette, 'F', frame of STREAM INDEXED
+	};
+
+	Connection *owner;
+	WSABUF bufs[MAX_BUFS];
+	DWORD bufCount;
+	StreamFrameHeader header;	// The header of STREAM FRAMED
+	StreamFrame frame;			// The frames the send reads from (shared with the workers, not copied)
+	bool pending;
+};
+
+/*
+The zero-byte receive a STREAM connection keeps outstanding. A STREAM client sends nothing after its request,
+so the receive completes when the client disconnects (or the connection fails), without it a disconnect
+is only noticed by the next send
+*/
+class StreamRecv : public ConnectionIo {
+public:
+	Connection *owner;
+	WSABUF buf;					// Zero length
+	DWORD flags;				// The flags for WSARecv, it must remain valid until the completion
+	bool pending;
+};
+
+class Connection : public ConnectionIo {
 	Connection(const Connection&);
 
 	// The state machine of this class 
@@ -23,6 +105,8 @@ class Connection : public OVERLAPPED {
 		WAIT_READREQUEST = 1,
 		WAIT_SENDDATA = 2,
 		WAIT_RESET = 3,
+		STREAMING = 4,			// Sends every new frame of the StreamSource through the StreamSends, parks while there is none
+		WAIT_STREAMSENDS = 5,	// Reset, waiting for the pending StreamSends and the StreamRecv before the next accept
 	};
 
 private:
@@ -40,6 +124,12 @@ private:
 	BYTE AcceptBuffer[Accept_Address_Length * 2];	// Accept buffer holds the remote address data of server and clients. Each of them needs Accept_Address_Length long. Therefore we need a size of 2*Accept_Address_Length 
 	WSABUF Buffer_wsa;								// We need this because WSARecv needs it 
 
+	// The response to the requests other than STREAM, sent in one gather send without copying the payload
+	string responseHeader;							// OK\n or ERROR\n and the fields of the response
+	WSABUF responsePayload;							// The data after the header (new[], e.g. the XRay image), NULL if none
+	WSABUF responseBufs[2];							// responseHeader and responsePayload
+	DWORD responseBufCount;
+
 	string *buffer; 							// This buffer (pointer) holds all the data we read from client. (Note: if the lenght of header exceeds 
 												// 1024 bytes we will treat it as invalid command)
 
@@ -58,10 +148,25 @@ private:
 	// Params for client profile
 	char *command;								// Command of the client
 	string clientIP;							// client's IP
+	const UINT16 *sentPalette;					// The palette this STREAM INDEXED client has, NULL before the first one
+
+	// Streaming
+	mutable mutex lock;							// The I/O completions of the sends, the wakes and the request complete on any worker thread
+	StreamSource *source;
+	StreamSend sends[STREAM_MAX_FRAMES_IN_FLIGHT];
+	int sendsPending;
+	StreamRecv streamRecv;
+	int maxFramesInFlight;						// The IN_FLIGHT= option of the STREAM request
+	UINT64 lastSentSequence;					// Frame::sequence of the last frame sent
+	BOOL sentAnyFrame;
+	BOOL waitingForFrame;						// Parked, the next Publish has to wake the connection
+	char streamTags[2];							// COMM_MSG_PALETTE and COMM_MSG_FRAME, the message types of STREAM INDEXED
+	INT64 ticksPerSecond;						// QueryPerformanceFrequency, for the times of STREAM FRAMED
 
 public:
 	// Constructor
-	Connection(SOCKET Listener, HANDLE IoPort, int Conn_ID);
+	// Source: the frames of the STREAM requests
+	Connection(SOCKET Listener, HANDLE IoPort, int Conn_ID, StreamSource *Source);
 
 	// Destructor
 	~Connection();
@@ -70,10 +175,16 @@ public:
 	void CompleteAccept();
 
 	void IssueReadRequest();
-	void CompleteReadRequest(WSABUF DataToSend);
+	void CompleteReadRequest();
+
+	void IssueSendData();
+	void CompleteSendData();
+
+	void IssueStreamSend();
+	void CompleteStreamSend(StreamSend *send, BOOL succeeded);
 
-	void IssueSendData(WSABUF DataToSend);
-	void CompleteSendData(WSABUF DataToSend);
+	void IssueStreamRecv();
+	void CompleteStreamRecv(BOOL succeeded);
 
 	void IssueReset();
 	void CompleteReset();
@@ -83,13 +194,46 @@ public:
 	Will be called by the worker thread when the iocp tells the thread that
 	this connection's I/O operation is compelte
 	*/
-	void OnIoComplete(WSABUF DataToSend);
+	void OnIoComplete();
+
+	// The I/O of the connection itself failed
+	void OnIoFailed();
+
+	// A StreamSend of the connection completed (or failed)
+	void OnStreamSendComplete(StreamSend *send, BOOL succeeded);
+
+	// The StreamRecv of the connection completed (or failed)
+	void OnStreamRecvComplete(BOOL succeeded);
+
+	/*
+	TRUE once after the connection parked for want of a new frame. The caller publishes the frame and then
+	posts COMPLETION_KEY_WAKE with the connection, OnWake sends the frame.
+	*/
+	BOOL NeedsWake();
+	void OnWake();
+
+	// TRUE from the accept of a client until the connection is reset. Thread safe, like GetStreamFormat
+	BOOL IsClientConnected() const;
+
+	// The format the client streams in, STREAM_FORMAT_NONE if it does not stream
+	StreamFormat GetStreamFormat() const;
 
 private:
 	// ---------- Helper Functions ----------
 	BOOL parseHeader(string *buf);
+
+	// TRUE if buf is the STREAM request name followed by the options (if any) and COMM_EOF
+	BOOL parseStreamHeader(string *buf, const char *name);
+
+	// TRUE for the STREAM requests, they are answered by StreamSends
+	BOOL IsStreamCommand() const;
+
+	// Issue the next accept once the last StreamSend and the StreamRecv of the reset connection completed
+	void AcceptAfterStreamIo();
 	
-	WSABUF BuildResponseMsg(WSABUF input);
+	void BuildResponseMsg();
+
+	void BuildStreamMsg(StreamSend *send, const StreamFrame &frame);
 
 	void cleanBuffers();
 
@@ -0,0 +1,181 @@
+#include "ControlServer.h"
+
+#include <sstream>
+
+ControlServer::ControlServer(int port)
+{
+	this->port = port;
+	listener = INVALID_SOCKET;
+	client = INVALID_SOCKET;
+	running = false;
+	_logger = spdlog::stdout_color_mt("ControlServer");
+
+	AddCommand("help", "help", [this](const vector<string> &args, string &result) {
+		for (map<string, Command>::const_iterator it = commands.begin(); it != commands.end(); ++it) {
+			result += (result.empty() ? "" : "; ") + it->second.usage;
+		}
+		return true;
+	});
+}
+
+ControlServer::~ControlServer()
+{
+	Stop();
+}
+
+void ControlServer::AddCommand(const string &name, const string &usage, CommandHandler handler) {
+	Command command;
+	command.usage = usage;
+	command.handler = handler;
+	commands[name] = command;
+}
+
+bool ControlServer::Start() {
+	WSADATA wsaData;
+	int err = WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (err != 0) {
+		_logger->error("WSAStartup failed: {0}", err);
+		return false;
+	}
+
+	listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (listener == INVALID_SOCKET) {
+		PRINT_WSAERROR("socket failed with error");
+		WSACleanup();
+		return false;
+	}
+
+	// Local connections only, the commands are not authenticated
+	sockaddr_in Addr;
+	Addr.sin_family = AF_INET;
+	Addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	Addr.sin_port = htons(port);
+	if (::bind(listener, (SOCKADDR *)&Addr, sizeof(Addr)) == SOCKET_ERROR || listen(listener, 1) == SOCKET_ERROR) {
+		PRINT_WSAERROR("bind/listen failed with error");
+		closesocket(listener);
+		listener = INVALID_SOCKET;
+		WSACleanup();
+		return false;
+	}
+
+	running = true;
+	worker = thread(&ControlServer::ServeFunction, this);
+	_logger->info("Listening for commands on 127.0.0.1:{0} (\"help\" lists them)", port);
+	return true;
+}
+
+void ControlServer::Stop() {
+	if (!running) {
+		return;
+	}
+	running = false;
+
+	// Closing the sockets wakes accept() and recv() up
+	{
+		lock_guard<mutex> lock(socketLock);
+		closesocket(listener);
+		listener = INVALID_SOCKET;
+		if (client != INVALID_SOCKET) {
+			shutdown(client, SD_BOTH);
+		}
+	}
+	worker.join();
+	WSACleanup();
+}
+
+string ControlServer::Execute(const string &line) {
+	istringstream stream(line);
+	vector<string> tokens;
+	string token;
+	while (stream >> token) {
+		tokens.push_back(token);
+	}
+	if (tokens.empty()) {
+		return string(COMM_ERROR) + " empty command";
+	}
+
+	map<string, Command>::iterator command = commands.find(tokens[0]);
+	if (command == commands.end()) {
+		return string(COMM_ERROR) + " unknown command \"" + tokens[0] + "\", try help";
+	}
+
+	string result;
+	if (!command->second.handler(vector<string>(tokens.begin() + 1, tokens.end()), result)) {
+		return string(COMM_ERROR) + " " + result + " (" + command->second.usage + ")";
+	}
+	return result.empty() ? string(COMM_OK) : string(COMM_OK) + " " + result;
+}
+
+void ControlServer::ServeFunction() {
+	while (running) {
+		SOCKET accepted = accept(listener, NULL, NULL);
+		if (accepted == INVALID_SOCKET) {
+			if (running) {
+				PRINT_WSAERROR("accept failed with error");
+				Sleep(100);
+			}
+			continue;
+		}
+
+		{
+			lock_guard<mutex> lock(socketLock);
+			client = accepted;
+		}
+		if (running) {
+			ServeClient(accepted);
+		}
+		{
+			lock_guard<mutex> lock(socketLock);
+			client = INVALID_SOCKET;
+		}
+		closesocket(accepted);
+	}
+}
+
+void ControlServer::ServeClient(SOCKET socket) {
+	_logger->info("Control client connected");
+
+	string line;
+	bool overlong = false;
+	char buffer[256];
+	while (running) {
+		int received = recv(socket, buffer, sizeof(buffer), 0);
+		if (received <= 0) {
+			break;
+		}
+
+		for (int i = 0; i < received; i++) {
+			char c = buffer[i];
+			if (c != '\n') {
+				if (c != '\r' && !overlong) {
+					line += c;
+					overlong = line.size() > CONTROL_SERVER_LINE_MAX;
+				}
+				continue;
+			}
+
+			string answer = overlong ? string(COMM_ERROR) + " line too long" : Execute(line);
+			_logger->info("{0} -> {1}", overlong ? "(too long)" : line, answer);
+			line.clear();
+			overlong = false;
+			if (!SendLine(socket, answer)) {
+				return;
+			}
+		}
+	}
+
+	_logger->info("Control client disconnected");
+}
+
+bool ControlServer::SendLine(SOCKET socket, const string &line) {
+	string data = line + COMM_EOF;
+	size_t sent = 0;
+	while (sent < data.size()) {
+		int n = send(socket, data.c_str() + sent, (int)(data.size() - sent), 0);
+		if (n == SOCKET_ERROR) {
+			return false;
+		}
+		sent += n;
+	}
+	return true;
+}
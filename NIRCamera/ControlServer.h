@@ -0,0 +1,69 @@
+#pragma once
+#include "Common.h"
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#define CONTROL_SERVER_PORT 27016
+#define CONTROL_SERVER_LINE_MAX 1024		// Longer lines are answered with an error and skipped
+
+/*
+A line based command interface on a local TCP port (127.0.0.1 only), so that the camera can be controlled
+without the HighGUI window, e.g. "ncat 127.0.0.1 27016" on a headless machine.
+
+Every line is a command and its arguments, separated by blanks. Every command is answered by one line:
+COMM_OK followed by the result (if any), or COMM_ERROR followed by the reason.
+One client is served at a time, the commands run on the thread of the server.
+*/
+class ControlServer
+{
+public:
+	// Gets the arguments (without the command). Sets result to the answer, or to the reason and returns FALSE
+	typedef function<bool(const vector<string> &args, string &result)> CommandHandler;
+
+	ControlServer(int port = CONTROL_SERVER_PORT);
+	~ControlServer();
+
+	/*
+	Make a command available. usage is shown by "help", e.g. "exposure <ms>"
+	*/
+	void AddCommand(const string &name, const string &usage, CommandHandler handler);
+
+	// Start listening on a thread of its own. Return FALSE if the port cannot be opened
+	bool Start();
+
+	// Disconnect the client and join the thread
+	void Stop();
+
+	// Run one command line and return the answer (without the COMM_EOF)
+	string Execute(const string &line);
+
+private:
+	class Command {
+	public:
+		string usage;
+		CommandHandler handler;
+	};
+
+	std::shared_ptr<spdlog::logger> _logger;
+
+	int port;
+	map<string, Command> commands;
+
+	SOCKET listener;
+	SOCKET client;
+	mutex socketLock;		// listener and client are closed by Stop() to wake the thread up
+	atomic<bool> running;
+	thread worker;
+
+	void ServeFunction();
+	void ServeClient(SOCKET socket);
+	bool SendLine(SOCKET socket, const string &line);
+};
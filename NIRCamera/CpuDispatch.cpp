@@ -0,0 +1,88 @@
+#include "CpuDispatch.h"
+
+#include <intrin.h>
+#include <string>
+
+SimdLevel CpuDispatch::Detect() {
+	int info[4];		// EAX, EBX, ECX, EDX
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	bool ssse3 = (info[2] & (1 << 9)) != 0;
+	bool sse41 = (info[2] & (1 << 19)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!ssse3 || !sse41) {
+		return SIMD_SCALAR;
+	}
+
+	// The OS has to save the YMM (and ZMM) registers on a context switch
+	if (!osxsave || !avx || maxLeaf < 7) {
+		return SIMD_SSE41;
+	}
+	unsigned long long xcr0 = _xgetbv(0);
+	if ((xcr0 & 0x6) != 0x6) {
+		return SIMD_SSE41;
+	}
+
+	__cpuidex(info, 7, 0);
+	bool avx2 = (info[1] & (1 << 5)) != 0;
+	bool avx512f = (info[1] & (1 << 16)) != 0;
+	bool avx512bw = (info[1] & (1 << 30)) != 0;
+	if (!avx2) {
+		return SIMD_SSE41;
+	}
+	if (!avx512f || !avx512bw || (xcr0 & 0xe6) != 0xe6) {
+		return SIMD_AVX2;
+	}
+	return SIMD_AVX512;
+}
+
+SimdLevel CpuDispatch::Level() {
+	static SimdLevel level = Select();
+	return level;
+}
+
+const char *CpuDispatch::Name(SimdLevel level) {
+	switch (level) {
+	case SIMD_SSE41:
+		return "sse41";
+	case SIMD_AVX2:
+		return "avx2";
+	case SIMD_AVX512:
+		return "avx512";
+	default:
+		return "scalar";
+	}
+}
+
+SimdLevel CpuDispatch::Select() {
+	std::shared_ptr<spdlog::logger> logger = spdlog::stdout_color_mt("CpuDispatch");
+
+	SimdLevel detected = Detect();
+	SimdLevel level = detected;
+
+	char forced[16];
+	DWORD length = GetEnvironmentVariableA(CPU_DISPATCH_ENV, forced, sizeof(forced));
+	if (length > 0 && length < sizeof(forced)) {
+		bool known = false;
+		for (int l = SIMD_SCALAR; l <= SIMD_AVX512; l++) {
+			if (string(forced) == Name((SimdLevel)l)) {
+				known = true;
+				if (l > detected) {
+					logger->warn("{0}={1} is not supported by this CPU, using {2}", CPU_DISPATCH_ENV, forced, Name(detected));
+				}
+				else {
+					level = (SimdLevel)l;
+				}
+			}
+		}
+		if (!known) {
+			logger->warn("Unknown {0}={1} (scalar, sse41, avx2 or avx512)", CPU_DISPATCH_ENV, forced);
+		}
+	}
+
+	logger->info("Pixel kernels use {0} (CPU supports {1})", Name(level), Name(detected));
+	return level;
+}
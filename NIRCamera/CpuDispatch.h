@@ -0,0 +1,38 @@
+#pragma once
+
+#include <Windows.h>
+#include "spdlog/spdlog.h"
+
+using namespace std;
+
+// Environment variable that forces a SIMD level for testing: scalar, sse41, avx2 or avx512
+#define CPU_DISPATCH_ENV "NIRCAMERA_SIMD"
+
+// The instruction sets the pixel kernels are built for, every level includes the ones below
+enum SimdLevel {
+	SIMD_SCALAR = 0,
+	SIMD_SSE41 = 1,		// SSE4.1 (and SSSE3)
+	SIMD_AVX2 = 2,
+	SIMD_AVX512 = 3,	// AVX-512 F and BW
+};
+
+/*
+Picks the SIMD level of the pixel kernels once at startup, so that one binary runs on old and new workstations.
+*/
+class CpuDispatch
+{
+public:
+	// The highest level this CPU and the OS support
+	static SimdLevel Detect();
+
+	/*
+	The level the kernels use: the detected one, or the one CPU_DISPATCH_ENV asks for.
+	A level above the detected one is not allowed. The choice is logged on the first call.
+	*/
+	static SimdLevel Level();
+
+	static const char *Name(SimdLevel level);
+
+private:
+	static SimdLevel Select();
+};
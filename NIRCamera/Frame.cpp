@@ -0,0 +1,214 @@
+#include "Frame.h"
+
+#include <malloc.h>
+
+// ----------- Frame -----------
+
+Frame::Frame()
+{
+	format = FRAME_FORMAT_GRAY8;
+	width = 0;
+	height = 0;
+	stride = 0;
+	sequence = 0;
+	captureTime = 0;
+	exposure = 0;
+
+	data = NULL;
+	capacity = 0;
+	storage = FRAME_STORAGE_NONE;
+	sizeClass = -1;
+	refCount = 0;
+}
+
+Frame::~Frame()
+{
+	_aligned_free(data);
+}
+
+cv::Mat Frame::Host() const {
+	return cv::Mat(height, width, CvType(format), data, stride);
+}
+
+void Frame::CopyMetadata(const Frame &other) {
+	sequence = other.sequence;
+	captureTime = other.captureTime;
+	exposure = other.exposure;
+}
+
+int Frame::BytesPerPixel(FrameFormat format) {
+	switch (format) {
+	case FRAME_FORMAT_GRAY16:
+	case FRAME_FORMAT_HOLO16:
+		return 2;
+	case FRAME_FORMAT_BGR24:
+		return 3;
+	default:
+		return 1;
+	}
+}
+
+int Frame::CvType(FrameFormat format) {
+	switch (format) {
+	case FRAME_FORMAT_GRAY16:
+		return CV_16UC1;
+	case FRAME_FORMAT_BGR24:
+		return CV_8UC3;
+	case FRAME_FORMAT_HOLO16:
+		return CV_8UC2;
+	default:
+		return CV_8UC1;
+	}
+}
+
+// ----------- FrameRef -----------
+
+FrameRef::FrameRef(const FrameRef &other) {
+	frame = other.frame;
+	if (frame != NULL) {
+		frame->refCount++;
+	}
+}
+
+FrameRef::FrameRef(FrameRef &&other) {
+	frame = other.frame;
+	other.frame = NULL;
+}
+
+FrameRef::~FrameRef() {
+	reset();
+}
+
+FrameRef &FrameRef::operator=(const FrameRef &other) {
+	if (other.frame != NULL) {
+		other.frame->refCount++;
+	}
+	reset();
+	frame = other.frame;
+	return *this;
+}
+
+FrameRef &FrameRef::operator=(FrameRef &&other) {
+	if (this != &other) {
+		reset();
+		frame = other.frame;
+		other.frame = NULL;
+	}
+	return *this;
+}
+
+bool FrameRef::unique() const {
+	return frame != NULL && frame->refCount == 1;
+}
+
+void FrameRef::reset() {
+	if (frame != NULL && --frame->refCount == 0) {
+		FramePool::Shared().Release(frame);
+	}
+	frame = NULL;
+}
+
+// ----------- FramePool -----------
+
+FramePool::FramePool()
+{
+	allocations = 0;
+	framesInUse = 0;
+	_logger = spdlog::stdout_color_mt("FramePool");
+}
+
+FramePool::~FramePool()
+{
+	for (int s = 0; s < 3; s++) {
+		for (int c = 0; c < FRAME_POOL_SIZE_CLASSES; c++) {
+			for (size_t i = 0; i < freeLists[s][c].size(); i++) {
+				delete freeLists[s][c][i];
+			}
+		}
+	}
+}
+
+FramePool &FramePool::Shared() {
+	static FramePool pool;
+	return pool;
+}
+
+FrameRef FramePool::Acquire(FrameFormat format, int width, int height, FrameStorage storage) {
+	size_t stride = (size_t)width * Frame::BytesPerPixel(format);
+	size_t bytes = stride * height;
+	int sizeClass = SizeClass(bytes);
+
+	Frame *frame = NULL;
+	if (sizeClass >= 0) {
+		lock_guard<mutex> guard(lock);
+		vector<Frame*> &freeList = freeLists[storage][sizeClass];
+		if (!freeList.empty()) {
+			frame = freeList.back();
+			freeList.pop_back();
+		}
+	}
+
+	if (frame == NULL) {
+		frame = new Frame();
+		frame->storage = storage;
+		frame->sizeClass = sizeClass;
+		if (storage == FRAME_STORAGE_HOST) {
+			// A pooled buffer is as large as its size class, so it fits every frame of the class
+			frame->capacity = sizeClass >= 0 ? (size_t)FRAME_POOL_MIN_BYTES << sizeClass : bytes;
+			frame->data = (UINT8*)_aligned_malloc(frame->capacity, FRAME_ALIGNMENT);
+		}
+		allocations++;
+	}
+
+	frame->format = format;
+	frame->width = width;
+	frame->height = height;
+	frame->stride = stride;
+	frame->sequence = 0;
+	frame->captureTime = 0;
+	frame->exposure = 0;
+	if (storage == FRAME_STORAGE_DEVICE) {
+		// Only allocates if the frame was last used with another geometry
+		frame->device.create(height, width, Frame::CvType(format));
+	}
+	frame->refCount = 1;
+	framesInUse++;
+
+	return FrameRef(frame);
+}
+
+void FramePool::ReportStats() {
+	int count = allocations.exchange(0);
+	if (count > 0) {
+		_logger->info("{0} frames allocated, {1} in use", count, (int)framesInUse);
+	}
+}
+
+void FramePool::Release(Frame *frame) {
+	framesInUse--;
+
+	if (frame->storage == FRAME_STORAGE_NONE) {
+		// The pixels belong to the stage that made the frame
+		frame->device.release();
+	}
+
+	if (frame->sizeClass < 0) {
+		_logger->warn("Frame of {0}x{1} is too large for the pool", frame->width, frame->height);
+		delete frame;
+		return;
+	}
+
+	lock_guard<mutex> guard(lock);
+	freeLists[frame->storage][frame->sizeClass].push_back(frame);
+}
+
+int FramePool::SizeClass(size_t bytes) {
+	size_t classBytes = FRAME_POOL_MIN_BYTES;
+	for (int c = 0; c < FRAME_POOL_SIZE_CLASSES; c++) {
+		if (bytes <= classBytes) {
+			return c;
+		}
+		classBytes <<= 1;
+	}
+	return -1;
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <Windows.h>
+#include "spdlog/spdlog.h"
+
+#include "opencv2/core.hpp"
+#include "opencv2/core/cuda.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+// Host buffers are aligned for the SIMD kernels
+#define FRAME_ALIGNMENT 64
+// The smallest size class of the pool in bytes, every next class is twice as large
+#define FRAME_POOL_MIN_BYTES 4096
+#define FRAME_POOL_SIZE_CLASSES 16
+
+class FramePool;
+
+// Pixel format of a frame
+enum FrameFormat {
+	FRAME_FORMAT_RAW8 = 0,		// Bytes as they come from the FPGA (width = number of bytes)
+	FRAME_FORMAT_GRAY16 = 1,	// Raw sensor values
+	FRAME_FORMAT_GRAY8 = 2,		// Scaled/thresholded image
+	FRAME_FORMAT_BGR24 = 3,		// Colored image for the display
+	FRAME_FORMAT_HOLO16 = 4,	// GB and AR byte per pixel as sent to the HoloLens
+};
+
+// Where the pixels of a frame live
+enum FrameStorage {
+	FRAME_STORAGE_NONE = 0,		// Only the metadata, the stage sets the pixels (e.g. a GpuMat it owns)
+	FRAME_STORAGE_HOST = 1,
+	FRAME_STORAGE_DEVICE = 2,
+};
+
+/*
+A frame and its metadata. Frames are only created by the FramePool and are passed around by FrameRef.
+A frame that is referenced by more than one FrameRef may be read by other threads and must not be modified.
+*/
+class Frame {
+public:
+	FrameFormat format;
+	int width;
+	int height;
+	size_t stride;				// Bytes per row of the host buffer
+
+	UINT64 sequence;			// Number of the frame since the program started
+	INT64 captureTime;			// QueryPerformanceCounter() when the frame was read from the imager
+	int exposure;				// Exposure of the imager in ms
+
+	cv::cuda::GpuMat device;	// Device storage, kept allocated while the frame is in the pool
+
+	// Host pixels of row y
+	template<class T> T *Ptr(int y = 0) { return (T*)(data + y * stride); }
+	template<class T> const T *Ptr(int y = 0) const { return (const T*)(data + y * stride); }
+
+	// Size of the host pixels in bytes
+	size_t Size() const { return stride * height; }
+
+	// A Mat header on the host buffer (no copy)
+	cv::Mat Host() const;
+
+	// Copy sequence, capture time and exposure from other
+	void CopyMetadata(const Frame &other);
+
+	static int BytesPerPixel(FrameFormat format);
+	static int CvType(FrameFormat format);
+
+private:
+	friend class FramePool;
+	friend class FrameRef;
+
+	Frame();
+	~Frame();
+
+	UINT8 *data;				// Host buffer, _aligned_malloc
+	size_t capacity;			// Size of data in bytes
+	FrameStorage storage;
+	int sizeClass;
+	atomic<int> refCount;
+};
+
+/*
+A reference to a Frame. Copying a FrameRef shares the frame, the last FrameRef returns it to the pool.
+*/
+class FrameRef {
+public:
+	FrameRef() { frame = NULL; }
+	FrameRef(const FrameRef &other);
+	FrameRef(FrameRef &&other);
+	~FrameRef();
+
+	FrameRef &operator=(const FrameRef &other);
+	FrameRef &operator=(FrameRef &&other);
+
+	Frame *operator->() const { return frame; }
+	Frame &operator*() const { return *frame; }
+
+	// TRUE if it does not refer to a frame (the TQueue "no data" value)
+	bool empty() const { return frame == NULL; }
+
+	// TRUE if no one else refers to the frame, i.e. it can be modified
+	bool unique() const;
+
+	void reset();
+
+private:
+	friend class FramePool;
+
+	Frame *frame;
+
+	explicit FrameRef(Frame *newFrame) { frame = newFrame; }
+};
+
+/*
+FramePool recycles the frames of the whole pipeline, so that the frame buffers are only allocated
+until the pipeline has warmed up. Free frames are kept in lists by size class of their host buffer.
+*/
+class FramePool
+{
+public:
+	FramePool();
+	~FramePool();
+
+	// The pool shared by the pipeline stages
+	static FramePool &Shared();
+
+	/*
+	Get a frame for width x height pixels of format. The metadata of the frame is cleared,
+	the pixels are left as they are.
+	*/
+	FrameRef Acquire(FrameFormat format, int width, int height, FrameStorage storage);
+
+	// Print the number of allocations since the last report
+	void ReportStats();
+
+private:
+	friend class FrameRef;
+
+	mutex lock;
+	vector<Frame*> freeLists[3][FRAME_POOL_SIZE_CLASSES];		// [storage][size class]
+
+	atomic<int> allocations;		// Frames created since the last report
+	atomic<int> framesInUse;
+
+	std::shared_ptr<spdlog::logger> _logger;
+
+	void Release(Frame *frame);
+
+	static int SizeClass(size_t bytes);
+};
@@ -0,0 +1,205 @@
+#include "HistogramEngine.h"
+
+#include <algorithm>
+#include <emmintrin.h>		// SSE2
+
+HistogramEngine::HistogramEngine(int width, int height)
+{
+	Width = width;
+	Height = height;
+
+	subHistograms.assign(4 * HISTOGRAM_BINS, 0);
+
+	thresholdPercentile = HISTOGRAM_THRESHOLD_PERCENTILE;
+
+	frameNumber = 0;
+	smoothLow = 0;
+	smoothHigh = 0;
+	smoothThreshold = 0;
+
+	// Same mapping as the hand-tuned defaults until the first frame arrives
+	levels.scale = 24.0 / 256.0;
+	levels.offset = 0;
+	levels.thresholdLow = 0;
+
+	recycler = make_shared<SnapshotRecycler>();
+
+	_logger = spdlog::stdout_color_mt("HistogramEngine");
+}
+
+HistogramEngine::~HistogramEngine()
+{
+}
+
+void HistogramEngine::Process(const UINT16 *frame) {
+	Count(frame);
+
+	// A snapshot that nobody is holding on to anymore
+	shared_ptr<HistogramSnapshot> snapshot = AcquireSnapshot();
+
+	// Merge the sub-histograms
+	const UINT32 *h0 = subHistograms.data();
+	const UINT32 *h1 = h0 + HISTOGRAM_BINS;
+	const UINT32 *h2 = h1 + HISTOGRAM_BINS;
+	const UINT32 *h3 = h2 + HISTOGRAM_BINS;
+	UINT32 total = 0;
+	double sum = 0;
+	for (int i = 0; i < HISTOGRAM_BINS; i++) {
+		UINT32 count = h0[i] + h1[i] + h2[i] + h3[i];
+		snapshot->bins[i] = count;
+		total += count;
+		sum += (double)count * BinValue(i);
+	}
+
+	snapshot->sampleCount = total;
+	snapshot->frameNumber = frameNumber++;
+	snapshot->mean = total > 0 ? sum / total : 0;
+	snapshot->lowValue = Percentile(*snapshot, HISTOGRAM_LOW_PERCENTILE);
+	snapshot->highValue = Percentile(*snapshot, HISTOGRAM_HIGH_PERCENTILE);
+	UINT32 saturated = 0;
+	for (int i = BinOf(HISTOGRAM_SENSOR_MAX); i < HISTOGRAM_BINS; i++) {
+		saturated += snapshot->bins[i];
+	}
+	snapshot->saturatedFraction = total > 0 ? (double)saturated / total : 0;
+
+	UpdateLevels(*snapshot);
+	snapshot->levels = levels;
+
+	atomic_store(&current, snapshot);
+}
+
+shared_ptr<const HistogramSnapshot> HistogramEngine::Latest() const {
+	return atomic_load(&current);
+}
+
+AutoLevels HistogramEngine::GetLevels() const {
+	return levels;
+}
+
+void HistogramEngine::SetThresholdPercentile(double p) {
+	thresholdPercentile = p < 0 ? 0 : (p > 1 ? 1 : p);
+}
+
+double HistogramEngine::GetThresholdPercentile() const {
+	return thresholdPercentile;
+}
+
+HistogramEngine::SnapshotRecycler::~SnapshotRecycler()
+{
+	for (size_t i = 0; i < snapshots.size(); i++) {
+		delete snapshots[i];
+	}
+}
+
+shared_ptr<HistogramSnapshot> HistogramEngine::AcquireSnapshot() {
+	HistogramSnapshot *snapshot = NULL;
+	{
+		lock_guard<mutex> lock(recycler->lock);
+		if (!recycler->snapshots.empty()) {
+			snapshot = recycler->snapshots.back();
+			recycler->snapshots.pop_back();
+		}
+	}
+	if (snapshot == NULL) {
+		snapshot = new HistogramSnapshot();
+		snapshot->bins.resize(HISTOGRAM_BINS);
+	}
+
+	shared_ptr<SnapshotRecycler> owner = recycler;
+	return shared_ptr<HistogramSnapshot>(snapshot, [owner](HistogramSnapshot *released) {
+		lock_guard<mutex> lock(owner->lock);
+		owner->snapshots.push_back(released);
+	});
+}
+
+void HistogramEngine::Count(const UINT16 *frame) {
+	std::fill(subHistograms.begin(), subHistograms.end(), 0);
+	UINT32 *h0 = subHistograms.data();
+	UINT32 *h1 = h0 + HISTOGRAM_BINS;
+	UINT32 *h2 = h1 + HISTOGRAM_BINS;
+	UINT32 *h3 = h2 + HISTOGRAM_BINS;
+
+	// The bins are computed 8 pixels at a time, then the samples (every other pixel) are spread over the four
+	// sub-histograms. The increments stay scalar: x86 has no scatter-add, and a conflict-detecting AVX-512
+	// histogram is slower than four independent scalar histograms for this few samples per row
+	const __m128i fineBins = _mm_set1_epi16(HISTOGRAM_FINE_BINS);
+
+	for (int y = 0; y < Height; y += HISTOGRAM_STEP) {
+		const UINT16 *row = frame + y * Width;
+
+		int x = 0;
+		for (; x + 8 <= Width; x += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+			__m128i excess = _mm_subs_epu16(v, fineBins);		// max(v - HISTOGRAM_FINE_BINS, 0)
+			v = _mm_add_epi16(_mm_sub_epi16(v, excess), _mm_srli_epi16(excess, HISTOGRAM_COARSE_SHIFT));
+
+			h0[_mm_extract_epi16(v, 0)]++;
+			h1[_mm_extract_epi16(v, 2)]++;
+			h2[_mm_extract_epi16(v, 4)]++;
+			h3[_mm_extract_epi16(v, 6)]++;
+		}
+		for (; x < Width; x += HISTOGRAM_STEP) {
+			h0[BinOf(row[x])]++;
+		}
+	}
+}
+
+int HistogramEngine::BinOf(UINT16 value) {
+	if (value < HISTOGRAM_FINE_BINS) {
+		return value;
+	}
+	return HISTOGRAM_FINE_BINS + ((value - HISTOGRAM_FINE_BINS) >> HISTOGRAM_COARSE_SHIFT);
+}
+
+int HistogramEngine::BinValue(int bin) {
+	if (bin < HISTOGRAM_FINE_BINS) {
+		return bin;
+	}
+	return HISTOGRAM_FINE_BINS + ((bin - HISTOGRAM_FINE_BINS) << HISTOGRAM_COARSE_SHIFT);
+}
+
+int HistogramEngine::Percentile(const HistogramSnapshot &snapshot, double p) {
+	double target = p * snapshot.sampleCount;
+	double cumulative = 0;
+	for (int i = 0; i < HISTOGRAM_BINS; i++) {
+		cumulative += snapshot.bins[i];
+		if (cumulative >= target) {
+			return BinValue(i);
+		}
+	}
+	return BinValue(HISTOGRAM_BINS - 1);
+}
+
+void HistogramEngine::UpdateLevels(const HistogramSnapshot &snapshot) {
+	if (snapshot.sampleCount == 0) {
+		return;
+	}
+
+	double low = snapshot.lowValue;
+	double high = snapshot.highValue;
+	double threshold = thresholdPercentile > 0 ? Percentile(snapshot, thresholdPercentile) : 0;
+
+	// Smooth the percentiles over time so that the contrast does not pump from frame to frame
+	if (snapshot.frameNumber == 0) {
+		smoothLow = low;
+		smoothHigh = high;
+		smoothThreshold = threshold;
+	}
+	else {
+		smoothLow += (low - smoothLow) * HISTOGRAM_SMOOTHING;
+		smoothHigh += (high - smoothHigh) * HISTOGRAM_SMOOTHING;
+		smoothThreshold += (threshold - smoothThreshold) * HISTOGRAM_SMOOTHING;
+	}
+
+	double range = smoothHigh - smoothLow;
+	if (range < HISTOGRAM_MIN_RANGE) {
+		range = HISTOGRAM_MIN_RANGE;
+	}
+
+	// Map [low, high] to [0, 255]
+	levels.scale = 255.0 / range;
+	levels.offset = -smoothLow * levels.scale;
+
+	int thresholdLow = (int)((smoothThreshold - smoothLow) * levels.scale + 0.5);
+	levels.thresholdLow = thresholdLow < 0 ? 0 : (thresholdLow > 254 ? 254 : thresholdLow);
+}
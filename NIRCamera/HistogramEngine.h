@@ -0,0 +1,149 @@
+#pragma once
+
+#include <Windows.h>
+#include "spdlog/spdlog.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+/*
+The bins cover all 16 bit raw values. The sensor delivers 12 bit values, they get one bin each. The sensor
+correction can push values above that (flat field gain), they are binned 16 values per bin:
+	bin = value                                          for value < HISTOGRAM_FINE_BINS
+	bin = HISTOGRAM_FINE_BINS + ((value - HISTOGRAM_FINE_BINS) >> HISTOGRAM_COARSE_SHIFT)   above
+*/
+#define HISTOGRAM_FINE_BINS 4096
+#define HISTOGRAM_COARSE_SHIFT 4
+#define HISTOGRAM_BINS (HISTOGRAM_FINE_BINS + ((65536 - HISTOGRAM_FINE_BINS) >> HISTOGRAM_COARSE_SHIFT))
+// Full scale of the sensor, the samples at or above it count as saturated
+#define HISTOGRAM_SENSOR_MAX 4095
+// Only every HISTOGRAM_STEP-th pixel of every HISTOGRAM_STEP-th row is sampled
+#define HISTOGRAM_STEP 2
+// Percentiles that are mapped to 0 and 255 by the auto contrast
+#define HISTOGRAM_LOW_PERCENTILE 0.01
+#define HISTOGRAM_HIGH_PERCENTILE 0.995
+/*
+Default percentile of the auto threshold, everything at or below it becomes 0 (HistogramEngine::SetThresholdPercentile).
+The fluorescence covers a small part of the view, most of the pixels are background: the median is the
+background level, and it stays so while the fluorescent area is less than half of the frame. 0 keeps every pixel.
+*/
+#define HISTOGRAM_THRESHOLD_PERCENTILE 0.5
+// The auto contrast never stretches less than this many raw counts to the full 8 bit range
+#define HISTOGRAM_MIN_RANGE 16
+// Weight of the new frame when the percentiles are smoothed over time
+#define HISTOGRAM_SMOOTHING 0.1
+
+/*
+Scale and threshold values derived from the histogram.
+They replace the hand-tuned 24/256 scale of the scale stage and the low threshold slider of the warp stage:
+	scaled = raw * scale + offset, then threshold to zero at thresholdLow
+The scale already maps the high percentile to 255, so the high threshold slider has no auto value (the warp stage uses 255)
+*/
+class AutoLevels {
+public:
+	double scale;
+	double offset;
+	int thresholdLow;
+};
+
+/*
+The histogram of one frame and the statistics derived from it.
+A published snapshot is never modified, other threads can hold on to it as long as they need.
+*/
+class HistogramSnapshot {
+public:
+	vector<UINT32> bins;		// HISTOGRAM_BINS entries
+	UINT32 sampleCount;
+	UINT64 frameNumber;
+
+	double mean;				// Mean raw value
+	int lowValue;				// Raw value at HISTOGRAM_LOW_PERCENTILE
+	int highValue;				// Raw value at HISTOGRAM_HIGH_PERCENTILE
+	double saturatedFraction;	// Fraction of the samples at or above HISTOGRAM_SENSOR_MAX
+
+	AutoLevels levels;			// Smoothed auto levels after this frame
+};
+
+/*
+HistogramEngine computes the histogram of every raw frame on a subsampled grid, derives the auto
+contrast/threshold values from its percentiles and publishes the result for other consumers.
+Process() has to be called from a single thread, Latest() can be called from any thread.
+*/
+class HistogramEngine
+{
+public:
+	HistogramEngine(int width, int height);
+	~HistogramEngine();
+
+	/*
+	Compute the histogram of frame, update the smoothed auto levels and publish a new snapshot
+	*/
+	void Process(const UINT16 *frame);
+
+	/*
+	Get the latest published snapshot. NULL before the first frame.
+	*/
+	shared_ptr<const HistogramSnapshot> Latest() const;
+
+	/*
+	Get the smoothed auto levels
+	*/
+	AutoLevels GetLevels() const;
+
+	/*
+	Set the percentile of the auto threshold (0 to 1, HISTOGRAM_THRESHOLD_PERCENTILE by default). Can be called from any thread
+	*/
+	void SetThresholdPercentile(double p);
+	double GetThresholdPercentile() const;
+
+private:
+	int Width;
+	int Height;
+
+	// Four interleaved sub-histograms, so that consecutive samples of the same value do not wait on each other
+	vector<UINT32> subHistograms;
+
+	/*
+	The snapshots that no consumer holds anymore. A published snapshot goes back here when its last
+	shared_ptr is released, on whichever thread that is. Shared with the deleter of the snapshots,
+	so a consumer may still release one after the engine is gone.
+	*/
+	class SnapshotRecycler {
+	public:
+		~SnapshotRecycler();
+
+		mutex lock;
+		vector<HistogramSnapshot*> snapshots;
+	};
+
+	shared_ptr<HistogramSnapshot> current;		// Only accessed by atomic_load/atomic_store
+	shared_ptr<SnapshotRecycler> recycler;
+
+	atomic<double> thresholdPercentile;
+
+	UINT64 frameNumber;
+	double smoothLow;
+	double smoothHigh;
+	double smoothThreshold;
+	AutoLevels levels;
+
+	std::shared_ptr<spdlog::logger> _logger;
+
+	void Count(const UINT16 *frame);
+
+	// A free snapshot (a recycled one if there is any), returned to the recycler when its last reference is released
+	shared_ptr<HistogramSnapshot> AcquireSnapshot();
+
+	// The bin of a raw value, and the lowest raw value of a bin
+	static int BinOf(UINT16 value);
+	static int BinValue(int bin);
+
+	// Get the raw value below which the fraction p of the samples lies
+	static int Percentile(const HistogramSnapshot &snapshot, double p);
+
+	void UpdateLevels(const HistogramSnapshot &snapshot);
+};
@@ -0,0 +1,15 @@
+#include "HoloColorTable.h"
+
+static constexpr HoloColorTable holoColors = MakeHoloColorTable(make_index_sequence<HOLO_ALPHA_LEVELS>());
+
+// Spot checks against the values of the original encoder functions, at the ends of their sections
+static_assert(holoColors.rows[15].entries[0] == 0x0008, "differs from the original encoder");
+static_assert(holoColors.rows[15].entries[95] == 0xf0ff, "differs from the original encoder");
+static_assert(holoColors.rows[15].entries[158] == 0xfff0, "differs from the original encoder");
+static_assert(holoColors.rows[15].entries[223] == 0xff00, "differs from the original encoder");
+static_assert(holoColors.rows[8].entries[200] == 0x8f50, "differs from the original encoder");
+static_assert(holoColors.rows[0].entries[255] == 0x0000, "differs from the original encoder");
+
+const HoloColorTable &HoloColorTable::Shared() {
+	return holoColors;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <Windows.h>
+
+#include <utility>
+
+using namespace std;
+
+// The transparency (alpha) of the HoloLens pixels has 4 bits
+#define HOLO_ALPHA_LEVELS 16
+// 256 values, and one more so that a 4 byte load of the last entry stays in the row (for the AVX2 gather)
+#define HOLO_COLOR_ENTRIES 257
+
+/*
+The 2 bytes per pixel sent to the HoloLens (RGBA4444 as GB | AR << 8) of every 8 bit value and transparency.
+The colors are a Jet-like scheme in 4 bits per channel. The functions below are the original per pixel
+functions of the encoder (GetColorAR, GetColorGB, getG and getB), written as single expressions so that
+the whole table is built by the compiler.
+*/
+namespace HoloColor {
+	constexpr UINT8 AR(int i) {
+		return i == 0 ? 0 :
+			i < 96 ? 0xf0 :
+			i < 128 ? (UINT8)(0xf0 + (UINT8)((i - 95) * 4) / 16) :
+			i < 159 ? (UINT8)(0xf0 + (UINT8)(131 + (i - 128) * 4) / 16) :
+			i < 224 ? 0xff : 0;
+	}
+
+	constexpr UINT8 G(int i) {
+		return i < 32 || i > 222 ? 0 :
+			i < 64 ? (UINT8)((i - 31) * 4) :
+			i < 95 ? (UINT8)((i - 64) * 4 + 131) :
+			i < 160 ? 0xff :
+			i < 191 ? (UINT8)(0xff - (i - 159) * 4) :
+			(UINT8)(128 - (i - 191) * 4);
+	}
+
+	constexpr UINT8 B(int i) {
+		return i > 158 ? 0 :
+			i <= 30 ? (UINT8)(131 + i * 4) :
+			i < 96 ? 0xff :
+			i < 127 ? (UINT8)(0xff - (i - 95) * 4) :
+			(UINT8)(128 - (i - 127) * 4);
+	}
+
+	constexpr UINT8 GB(int i) {
+		return (UINT8)((G(i) / 16) << 4 | B(i) / 16);
+	}
+
+	// The alpha nibble replaces the high 4 bits of AR (alpha 15: AR as it is)
+	constexpr UINT16 Entry(int alpha, int i) {
+		return i > 255 ? 0 : (UINT16)(GB(i) | (AR(i) & ((alpha << 4 | 0x0f) & 0xff)) << 8);
+	}
+}
+
+struct HoloColorRow {
+	UINT16 entries[HOLO_COLOR_ENTRIES];
+};
+
+struct HoloColorTable {
+	HoloColorRow rows[HOLO_ALPHA_LEVELS];
+
+	// The 256 entries (value -> GB | AR << 8) of a transparency, alpha is clamped to [0, HOLO_ALPHA_LEVELS)
+	const UINT16 *ForAlpha(int alpha) const {
+		return rows[alpha < 0 ? 0 : alpha >= HOLO_ALPHA_LEVELS ? HOLO_ALPHA_LEVELS - 1 : alpha].entries;
+	}
+
+	// The table, built at compile time
+	static const HoloColorTable &Shared();
+};
+
+template<size_t... I>
+constexpr HoloColorRow MakeHoloColorRow(int alpha, index_sequence<I...>) {
+	return HoloColorRow{ { HoloColor::Entry(alpha, (int)I)... } };
+}
+
+template<size_t... A>
+constexpr HoloColorTable MakeHoloColorTable(index_sequence<A...>) {
+	return HoloColorTable{ { MakeHoloColorRow((int)A, make_index_sequence<HOLO_COLOR_ENTRIES>())... } };
+}
@@ -27,11 +27,6 @@ HoloNetwork::~HoloNetwork()
 {
 }
 
-void HoloNetwork::delete_fun_package(Package input) {
-	delete[] input.content;
-	input.content = NULL;
-}
-
 void HoloNetwork::RunServer() {
 	DWORD WORKER_THREAD_COUNT = (DWORD)MaxWorkerThreadNum;		// This is equal to the MaxWorkerThreadNum. But becasue WinAPI requires DWORD type, we just give them a one.
 
@@ -65,18 +60,15 @@ void HoloNetwork::RunServer() {
 	// Associate the server socket with the I/O Completion Port
 	CreateIoCompletionPort((HANDLE)ServerSocket, IocpHandle, COMPLETION_KEY_IO, 0);
 
+	// Allocate an vector of connections pointer
+	for (int i = 0; i < MaxClientNum; i++) {
+		Connections.push_back(new Connection(ServerSocket, IocpHandle, i, &source));
+	}
+
 	// Create worker threads
-	TQueue<Package> tq_reference(1, delete_fun_package);		// By experiment, I find out that the smaller the capacity is, the less likely will the video have glitch. This behavior is coherent with the original mutex-lock design as the original design only have one frame buffer. I set the capacity to 1 here so that we will have the best video quality. Of cause, you can just use c++ <atomic> to achieve similar result without using TQueue, and that may have less overhead. It is a future work for anyone who is interested in. 
 	for (int i = 0; i < MaxWorkerThreadNum; i++) {
-		// Each worker thread will have a unique TQueue
-		worker_tqs.push_back(tq_reference);		
 		WorkerThreads.push_back(thread(&HoloNetwork::WorkerFunction, this, IocpHandle, i));
 	}
-
-	// Allocate an vector of connections pointer
-	for (int i = 0; i < MaxClientNum; i++) {
-		Connections.push_back(new Connection(ServerSocket, IocpHandle, i));
-	}
 }
 
 void HoloNetwork::CloseServer() {
@@ -107,23 +99,39 @@ void HoloNetwork::CloseServer() {
 	return;
 }
 
-void HoloNetwork::UpdateBuffer(char *dataIn, int dataLen) {
-	if (dataLen < 0) {
+void HoloNetwork::UpdateBuffer(const StreamFrame &frame) {
+	if (frame.empty()) {
 		return;
 	}
 	
-	// Send the latest data to each worker's TQueue
-	for (int i = 0; i < MaxWorkerThreadNum; i++) {
-		// Copy the dataIn
-		Package new_pkg;
-		new_pkg.content = new char[dataLen];
-		for (int i = 0; i < dataLen; i++) {
-			new_pkg.content[i] = dataIn[i];
+	// The frames are shared, not copied: they go back to the pool when the last send of them is done.
+	// Publish before the wakes, a connection that parks after its wake check finds the frame itself
+	source.Publish(frame);
+	for (size_t i = 0; i < Connections.size(); i++) {
+		if (Connections[i]->NeedsWake()) {
+			PostQueuedCompletionStatus(IocpHandle, 0, COMPLETION_KEY_WAKE, Connections[i]);
 		}
-		new_pkg.length = dataLen;
+	}
+}
 
-		worker_tqs[i].push(new_pkg);
+int HoloNetwork::GetClientCount() const {
+	int count = 0;
+	for (size_t i = 0; i < Connections.size(); i++) {
+		if (Connections[i]->IsClientConnected()) {
+			count++;
+		}
 	}
+	return count;
+}
+
+int HoloNetwork::GetStreamClientCount(StreamFormat format) const {
+	int count = 0;
+	for (size_t i = 0; i < Connections.size(); i++) {
+		if (Connections[i]->GetStreamFormat() == format) {
+			count++;
+		}
+	}
+	return count;
 }
 
 SOCKET HoloNetwork::SetupServer() {
@@ -184,10 +192,6 @@ SOCKET HoloNetwork::SetupServer() {
 }
 
 void HoloNetwork::WorkerFunction(HANDLE IoPort, int idx) {
-	// Create a variable to hold the most recent frame data
-	char *LocalData = NULL;
-	int LocalDataLen = 0; 
-
 	// Run the loop
 	while (TRUE) {
 		// Create variables to store the result of the iocp
@@ -199,47 +203,37 @@ void HoloNetwork::WorkerFunction(HANDLE IoPort, int idx) {
 		Status = GetQueuedCompletionStatus(reinterpret_cast<HANDLE>(IoPort),
 			&NumTransferred, &CompletionKey, &Overlapped_ptr, INFINITE);
 
-		// Try to get the latest data of the NIR image
-		Package empty_pkg;
-		Package new_pkg = worker_tqs[idx].pop(empty_pkg);
-		if (new_pkg.content != NULL) {
-			// Replace the old data 
-			delete[] LocalData;
-			LocalData = new_pkg.content;
-			LocalDataLen = new_pkg.length;
+		if (CompletionKey == COMPLETION_KEY_SHUTDOWN) {
+			// Clean up and terminate the thread
+			break;
+		}
+		if (Overlapped_ptr == NULL) {
+			continue;
 		}
 
-		// Convert the overlapped pointer to Connection
-		Connection *Conn_ptr = reinterpret_cast<Connection*>(Overlapped_ptr);
+		// Convert the overlapped pointer to the I/O of a connection
+		ConnectionIo *Io_ptr = static_cast<ConnectionIo*>(Overlapped_ptr);
 
-		if (FALSE == Status) {
+		if (CompletionKey == COMPLETION_KEY_WAKE) {
+			// A new frame for a parked connection
+			static_cast<Connection*>(Io_ptr)->OnWake();
+		}
+		else if (Io_ptr->ioType == ConnectionIo::IO_STREAM_SEND) {
+			StreamSend *Send_ptr = static_cast<StreamSend*>(Io_ptr);
+			Send_ptr->owner->OnStreamSendComplete(Send_ptr, Status);
+		}
+		else if (Io_ptr->ioType == ConnectionIo::IO_STREAM_RECV) {
+			StreamRecv *Recv_ptr = static_cast<StreamRecv*>(Io_ptr);
+			Recv_ptr->owner->OnStreamRecvComplete(Status);
+		}
+		else if (FALSE == Status) {
 			// An error occurred; reset connection
-			if (Conn_ptr) {
-				PRINT_WSAERROR("GetQueuedCompletionStatus() returns FALSE with error");
-				//DebugLog("Restarting the connection.");
-				// Reset connection
-				Conn_ptr->IssueReset();
-			}
+			PRINT_WSAERROR("GetQueuedCompletionStatus() returns FALSE with error");
+			//DebugLog("Restarting the connection.");
+			static_cast<Connection*>(Io_ptr)->OnIoFailed();
 		}
 		else if (CompletionKey == COMPLETION_KEY_IO) {
-			WSABUF DataToSend;
-			if (LocalData == NULL) {
-				DataToSend.len = 0;
-				DataToSend.buf = (CHAR*)LocalData;
-			}
-			else {
-				DataToSend.len = LocalDataLen;
-				DataToSend.buf = (CHAR*)LocalData;
-			}
-
-			Conn_ptr->OnIoComplete(DataToSend);
-		}
-		else if (CompletionKey == COMPLETION_KEY_SHUTDOWN) {
-			// Clean up and terminate the thread
-			break;
+			static_cast<Connection*>(Io_ptr)->OnIoComplete();
 		}
 	}
-
-	delete[] LocalData;
-	LocalData = NULL;
 }
@@ -1,7 +1,7 @@
 #pragma once
 #include "Connection.h"
 #include "Common.h"
-#include "TQueue.h"
+#include "Frame.h"
 
 #include <string>
 #include <thread>
@@ -31,31 +31,27 @@ public:
 	void RunServer();
 
 	/*
-	Update the internal FramePtr to the one pointed by dataIn. (It will perform a deep copy. Hence, it is user's responsibility to clean up dataIn)
-	dataIn: the data to be copied
-	dataLen: the length of dataIn that will be copied
+	Publish frame to the streaming clients and wake the connections that wait for it. The connections send from the frames
+	of frame directly, so the caller must not write them anymore (acquire new frames for the next update)
+	frame: the encoded frames, one per stream format
 	*/
-	void UpdateBuffer(char *dataIn, int dataLen);
+	void UpdateBuffer(const StreamFrame &frame);
+
+	// The number of clients that are connected right now
+	int GetClientCount() const;
+
+	// The number of clients that stream in format right now
+	int GetStreamClientCount(StreamFormat format) const;
 
 	void CloseServer();
 
 	/*
 	thread function that handles the connections
-	idx: use this index to get the corresponding TQueue in the worker_tqs
+	idx: the index of the worker
 	*/
 	void WorkerFunction(HANDLE IoPort, int idx);	// The worker function is put in public otherwise we cannot thread it. (Maybe?This is based on my memory.)
 
 private:
-	// A class for the data transportation between main thread and worker threads
-	class Package {
-	public:
-		int length;
-		char *content;
-		Package() {
-			length = 0; content = NULL;
-		};
-	};
-
 	std::shared_ptr<spdlog::logger> _logger;
 
 	string ServerIp; 
@@ -80,11 +76,7 @@ private:
 	*/
 	SOCKET SetupServer();
 
-	//Vector of TQueue
-	vector<TQueue<Package>> worker_tqs; 
-
-	//Delete function for TQueue
-	//The function is declared as static so it does not rely on a object to create this function
-	//See: https://stackoverflow.com/questions/12662891/passing-a-member-function-as-an-argument-in-c
-	static void delete_fun_package(Package input);
+	// The latest frames of the streaming connections
+	//The frames are returned to the FramePool when the last FrameRef goes, so no delete function is needed
+	StreamSource source;
 };
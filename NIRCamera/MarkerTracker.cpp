@@ -0,0 +1,135 @@
+#include "MarkerTracker.h"
+
+#include "opencv2/imgproc.hpp"
+#include "opencv2/cudawarping.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace cv;
+
+MarkerTracker::MarkerTracker(cv::Size imageSize, int downFactor)
+{
+	ImageSize = imageSize;
+	DownFactor = downFactor < 1 ? 1 : downFactor;
+
+	cv::Size smallSize(ImageSize.width / DownFactor, ImageSize.height / DownFactor);
+	SmallGpu.create(smallSize, CV_8UC1);
+	Small.create(smallSize, CV_8UC1);
+	Binary.create(smallSize, CV_8UC1);
+
+	cost = 0;
+	frameCount = 0;
+	_logger = spdlog::stdout_color_mt("MarkerTracker");
+}
+
+MarkerTracker::~MarkerTracker()
+{
+}
+
+/*
+Comparator for the marker positions
+*/
+static bool SortbyXaxis(const Point2f &a, const Point2f &b)
+{
+	return a.x < b.x;
+}
+
+bool MarkerTracker::Track(const cuda::GpuMat &scaledImage, Calibrator &calibrator) {
+	int64 startTick = getTickCount();
+
+	// Downsample on the GPU (INTER_AREA also smooths the noise, like the blur of the circle detection)
+	// and only download the small image
+	cuda::resize(scaledImage, SmallGpu, SmallGpu.size(), 0, 0, INTER_AREA);
+	SmallGpu.download(Small);
+
+	threshold(Small, Binary, MARKER_THRESHOLD, 255, THRESH_BINARY);
+
+	vector<Point2f> found;
+	if (!FindMarkers(found)) {
+		// Keep the last calibration until the markers are visible again
+		UpdateCost(startTick);
+		return false;
+	}
+
+	// Smooth the positions over frames to suppress the jitter of the centroids
+	if (Markers.size() != found.size()) {
+		Markers = found;
+	}
+	else {
+		for (size_t i = 0; i < Markers.size(); i++) {
+			Markers[i] += (found[i] - Markers[i]) * MARKER_SMOOTHING;
+		}
+	}
+
+	// Only rebuild the homography (and its remap tables) when a marker has actually moved
+	bool moved = PublishedMarkers.size() != Markers.size() || !calibrator.IsCalibrated();
+	for (size_t i = 0; !moved && i < Markers.size(); i++) {
+		Point2f d = Markers[i] - PublishedMarkers[i];
+		moved = fabs(d.x) > MARKER_UPDATE_TOLERANCE || fabs(d.y) > MARKER_UPDATE_TOLERANCE;
+	}
+
+	if (moved) {
+		calibrator.Publish(calibrator.MarkersToPerspective(Markers));
+		PublishedMarkers = Markers;
+	}
+
+	UpdateCost(startTick);
+	return true;
+}
+
+void MarkerTracker::Reset() {
+	Markers.clear();
+	PublishedMarkers.clear();
+}
+
+double MarkerTracker::GetCost() const {
+	return cost;
+}
+
+bool MarkerTracker::FindMarkers(vector<Point2f> &found) {
+	// 8-connected labelling; CV_16U labels are enough for the downsampled image
+	int count = connectedComponentsWithStats(Binary, Labels, Stats, Centroids, 8, CV_16U);
+
+	// Label 0 is the background, keep the components that are large enough to be a marker
+	vector<int> candidates;
+	for (int label = 1; label < count; label++) {
+		if (Stats.at<int>(label, CC_STAT_AREA) >= MARKER_MIN_AREA) {
+			candidates.push_back(label);
+		}
+	}
+
+	if (candidates.size() < 4) {
+		return false;
+	}
+
+	// The four largest components are the markers
+	Mat &stats = Stats;
+	std::partial_sort(candidates.begin(), candidates.begin() + 4, candidates.end(),
+		[&stats](int a, int b) { return stats.at<int>(a, CC_STAT_AREA) > stats.at<int>(b, CC_STAT_AREA); });
+
+	// Map the centroids back to full resolution
+	found.resize(4);
+	for (int i = 0; i < 4; i++) {
+		int label = candidates[i];
+		float cx = (float)Centroids.at<double>(label, 0);
+		float cy = (float)Centroids.at<double>(label, 1);
+		found[i] = Point2f((cx + 0.5f) * DownFactor - 0.5f, (cy + 0.5f) * DownFactor - 0.5f);
+	}
+
+	// Same ordering as the calibration, so that the markers can be matched between frames
+	std::sort(found.begin(), found.end(), SortbyXaxis);
+
+	return true;
+}
+
+void MarkerTracker::UpdateCost(int64 startTick) {
+	double frameCost = (getTickCount() - startTick) * 1000.0 / getTickFrequency();
+	cost = (frameCount == 0) ? frameCost : 0.9 * cost + 0.1 * frameCost;
+
+	// Report once every 120 frames (about a second) when tracking runs over its budget
+	frameCount++;
+	if (frameCount % 120 == 0 && cost > MARKER_TRACKING_BUDGET_MS) {
+		_logger->warn("Marker tracking takes {0:.3f} ms per frame, the budget is {1} ms.", cost, MARKER_TRACKING_BUDGET_MS);
+	}
+}
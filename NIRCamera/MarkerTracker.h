@@ -0,0 +1,81 @@
+#pragma once
+
+#include "Calibrator.h"
+
+#include "opencv2/core.hpp"
+#include "opencv2/core/cuda.hpp"
+#include "spdlog/spdlog.h"
+
+#include <vector>
+
+using namespace std;
+
+// Binary threshold that separates the calibration circles from the background (same value as the circle detection)
+#define MARKER_THRESHOLD 200
+// Components smaller than this (in downsampled pixels) are treated as noise
+#define MARKER_MIN_AREA 3
+// Weight of the new measurement when the marker positions are smoothed over frames
+#define MARKER_SMOOTHING 0.5f
+// The homography is only rebuilt when a marker has moved further than this (in full resolution pixels)
+#define MARKER_UPDATE_TOLERANCE 0.5f
+// Per-frame time budget of Track() in ms. Exceeding it is reported in the log
+#define MARKER_TRACKING_BUDGET_MS 1.0
+
+/*
+MarkerTracker re-estimates the four calibration markers on every frame, so that the perspective
+calibration follows the camera or the target when they move.
+
+Instead of the blur + Canny + findContours chain used by the one-shot calibration, the scaled image is
+downsampled on the GPU, only the small image is downloaded, and the markers are found by thresholding and
+connected-component labelling. This keeps the cost of a frame well below MARKER_TRACKING_BUDGET_MS.
+*/
+class MarkerTracker
+{
+public:
+	/*
+	imageSize: the size of the scaled image
+	downFactor: the downsample factor applied before the markers are searched
+	*/
+	MarkerTracker(cv::Size imageSize, int downFactor);
+	~MarkerTracker();
+
+	/*
+	Locate the markers in scaledImage. If they have moved since the last published calibration,
+	an updated perspective transformation is published to calibrator.
+	Return TRUE if the four markers are found in this frame.
+	*/
+	bool Track(const cv::cuda::GpuMat &scaledImage, Calibrator &calibrator);
+
+	/*
+	Forget the tracked marker positions. The next Track() starts from scratch.
+	*/
+	void Reset();
+
+	// The smoothed cost of Track() in ms
+	double GetCost() const;
+
+private:
+	cv::Size ImageSize;
+	int DownFactor;
+
+	// Work buffers, allocated once
+	cv::cuda::GpuMat SmallGpu;
+	cv::Mat Small;
+	cv::Mat Binary;
+	cv::Mat Labels;
+	cv::Mat Stats;
+	cv::Mat Centroids;
+
+	vector<cv::Point2f> Markers;				// Smoothed marker positions in full resolution, sorted by x
+	vector<cv::Point2f> PublishedMarkers;		// Marker positions used by the published calibration
+
+	double cost;
+	int frameCount;
+
+	std::shared_ptr<spdlog::logger> _logger;
+
+	// Find the four largest components in Binary. Return FALSE if there are less than four
+	bool FindMarkers(vector<cv::Point2f> &found);
+
+	void UpdateCost(int64 startTick);
+};
@@ -1,7 +1,19 @@
 #include "Common.h"
-#include "TQueue.h"
+#include "Pipeline.h"
+#include "Frame.h"
+#include "ThreadPool.h"
+#include "PixelKernels.h"
 #include "NirImager.h"
 #include "HoloNetwork.h"
+#include "Calibrator.h"
+#include "MarkerTracker.h"
+#include "SensorCorrection.h"
+#include "TemporalFilter.h"
+#include "HistogramEngine.h"
+#include "AutoExposure.h"
+#include "ColorTable.h"
+#include "HoloColorTable.h"
+#include "ControlServer.h"
 
 // Include the OpenCV library  
 #include "opencv2/highgui.hpp"
@@ -22,27 +34,35 @@
 #include <thread>
 
 #define FRAMES_PER_TRANSFER 4
-#define NUMBER_BUFFER 5
-#define BUFFER_SIZE 648*488*FRAMES_PER_TRANSFER
 #define IMAGE_HEIGHT 488
 #define IMAGE_WIDTH 648
 #define IMAGE_SATURATION_THRESHOLD 0.5
+#define SENSOR_CAPTURE_FRAMES 64		// Number of frames averaged into a dark frame or a flat field
+#define PIPELINE_CONFIG_FILE "pipeline.cfg"		// Next to the executable, the one place the pipeline is configured
+#define PIPELINE_REPORT_INTERVAL_MS 10000		// Interval of the per-stage timing report
+#define DISPLAY_COLORMAP COLORMAP_JET		// OpenCV colormap of the display (COLORMAP_HOT, COLORMAP_BONE, ...)
+#define DISPLAY_DEFAULT_REFRESH_HZ 60		// Present rate when the refresh rate of the monitor is unknown
+#define DISPLAY_EVENT_WAIT_MS 5		// Longest time the GUI waits for events before it looks for a new image
+#define BENCHMARK_FRAMES 1000		// Frames per kernel of "NIRCamera --benchmark"
 
 using namespace std;
 using namespace cv;
 
-// Interthread Image Buffer
-UINT16 *ImageBuffer[NUMBER_BUFFER];
-UINT16 *SaveBuffer[NUMBER_BUFFER];
-UINT16 *NetworkBuffer[NUMBER_BUFFER];
-
-// TQueue for different thread
-TQueue<UINT16*> *ProcessDatatq;
-TQueue<UINT16*> *Savetq;
-TQueue<cuda::GpuMat*> *Displaytq;
-TQueue<cuda::GpuMat*> *Networktq;
+/*
+The path of fileName next to the executable (the build copies PIPELINE_CONFIG_FILE there), whatever the working directory is
+*/
+string ExecutableFilePath(const string &fileName) {
+	char path[MAX_PATH];
+	DWORD length = GetModuleFileNameA(NULL, path, MAX_PATH);
+	if (length == 0 || length == MAX_PATH) {
+		return fileName;
+	}
+	string directory(path, length);
+	return directory.substr(0, directory.find_last_of("\\/") + 1) + fileName;
+}
 
-static volatile int stop_running;
+// The stages and the threads they run on
+Pipeline *pipeline = NULL;
 
 // States for read thread
 // Connect: Connecting to the FPGA
@@ -56,8 +76,12 @@ SaveDataState saveState = Idle;
 
 // Event signal for reconnecting the FPGA
 HANDLE connect_FPGA_event = INVALID_HANDLE_VALUE;
+// Event signal for quitting the program, set when the user presses q in the window
+HANDLE quit_event = INVALID_HANDLE_VALUE;
 // Will be true if user click buttom to change the exposure
 bool request_change_exposure = false;
+// Set when the exposure is changed by hand, the auto exposure waits a full interval before it adjusts it again
+bool manual_exposure_change = false;
 
 // Global variable for Slider GUI
 int exposure_slider = 30;
@@ -69,16 +93,20 @@ const int rgba_alpha_slider_max = 15;
 // The logger for out top-level process
 std::shared_ptr<spdlog::logger> _logger;
 
-// ----------- Read Thread -----------
+// ----------- Acquire Stage -----------
 
 /*
-Thread function for reading data from Imager
-Reading from FPGA is usually 1/120 s. Its slowness can be utilized for designing the TQueue.
+Read the data from the Imager and split every transfer into single raw frames (FRAME_FORMAT_GRAY16)
+Reading from FPGA is usually 1/120 s and blocks, so this stage should have a thread of its own.
 */
-void ReadData() {
-	NirImager imager;
+class AcquireStage : public PipelineStage {
+public:
+	AcquireStage() : PipelineStage("acquire"), out("out") {
+		AddOutput(&out);
+		frameSequence = 0;
+	}
 
-	while (!stop_running) {
+	bool Process() {
 		switch (readState) {
 		case Connect: {
 			double exposure = 0.03;
@@ -91,7 +119,7 @@ void ReadData() {
 				WaitForSingleObject(connect_FPGA_event, INFINITE);
 				readState = Connect;
 			}
-			break;
+			return false;
 		}
 		case Working: {
 			if (request_change_exposure) {
@@ -104,269 +132,470 @@ void ReadData() {
 
 				request_change_exposure = false;
 				_logger->info("Imager's exposure has adjusted.");
+				return true;
 			}
-			else {
-				unsigned char *rdata = NULL;
-				//rdata = generate_dummy_data(BUFFER_SIZE*2);	// get dummy data
-				rdata = imager.readImagerData();
-
-				UINT16 *ProcessDataBuf = NULL;
-				UINT16 *SaveBuf = NULL;
 
-				if (rdata != NULL) {
-					// Data read is valid
-					ProcessDataBuf = new UINT16[BUFFER_SIZE];
-					SaveBuf = new UINT16[BUFFER_SIZE];
-					for (int PixCount = 0; PixCount < BUFFER_SIZE; PixCount++) {
-						int index = PixCount * 2;
+			// The transfer is read into a pooled buffer
+			FrameRef transfer = FramePool::Shared().Acquire(FRAME_FORMAT_RAW8, READ_SIZE, 1, FRAME_STORAGE_HOST);
+			const unsigned char *rdata = transfer->Ptr<unsigned char>();
 
-						int lowBit = rdata[index];
-						int highBit = rdata[index + 1];
-						int origBit = rdata[index];
-
-						ProcessDataBuf[PixCount] = origBit + (highBit << 8);
-						SaveBuf[PixCount] = (highBit << 8) + lowBit;
-					}
+			if (!imager.readImagerData(transfer->Ptr<unsigned char>())) {
+				_logger->warn("AcquireStage: Read from imager failed. Please reconnect the FPGA imager.");
+				readState = Connect;
+				WaitForSingleObject(connect_FPGA_event, INFINITE);
+				return false;
+			}
 
-					// Feed the data to TQueue
-					ProcessDatatq->push(ProcessDataBuf);
-					Savetq->push(SaveBuf);
+			LARGE_INTEGER captureTime;
+			QueryPerformanceCounter(&captureTime);
 
-					delete[] rdata;
-				}
-				else {
-					_logger->warn("ReadData(): Read from imager failed. Please reconnect the FPGA imager.");
-					readState = Connect;
-					WaitForSingleObject(connect_FPGA_event, INFINITE);
-				}
+			// rdata contains FRAMES_PER_TRANSFER frames of picture, 2 bytes per pixel (low byte first)
+			for (int i = 0; i < FRAMES_PER_TRANSFER; i++) {
+				FrameRef frame = FramePool::Shared().Acquire(FRAME_FORMAT_GRAY16, IMAGE_WIDTH, IMAGE_HEIGHT, FRAME_STORAGE_HOST);
+				frame->sequence = frameSequence++;
+				frame->captureTime = captureTime.QuadPart;
+				frame->exposure = exposure_slider;
+
+				UINT16 *FrameData = frame->Ptr<UINT16>();
+				const unsigned char *FrameBytes = rdata + i * IMAGE_HEIGHT * IMAGE_WIDTH * 2;
+				ThreadPool::Shared().ParallelRows(IMAGE_WIDTH, IMAGE_HEIGHT, [&](int firstRow, int lastRow) {
+					UnpackLE16Rows<IMAGE_WIDTH>(FrameBytes, FrameData, IMAGE_WIDTH, firstRow, lastRow);
+				});
+
+				out.Push(frame);
 			}
-			break;
+
+			return true;
 		}
 		}
+		return false;
 	}
-}
 
-// ----------- Process Data Thread -----------
+	void Wake() {
+		// In case the stage is still waiting for the connect_FPGA_event
+		SetEvent(connect_FPGA_event);
+	}
+
+private:
+	NirImager imager;
+	OutputPort<FrameRef> out;
+	UINT64 frameSequence;
+};
+
+// ----------- Processing Stages -----------
 
 int threshold_low_slider = 0;
 int threshold_high_slider = 255;
 BOOL RequestCalibration = FALSE;		// Variable indicates whether the user want to calibration  
 BOOL RestoreCalibration = FALSE;
+BOOL TrackMarkers = FALSE;				// Re-estimate the calibration markers on every frame
+SensorCaptureMode RequestSensorCapture = SENSOR_CAPTURE_NONE;		// Set by the GUI to start a dark frame/flat field capture
+BOOL AutoContrastEnabled = FALSE;		// Derive the scale and the thresholds from the histogram instead of the sliders
+BOOL AutoExposureEnabled = FALSE;		// Let the warp stage adjust the imager exposure
 
-/*
-Save the perspective transformation matrix into a file
-*/
-void SavePersTranMat(Mat PersTranMat) {
-	FileStorage file("calibrationMat.xml", cv::FileStorage::WRITE);
-
-	// Write to file!
-	file << "PersTransMat" << PersTranMat;
-	file.release();
-}
+// Per-frame histogram, fed by the scale stage and published for other consumers
+HistogramEngine *histogram = NULL;
 
 /*
-Load the perspective transformation matrix from a file
+Detect whether the image (8 bit, on the host) is saturated.
+return true if the image is saturated.
 */
-bool LoadPersTranMat(Mat &PersTranMat) {
-	FileStorage file;
-	if (file.open("calibrationMat.xml", cv::FileStorage::READ)) {
-		file["PersTransMat"] >> PersTranMat;
-		file.release();
-		return TRUE;
+bool SaturationDetection(const Frame &Image) {
+	atomic<UINT64> PixelSum(0);
+	const UINT8 *pixels = Image.Ptr<UINT8>();
+	ThreadPool::Shared().ParallelRows(Image.width, Image.height, [&](int firstRow, int lastRow) {
+		if (Image.width == IMAGE_WIDTH && Image.stride == IMAGE_WIDTH) {
+			PixelSum += SumRows<IMAGE_WIDTH>(pixels, Image.stride, Image.width, firstRow, lastRow);
+		}
+		else {
+			PixelSum += SumRows<PIXEL_KERNEL_GENERIC>(pixels, Image.stride, Image.width, firstRow, lastRow);
+		}
+	});
+	if (PixelSum > 255 * IMAGE_HEIGHT*IMAGE_WIDTH*IMAGE_SATURATION_THRESHOLD) {
+		return true;
 	}
 	else {
-		return FALSE;
+		return false;
 	}
 }
 
 /*
-Comparator for Circle Detection
+Fixed-pattern noise correction of the raw frames (dark frame, gain map and defect map)
+A dark frame/flat field capture also runs while the stage is disabled.
 */
-bool SortbyXaxis(const Point & a, const Point &b)
-{
-	return a.x < b.x;
-}
-
-/*
-Perform dectection on the four calibration circles in the image
-Return TRUE if calibration success, FALSE otherwise
+class CorrectStage : public PipelineStage {
+public:
+	CorrectStage() : PipelineStage("correct"), in("in"), out("out"), sensorCorrection(IMAGE_WIDTH, IMAGE_HEIGHT) {
+		AddInput(&in);
+		AddOutput(&out);
+	}
 
-Bug: what if the image is empty, first pointer is null
-*/
-bool CircleDetection(cuda::GpuMat OrigDisplay, Mat &PersTransMat) {
-	Mat SrcGray;
-	OrigDisplay.download(SrcGray);
+	bool Process() {
+		FrameRef frame;
+		if (!in.Pop(frame)) {
+			return false;
+		}
+		Capture(*frame);
 
-	// Blur the image in order to reduce the noice from original image
-	Mat BlurredDisplay;
-	blur(SrcGray, BlurredDisplay, cv::Size(10, 10));	// blur matrix (10,10) is picked by experiments
+		// The input frame may be shared with other consumers (e.g. save), don't modify it
+		FrameRef corrected = FramePool::Shared().Acquire(FRAME_FORMAT_GRAY16, frame->width, frame->height, FRAME_STORAGE_HOST);
+		corrected->CopyMetadata(*frame);
+		sensorCorrection.Apply(frame->Ptr<UINT16>(), corrected->Ptr<UINT16>());
+		out.Push(corrected);
+		return true;
+	}
 
-														// thresh == 200 is picked by experiments
-	int thresh = 200;
-	const double MAX_BINARY_VALUE = 255;
-	Mat ThresholdDisplay;
+	bool Bypass() {
+		FrameRef frame;
+		if (!in.Pop(frame)) {
+			return false;
+		}
+		Capture(*frame);
+		out.Push(frame);
+		return true;
+	}
 
-	// Perform type 0 threshold (Binary threshold)
-	threshold(BlurredDisplay, ThresholdDisplay, thresh, MAX_BINARY_VALUE, 0);
+	bool HasDemand() const {
+		// A dark frame/flat field capture needs the frames even if nothing is shown
+		return RequestSensorCapture != SENSOR_CAPTURE_NONE || sensorCorrection.IsCapturing();
+	}
 
-	// Edge detection with canny 
-	Mat CannyOutput;
-	Canny(ThresholdDisplay, CannyOutput, thresh, thresh * 3, 3);	// threshold1 = thresh; threshold2 = thresh * 3 are picked by experiments
+private:
+	InputPort<FrameRef> in;
+	OutputPort<FrameRef> out;
+	SensorCorrection sensorCorrection;
 
-																	// Find contours
-	std::vector<std::vector<cv::Point>> contours;
-	std::vector<cv::Vec4i> hierarchy;
-	findContours(CannyOutput, contours, hierarchy, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE, Point(0, 0));
+	void Capture(const Frame &frame) {
+		// Sensor correction works on the raw values, so the capture must see the frame before it is corrected
+		if (RequestSensorCapture != SENSOR_CAPTURE_NONE) {
+			sensorCorrection.BeginCapture(RequestSensorCapture, SENSOR_CAPTURE_FRAMES);
+			RequestSensorCapture = SENSOR_CAPTURE_NONE;
+		}
+		sensorCorrection.Accumulate(frame.Ptr<UINT16>());
+	}
+};
 
-	// If the detected contour points are less than 4, then this detection is invalid. Return Identity matrix 
-	if (contours.size() < 4) {
-		PersTransMat = Mat::eye(3, 3, CV_64FC1);
-		return false;
+/*
+Temporal denoising of the raw frames
+*/
+class DenoiseStage : public PipelineStage {
+public:
+	DenoiseStage() : PipelineStage("denoise"), in("in"), out("out"), temporalFilter(IMAGE_WIDTH, IMAGE_HEIGHT) {
+		AddInput(&in);
+		AddOutput(&out);
 	}
 
-	std::vector<Moments> mu(contours.size());
-	for (int i = 0; i < contours.size(); i++) {
+	bool Process() {
+		FrameRef frame;
+		if (!in.Pop(frame)) {
+			return false;
+		}
+		FrameRef filtered = FramePool::Shared().Acquire(FRAME_FORMAT_GRAY16, frame->width, frame->height, FRAME_STORAGE_HOST);
+		filtered->CopyMetadata(*frame);
+		temporalFilter.Apply(frame->Ptr<UINT16>(), filtered->Ptr<UINT16>());
+		out.Push(filtered);
+		return true;
+	}
 
-		mu[i] = moments(contours[i], false);
+	bool Bypass() {
+		// The accumulator is kept, the filter restarts from the next frame once enabled again
+		temporalFilter.Reset();
+		return PipelineStage::Bypass();
 	}
 
-	// Find the mass centers of each circle (point); Note the getPerspectiveTransform accept Point2f but not Point2d
-	std::vector<Point2f> mc(contours.size());
-	for (int i = 0; i < contours.size(); i++) {
-		mc[i] = Point2f(float(mu[i].m10 / mu[i].m00), float(mu[i].m01 / mu[i].m00));
+private:
+	InputPort<FrameRef> in;
+	OutputPort<FrameRef> out;
+	TemporalFilter temporalFilter;
+};
+
+/*
+Compute the histogram of the raw frame, scale it to 8 bit and load it into the GPU
+The scaling runs on the CPU (in row bands), so only the 8 bit image is loaded into the GPU, half the bytes of the raw frame.
+*/
+class ScaleStage : public PipelineStage {
+public:
+	ScaleStage() : PipelineStage("scale"), in("in"), out("out"), ScaledImage(IMAGE_HEIGHT, IMAGE_WIDTH, CV_8UC1) {
+		AddInput(&in);
+		AddOutput(&out);
 	}
 
-	std::vector<Point2f> OrigCoordiate(mc.begin(), next(mc.begin(), 4));
-	std::sort(OrigCoordiate.begin(), OrigCoordiate.end(), SortbyXaxis);
+	bool Process() {
+		FrameRef frame;
+		if (!in.Pop(frame)) {
+			return false;
+		}
 
-	// Generate Perspective adjusted image
-	std::vector<Point2f> AdjustCoordiate(4);
-	AdjustCoordiate[0] = Point2f(0, IMAGE_HEIGHT);
-	AdjustCoordiate[1] = Point2f(IMAGE_WIDTH / 4, 0);
-	AdjustCoordiate[2] = Point2f(IMAGE_WIDTH / 4 * 3, 0);
-	AdjustCoordiate[3] = Point2f(IMAGE_WIDTH, IMAGE_HEIGHT);
+		histogram->Process(frame->Ptr<UINT16>());
 
-	// Calculate the transformation matrix
-	PersTransMat = getPerspectiveTransform(OrigCoordiate, AdjustCoordiate);
+		// The number 256 means we want to restain the pixel value in the range of (0,255). The nuber 24 is picked by experiment.
+		double scale = 24.0 / 256.0;
+		double scaleOffset = 0;
+		if (AutoContrastEnabled) {
+			AutoLevels levels = histogram->GetLevels();
+			scale = levels.scale;
+			scaleOffset = levels.offset;
+		}
 
-	return true;
-}
+		// Adjust the pixel value in the image
+		ScaledImage.create(frame->height, frame->width, CV_8UC1);
+		const UINT16 *raw = frame->Ptr<UINT16>();
+		const size_t rawStride = frame->stride;
+		const bool fixedWidth = frame->width == IMAGE_WIDTH && rawStride == IMAGE_WIDTH * 2 && ScaledImage.isContinuous();
+		ThreadPool::Shared().ParallelRows(frame->width, frame->height, [&](int firstRow, int lastRow) {
+			if (fixedWidth) {
+				Scale16To8Rows<IMAGE_WIDTH>(raw, rawStride, ScaledImage.data, ScaledImage.step, (float)scale, (float)scaleOffset,
+					frame->width, firstRow, lastRow);
+			}
+			else {
+				Scale16To8Rows<PIXEL_KERNEL_GENERIC>(raw, rawStride, ScaledImage.data, ScaledImage.step, (float)scale, (float)scaleOffset,
+					frame->width, firstRow, lastRow);
+			}
+		});
+
+		// Load the image into GPU. The warp stage may run on another thread, so every frame gets its own pooled buffer
+		FrameRef scaled = FramePool::Shared().Acquire(FRAME_FORMAT_GRAY8, frame->width, frame->height, FRAME_STORAGE_DEVICE);
+		scaled->CopyMetadata(*frame);
+		scaled->device.upload(ScaledImage);
+
+		out.Push(scaled);
+		return true;
+	}
+
+private:
+	InputPort<FrameRef> in;
+	OutputPort<FrameRef> out;
+	Mat ScaledImage;		// (8 bit per element)
+};
 
 /*
-Detect whether the image is saturated.
-return true if the image is saturated.
+Calibrate the image (perspective warp), threshold it and drop the saturated frames.
+The auto exposure is driven from here because this is where the saturation is known.
+The result is downloaded once into a host frame, the stages behind it (despeckle, colorize, encode) all work on the CPU.
 */
-bool SaturationDetection(cuda::GpuMat Image) {
-	Scalar PixelSum = cuda::sum(Image);
-	if (PixelSum[0] > 255 * IMAGE_HEIGHT*IMAGE_WIDTH*IMAGE_SATURATION_THRESHOLD) {
+class WarpStage : public PipelineStage {
+public:
+	WarpStage() : PipelineStage("warp"), in("in"), out("out"),
+		calibrator(cv::Size(IMAGE_WIDTH, IMAGE_HEIGHT)),
+		tracker(cv::Size(IMAGE_WIDTH, IMAGE_HEIGHT), 4),		// Downsample by 4 before searching the markers
+		ThresholdLowImageGpu(IMAGE_HEIGHT, IMAGE_WIDTH, CV_8UC1),
+		ThresholdHighImageGpu(IMAGE_HEIGHT, IMAGE_WIDTH, CV_8UC1),
+		TransformDisplayGpu(IMAGE_HEIGHT, IMAGE_WIDTH, CV_8UC1) {
+		AddInput(&in);
+		AddOutput(&out);
+	}
+
+	bool Process() {
+		FrameRef input;
+		if (!in.Pop(input)) {
+			return false;
+		}
+
+		// ScaleDisplayGpu will have the calibrated image information
+		const cuda::GpuMat &ScaleDisplayGpu = input->device;
+
+		// The threshold belongs to the same auto levels as the scale (up to the smoothing). The auto scale already
+		// maps the high percentile to 255, so there is nothing left to stretch
+		shared_ptr<const HistogramSnapshot> stats = histogram->Latest();
+		int thresholdLow = threshold_low_slider;
+		int thresholdHigh = threshold_high_slider;
+		if (AutoContrastEnabled && stats != NULL) {
+			thresholdLow = stats->levels.thresholdLow;
+			thresholdHigh = 255;
+		}
+
+		// Pick up the result of the background calibration job (if any)
+		if (calibrator.CollectJob() == CALIBRATION_JOB_FAILED) {
+			RequestCalibration = FALSE;
+		}
+
+		if (RestoreCalibration) {
+			RestoreCalibration = FALSE;		// Reset this variable
+			RequestCalibration = TRUE;
+			if (!calibrator.Restore()) {
+				cout << "cannot restore calibration!" << endl;
+			}
+		}
+		else if (TrackMarkers) {
+			// Tracking keeps the calibration up to date by itself, a circle detection that is still running
+			// must not overwrite (and save) the tracked homography when it finishes
+			RequestCalibration = TRUE;
+			if (calibrator.IsBusy()) {
+				calibrator.CancelJob();
+			}
+			tracker.Track(ScaleDisplayGpu, calibrator);
+		}
+		else {
+			tracker.Reset();
+
+			// Check whether we need to do a calibration
+			if (RequestCalibration && !calibrator.IsCalibrated() && !calibrator.IsBusy()) {
+				// To understand this if ... else if ... statement, think about IsCalibrated() as a state
+				// If it is in FALSE state and user RequestCalibration, then do (1)
+				// If it is in TRUE state and user cancel RequestCalibration, the do (2)
+				// (1) runs on a snapshot in the background, the video keeps streaming uncalibrated meanwhile
+				calibrator.StartJob(ScaleDisplayGpu);
+			}
+			else if (!RequestCalibration && calibrator.IsCalibrated()) {
+				calibrator.Reset();
+			}
+		}
+
+		// Generate the threshold image
+		shared_ptr<const CalibrationData> calibration = calibrator.Current();
+		if (calibration == NULL) {
+			// Adjust the threshold in the scaled image, use type 3 threshold (threshold to zero)
+			cuda::threshold(ScaleDisplayGpu, ThresholdLowImageGpu, thresholdLow, 255.0, 3);
+			ThresholdLowImageGpu.convertTo(ThresholdHighImageGpu, CV_8UC1, 255.0 / thresholdHigh);
+		}
+		else {
+			// Change the perspective of image based on calculated disparity
+			cuda::remap(ScaleDisplayGpu, TransformDisplayGpu, calibration->XMap, calibration->YMap, INTER_LINEAR);
+
+			// Ajust the threshold based on the perspective-adjusted image, use type 3 threshold
+			cuda::threshold(TransformDisplayGpu, ThresholdLowImageGpu, thresholdLow, 255.0, 3);
+			ThresholdLowImageGpu.convertTo(ThresholdHighImageGpu, CV_8UC1, 255.0 / thresholdHigh);
+		}
+
+		// The threshold image is downloaded into a pooled frame that no consumer holds, the consumers keep
+		// their frames for as long as they read them (no copy, and no frame is overwritten while it is shown or sent)
+		FrameRef output = FramePool::Shared().Acquire(FRAME_FORMAT_GRAY8, IMAGE_WIDTH, IMAGE_HEIGHT, FRAME_STORAGE_HOST);
+		output->CopyMetadata(*input);
+		Mat OutputImage = output->Host();
+		ThresholdHighImageGpu.download(OutputImage);
+
+		bool saturated = SaturationDetection(*output);
+
+		// Restart the settle time of the controller on the thread that owns it
+		if (manual_exposure_change) {
+			manual_exposure_change = false;
+			autoExposure.Reset();
+		}
+
+		// The new exposure is applied by the acquire stage, don't ask again while a change is pending
+		if (AutoExposureEnabled && !request_change_exposure && stats != NULL) {
+			int newExposure = exposure_slider;
+			if (autoExposure.Update(*stats, saturated, exposure_slider, newExposure)) {
+				exposure_slider = newExposure;
+				request_change_exposure = true;
+			}
+		}
+
+		// Filter out the saturated images (the frame goes back to the pool)
+		if (saturated) {
+			return true;
+		}
+
+		// Output the process image
+		out.Push(output);
 		return true;
 	}
-	else {
-		return false;
+
+	bool HasDemand() const {
+		// The calibration, the marker tracking and the auto exposure/contrast need the frames even if no one looks at them
+		return RestoreCalibration || (RequestCalibration && !calibrator.IsCalibrated()) || calibrator.IsBusy() ||
+			TrackMarkers || AutoExposureEnabled || AutoContrastEnabled;
 	}
-}
 
-/*
-Process the image, calibrate it if necessary
-The process image will send to other thread via a TQueue<cv::GpuMat>
-*/
-void ProcessImage() {
-	Mat DisplayMat(IMAGE_HEIGHT, IMAGE_WIDTH, CV_16UC1);						// (16 bit per element)
-	cuda::GpuMat DisplayMatGpu(IMAGE_HEIGHT, IMAGE_WIDTH, CV_16UC1);
+private:
+	InputPort<FrameRef> in;
+	OutputPort<FrameRef> out;
 
-	// ScaleDisplayGpu will have the calibrated image information
-	cuda::GpuMat ScaleDisplayGpu(IMAGE_HEIGHT, IMAGE_WIDTH, CV_8UC1); 			// Scaled Image will have the customized max/min pixel value (8 bit per element)
+	// Calibration runs in the background, the matrix and its remap tables are swapped in once ready
+	Calibrator calibrator;
+	MarkerTracker tracker;
 
-	Mat PersTranMat;						// Perspective Transformation Matrix
-	bool PersTranMatConstructed = false;	// If true then we need to calibrate the image
+	// Closed-loop exposure control based on the histogram
+	AutoExposure autoExposure;
 
-	Mat ThresholdImage(IMAGE_HEIGHT, IMAGE_WIDTH, CV_8UC1);						// Threshold image (8 bit per element)
-	cuda::GpuMat ThresholdLowImageGpu(IMAGE_HEIGHT, IMAGE_WIDTH, CV_8UC1);
-	cuda::GpuMat ThresholdHighImageGpu(IMAGE_HEIGHT, IMAGE_WIDTH, CV_8UC1);		// ThresholdHigh image will be the output image
+	cuda::GpuMat ThresholdLowImageGpu;
+	cuda::GpuMat ThresholdHighImageGpu;		// The output before it is downloaded
+	cuda::GpuMat TransformDisplayGpu;		// Perspective-adjusted image
+};
 
-	while (!stop_running) {
-		// Get the image from readData thread
-		UINT16 *ImageData = ProcessDatatq->pop(NULL);
-		if (ImageData != NULL) {
-			// ImageData contains FRAMES_PER_TRANSFER frames of picture, go through each of them
-			for (int i = 0; i < FRAMES_PER_TRANSFER; i++) {
-				int offset = i * IMAGE_HEIGHT * IMAGE_WIDTH;
-				DisplayMat.data = (uchar*)(ImageData + offset);
-
-				// Load the image into GPU
-				DisplayMatGpu.upload(DisplayMat);
-
-				// Adjust the pixel value in the image
-				// The number 256 means we want to restain the pixel value in the range of (0,255). The nuber 24 is picked by experiment.
-				DisplayMatGpu.convertTo(ScaleDisplayGpu, CV_8UC1, 24.0 / 256.0);
-
-				if (RestoreCalibration) {
-					RestoreCalibration = FALSE;		// Reset this variable
-					RequestCalibration = TRUE;
-					PersTranMatConstructed = LoadPersTranMat(PersTranMat);
-					if (!PersTranMatConstructed) {
-						cout << "cannot restore calibration!" << endl;
-					}
+// Filter of the despeckle stage, switched by the "Despeckle" button
+enum DespeckleMode { DESPECKLE_MEDIAN, DESPECKLE_CLAMP };
+volatile DespeckleMode despeckleMode = DESPECKLE_MEDIAN;
+
+/*
+Remove the hot pixels and the speckles of the 8 bit image that get through the threshold, before it is shown
+and sent. Either a 3x3 median (DESPECKLE_MEDIAN) or the cheaper clamp of every pixel to the range of its
+8 neighbours, which only removes single pixels and keeps the edges and corners of the markers (DESPECKLE_CLAMP).
+The warp stage hands over a host frame, so the image is filtered where it is, in row bands on the ThreadPool,
+into a pooled host frame that colorize and encode read without another transfer.
+*/
+class DespeckleStage : public PipelineStage {
+public:
+	DespeckleStage() : PipelineStage("despeckle"), in("in"), out("out") {
+		AddInput(&in);
+		AddOutput(&out);
+	}
+
+	bool Process() {
+		FrameRef input;
+		if (!in.Pop(input)) {
+			return false;
+		}
+
+		const int width = input->width;
+		const int height = input->height;
+		FrameRef output = FramePool::Shared().Acquire(FRAME_FORMAT_GRAY8, width, height, FRAME_STORAGE_HOST);
+		output->CopyMetadata(*input);
+
+		const DespeckleMode mode = despeckleMode;
+		// Pooled frames have no padding, so a frame of the sensor width is one contiguous run
+		const bool fixedWidth = width == IMAGE_WIDTH;
+		const UINT8 *src = input->Ptr<UINT8>();
+		UINT8 *dst = output->Ptr<UINT8>();
+		const size_t srcStride = input->stride;
+		const size_t dstStride = output->stride;
+		ThreadPool::Shared().ParallelRows(width, height, [&](int firstRow, int lastRow) {
+			if (mode == DESPECKLE_MEDIAN) {
+				if (fixedWidth) {
+					Median3x3Rows<IMAGE_WIDTH>(src, srcStride, dst, dstStride, width, height, firstRow, lastRow);
 				}
 				else {
-					// Check whether we need to do a calibration
-					if (RequestCalibration && !PersTranMatConstructed) {
-						// To understand this if ... else if ... statement, think about PersTranMatConstructed as a state
-						// If it is in FALSE state and user RequestCalibration, then do (1)
-						// If it is in TRUE state and user cancel RequestCalibration, the do (2)
-						PersTranMatConstructed = CircleDetection(ScaleDisplayGpu, PersTranMat);
-						SavePersTranMat(PersTranMat);	// Save new perspective transformation matrix into file
-						if (!PersTranMatConstructed) {
-							RequestCalibration = FALSE;
-						}
-					}
-					else if (!RequestCalibration && PersTranMatConstructed) {
-						PersTranMatConstructed = false;
-					}
+					Median3x3Rows<PIXEL_KERNEL_GENERIC>(src, srcStride, dst, dstStride, width, height, firstRow, lastRow);
 				}
-
-				// Generate the threshold image
-				if (!PersTranMatConstructed) {
-					// Adjust the threshold in the scaled image, use type 3 threshold (threshold to zero)
-					cuda::threshold(ScaleDisplayGpu, ThresholdLowImageGpu, threshold_low_slider, 255.0, 3);
-					ThresholdLowImageGpu.convertTo(ThresholdHighImageGpu, CV_8UC1, 255.0 / threshold_high_slider);
+			}
+			else {
+				if (fixedWidth) {
+					ClampSpeckle3x3Rows<IMAGE_WIDTH>(src, srcStride, dst, dstStride, width, height, firstRow, lastRow);
 				}
 				else {
-					cuda::GpuMat TransformDisplayGpu(IMAGE_HEIGHT, IMAGE_WIDTH, CV_8UC1);
-					// Change the perspective of image based on calculated disparity
-					cuda::warpPerspective(ScaleDisplayGpu, TransformDisplayGpu, PersTranMat, ScaleDisplayGpu.size());
-
-					// Ajust the threshold based on the perspective-adjusted image, use type 3 threshold
-					cuda::threshold(TransformDisplayGpu, ThresholdLowImageGpu, threshold_low_slider, 255.0, 3);
-					ThresholdLowImageGpu.convertTo(ThresholdHighImageGpu, CV_8UC1, 255.0 / threshold_high_slider);
+					ClampSpeckle3x3Rows<PIXEL_KERNEL_GENERIC>(src, srcStride, dst, dstStride, width, height, firstRow, lastRow);
 				}
+			}
+		});
 
-				// Filter out the saturated images
-				if (SaturationDetection(ThresholdHighImageGpu)) {
-					continue;
-				}
+		out.Push(output);
+		return true;
+	}
 
-				cuda::GpuMat *OutputImage_display = new cuda::GpuMat(ThresholdHighImageGpu);
-				cuda::GpuMat *OutputImage_network = new cuda::GpuMat(ThresholdHighImageGpu);
+private:
+	InputPort<FrameRef> in;
+	OutputPort<FrameRef> out;
+};
 
-				// Output the process image
-				Displaytq->push(OutputImage_display);
-				Networktq->push(OutputImage_network);
-			}
-		}
+// ----------- Display GUI Stages -----------
 
-		delete[] ImageData;
+/*
+Enable/disable a stage of the pipeline
+*/
+void ToggleStage(const string &stageName) {
+	PipelineStage *stage = pipeline->FindStage(stageName);
+	if (stage != NULL) {
+		pipeline->SetStageEnabled(stageName, !stage->IsEnabled());
 	}
 }
 
-// ----------- Display GUI Thread -----------
-
 /*
 This event (function) will be triggered when the user presses SetExposure button.
 It will set the imager's exposure to the exposure_slider's value
 */
 void SetExposureClick(int state, void* userdata) {
 	CoutPrint("Set exposure button clicked");
+	manual_exposure_change = true;
 	request_change_exposure = true;
 }
 
@@ -404,6 +633,16 @@ void ResetCalibrationClick(int state, void* userdata) {
 	CoutPrint("Reset calibration button clicked");
 	RequestCalibration = FALSE;
 	RestoreCalibration = FALSE;
+	TrackMarkers = FALSE;
+}
+
+/*
+Called when the "Track Markers" button is clicked
+Toggle the continuous tracking of the calibration markers. When tracking stops, the last calibration is kept.
+*/
+void TrackMarkersClick(int state, void* userdata) {
+	CoutPrint("Track markers button clicked");
+	TrackMarkers = !TrackMarkers;
 }
 
 /*
@@ -415,257 +654,378 @@ void RestoreCalibrationClick(int state, void* userdata) {
 }
 
 /*
-Called when user wants to connect the FPGA Imager
+Called when the "Sensor Correction" button is clicked, toggle the sensor correction
 */
-void FPGAConnectClick(int state, void* userdata) {
-	if (readState == Connect && connect_FPGA_event != INVALID_HANDLE_VALUE) {
-		SetEvent(connect_FPGA_event);
-	}
+void SensorCorrectionClick(int state, void* userdata) {
+	CoutPrint("Sensor correction button clicked");
+	ToggleStage("correct");
 }
 
 /*
-Adjust the Jet colormap based on src Matrix and store the result in the dst Matrix
+Called when the "Capture Dark Frame" button is clicked
+The lens has to be covered during the capture
 */
-void AdjustJet(Mat &src, Mat &dst) {
-	applyColorMap(src, dst, COLORMAP_JET);
-	for (int i = 0; i < IMAGE_HEIGHT; i++) {
-		for (int j = 0; j < IMAGE_WIDTH; j++) {
-			if (src.at<uchar>(i, j) == 0) {
-				dst.at<Vec3b>(i, j) = Vec3b(0.0, 0.0, 0.0);
-			}
-		}
-	}
+void CaptureDarkClick(int state, void* userdata) {
+	CoutPrint("Capture dark frame button clicked");
+	RequestSensorCapture = SENSOR_CAPTURE_DARK;
 }
 
 /*
-Create a GUI in the PC by using openCV's library and display the imager data
-The GUI is created based on opencv's HighGUI
+Called when the "Capture Flat Field" button is clicked
+The sensor has to see a uniformly illuminated target during the capture
 */
-void DisplayData() {
-	// Using OpenCV window
-	cv::String windowName("NIR Camera");
+void CaptureFlatClick(int state, void* userdata) {
+	CoutPrint("Capture flat field button clicked");
+	RequestSensorCapture = SENSOR_CAPTURE_FLAT;
+}
 
-	// Create a threshold windows
-	namedWindow(windowName, CV_WINDOW_AUTOSIZE);
+/*
+Called when the "Temporal Filter" button is clicked, toggle the temporal denoising
+*/
+void TemporalFilterClick(int state, void* userdata) {
+	CoutPrint("Temporal filter button clicked");
+	ToggleStage("denoise");
+}
 
-	// Create buttons related to the camera
-	cv::createButton("Set Exposure", SetExposureClick, NULL, CV_PUSH_BUTTON, 0);
-	cv::createButton("Start Calibration", CalibrationClick, NULL, CV_PUSH_BUTTON, 0);
-	cv::createButton("Restore Calibration", RestoreCalibrationClick, NULL, CV_PUSH_BUTTON, 0);
-	cv::createButton("Reset Calibration", ResetCalibrationClick, NULL, CV_PUSH_BUTTON, 0);
+/*
+Called when the "Despeckle" button is clicked, step through off -> median -> clamp -> off
+*/
+void DespeckleClick(int state, void* userdata) {
+	CoutPrint("Despeckle button clicked");
+	PipelineStage *stage = pipeline->FindStage("despeckle");
+	if (stage == NULL) {
+		return;
+	}
+	if (!stage->IsEnabled()) {
+		despeckleMode = DESPECKLE_MEDIAN;
+		pipeline->SetStageEnabled("despeckle", true);
+	}
+	else if (despeckleMode == DESPECKLE_MEDIAN) {
+		despeckleMode = DESPECKLE_CLAMP;
+	}
+	else {
+		pipeline->SetStageEnabled("despeckle", false);
+	}
+}
 
-	// Create Trackbars
-	cv::String emptyStr;		// Use an empty string to help creating the trackbar (Otherwise by using "", createTrackbar() will segfault occuasionally)
-	cv::createTrackbar("Exposure(ms)", emptyStr, &exposure_slider, exposure_slider_max);		// Experiment has shown that the 2nd input parameters of the cv::createTrackbar should not be a "". Otherwise it will cause segfault. So I use emptyStr here.
-	cv::createTrackbar("Thres_low", emptyStr, &threshold_low_slider, threshold_slider_max);
-	cv::createTrackbar("Thres_high", emptyStr, &threshold_high_slider, threshold_slider_max);
-	cv::createTrackbar("Transparency", emptyStr, &rgba_alpha_slider, rgba_alpha_slider_max);
+/*
+Called when the "Auto Contrast" button is clicked
+Toggle between the histogram based scale/thresholds and the slider values
+*/
+void AutoContrastClick(int state, void* userdata) {
+	CoutPrint("Auto contrast button clicked");
+	AutoContrastEnabled = !AutoContrastEnabled;
+}
 
-	cv::createButton("Save Data", SaveDataClick, NULL, CV_PUSH_BUTTON, 0);
-	cv::createButton("Connect FPGA Imager", FPGAConnectClick, NULL, CV_PUSH_BUTTON, 0);
+/*
+Called when the "Auto Exposure" button is clicked, toggle the automatic exposure control
+*/
+void AutoExposureClick(int state, void* userdata) {
+	CoutPrint("Auto exposure button clicked");
+	AutoExposureEnabled = !AutoExposureEnabled;
+}
 
-	bool closeWindow = false;
-	while (!closeWindow) {
-		cuda::GpuMat *InputImage = Displaytq->pop(NULL);
+/*
+Called when user wants to connect the FPGA Imager
+*/
+void FPGAConnectClick(int state, void* userdata) {
+	if (readState == Connect && connect_FPGA_event != INVALID_HANDLE_VALUE) {
+		SetEvent(connect_FPGA_event);
+	}
+}
 
-		if (InputImage != NULL) {
-			// Image to be displayed (8 bit per element)
-			Mat DisplayImage(IMAGE_HEIGHT, IMAGE_WIDTH, CV_8UC1);
+/*
+Color src (8 bit) with the colormap of colors into dst (BGR), in one table lookup per pixel
+*/
+void Colorize(const Mat &src, Mat &dst, const ColorTable &colors) {
+	dst.create(src.size(), CV_8UC3);
 
-			// Load the threshold image from GPU to CPU 
-			InputImage->download(DisplayImage);
+	// Each band colors its own rows of dst
+	ThreadPool::Shared().ParallelRows(src.cols, src.rows, [&](int firstRow, int lastRow) {
+		if (src.cols == IMAGE_WIDTH && src.isContinuous() && dst.isContinuous()) {
+			ColorizeRows<IMAGE_WIDTH>(src.data, src.step, dst.data, dst.step, colors.Entries(), src.cols, firstRow, lastRow);
+		}
+		else {
+			ColorizeRows<PIXEL_KERNEL_GENERIC>(src.data, src.step, dst.data, dst.step, colors.Entries(), src.cols, firstRow, lastRow);
+		}
+	});
+}
 
-			// Get the jet image
-			Mat jetImage;
-			AdjustJet(DisplayImage, jetImage);
+/*
+Apply the colormap (DISPLAY_COLORMAP) to the processed image, the pixels that are 0 stay black
+*/
+class ColorizeStage : public PipelineStage {
+public:
+	ColorizeStage() : PipelineStage("colorize"), in("in"), out("out"), colors(DISPLAY_COLORMAP) {
+		AddInput(&in);
+		AddOutput(&out);
+	}
 
-			// Display the jet image
-			imshow(windowName, jetImage);
+	bool Process() {
+		FrameRef input;
+		if (!in.Pop(input)) {
+			return false;
 		}
 
-		// After imshow is called, you have to call waitkey for at least some time (e.g. 5)
-		char key_pressed = waitKey(5);
+		// The threshold image is on the host already
+		Mat DisplayImage = input->Host();
 
-		// If User press q, then exist
-		if (key_pressed == 'q') {
-			closeWindow = true;
-		}
+		// Get the jet image
+		FrameRef jet = FramePool::Shared().Acquire(FRAME_FORMAT_BGR24, DisplayImage.cols, DisplayImage.rows, FRAME_STORAGE_HOST);
+		jet->CopyMetadata(*input);
+		Mat jetImage = jet->Host();
+		Colorize(DisplayImage, jetImage, colors);
 
-		delete InputImage;
+		out.Push(jet);
+		return true;
 	}
-}
 
-// ----------- Network Thread -----------
+private:
+	InputPort<FrameRef> in;
+	OutputPort<FrameRef> out;
+
+	ColorTable colors;
+};
 
 /*
-* Breaking i into sections and getting AR value (8 Bits in total)
+Create a GUI in the PC by using openCV's library and display the imager data
+The GUI is created based on opencv's HighGUI, so the window is created and served on the stage's thread.
+The images come finished from the colorize stage (on its own thread): the GUI thread only shows a new image
+when there is one, at most once per refresh of the monitor, and otherwise waits in the HighGUI event loop.
 */
-unsigned char GetColorAR(unsigned char i) {
-	if (i == 0) {
-		return 0;
+class DisplayStage : public PipelineStage {
+public:
+	DisplayStage() : PipelineStage("display"), in("in"), windowName("NIR Camera") {
+		AddInput(&in);
+
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		ticksPerMs = frequency.QuadPart / 1000.0;
+		presentPeriod = frequency.QuadPart / DISPLAY_DEFAULT_REFRESH_HZ;
+		nextPresent = 0;
 	}
 
-	unsigned char ret = 0xf0;
-	//if pixel(8 bits) value is less than 96, then R = 0x0
-	if (i < 96) {
-		return ret;
+	void Start() {
+		// Present at the refresh rate of the monitor, faster would only drop images in the compositor
+		HDC screen = GetDC(NULL);
+		int refreshHz = GetDeviceCaps(screen, VREFRESH);
+		ReleaseDC(NULL, screen);
+		if (refreshHz <= 1) {
+			// 0 and 1 mean the default rate of the hardware
+			refreshHz = DISPLAY_DEFAULT_REFRESH_HZ;
+		}
+		presentPeriod = (INT64)(ticksPerMs * 1000.0 / refreshHz);
+		_logger->info("Display presents at most {0} images per second", refreshHz);
+
+		// Create a threshold windows
+		namedWindow(windowName, CV_WINDOW_AUTOSIZE);
+
+		// Create buttons related to the camera
+		cv::createButton("Set Exposure", SetExposureClick, NULL, CV_PUSH_BUTTON, 0);
+		cv::createButton("Auto Exposure", AutoExposureClick, NULL, CV_PUSH_BUTTON, 0);
+		cv::createButton("Start Calibration", CalibrationClick, NULL, CV_PUSH_BUTTON, 0);
+		cv::createButton("Restore Calibration", RestoreCalibrationClick, NULL, CV_PUSH_BUTTON, 0);
+		cv::createButton("Reset Calibration", ResetCalibrationClick, NULL, CV_PUSH_BUTTON, 0);
+		cv::createButton("Track Markers", TrackMarkersClick, NULL, CV_PUSH_BUTTON, 0);
+
+		// Create Trackbars
+		cv::String emptyStr;		// Use an empty string to help creating the trackbar (Otherwise by using "", createTrackbar() will segfault occuasionally)
+		cv::createTrackbar("Exposure(ms)", emptyStr, &exposure_slider, exposure_slider_max);		// Experiment has shown that the 2nd input parameters of the cv::createTrackbar should not be a "". Otherwise it will cause segfault. So I use emptyStr here.
+		cv::createTrackbar("Thres_low", emptyStr, &threshold_low_slider, threshold_slider_max);
+		cv::createTrackbar("Thres_high", emptyStr, &threshold_high_slider, threshold_slider_max);
+		cv::createButton("Auto Contrast", AutoContrastClick, NULL, CV_PUSH_BUTTON, 0);
+		cv::createTrackbar("Transparency", emptyStr, &rgba_alpha_slider, rgba_alpha_slider_max);
+
+		cv::createButton("Sensor Correction", SensorCorrectionClick, NULL, CV_PUSH_BUTTON, 0);
+		cv::createButton("Capture Dark Frame", CaptureDarkClick, NULL, CV_PUSH_BUTTON, 0);
+		cv::createButton("Capture Flat Field", CaptureFlatClick, NULL, CV_PUSH_BUTTON, 0);
+		cv::createButton("Temporal Filter", TemporalFilterClick, NULL, CV_PUSH_BUTTON, 0);
+		cv::createButton("Despeckle", DespeckleClick, NULL, CV_PUSH_BUTTON, 0);
+
+		cv::createButton("Save Data", SaveDataClick, NULL, CV_PUSH_BUTTON, 0);
+		cv::createButton("Connect FPGA Imager", FPGAConnectClick, NULL, CV_PUSH_BUTTON, 0);
 	}
 
-	if (i < 128) {
-		ret += (unsigned char)((i - 95) * 4) / 16;
-		return ret;
-	}
+	bool Process() {
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+
+		// Before the next refresh the image stays in the channel, where a newer one replaces it
+		bool shown = false;
+		if (now.QuadPart >= nextPresent) {
+			FrameRef jetImage;
+			shown = in.Pop(jetImage);
+			if (shown) {
+				// Display the jet image
+				imshow(windowName, jetImage->Host());
+
+				// On the refresh grid, restarted after a pause
+				nextPresent += presentPeriod;
+				if (nextPresent <= now.QuadPart) {
+					nextPresent = now.QuadPart + presentPeriod;
+				}
+			}
+		}
 
-	if (i < 159) {
-		unsigned char x = 131;
-		x += (i - 128) * 4;
-		x /= 16;
-		return (unsigned char)(ret + x);
+		// Serve the events until the next refresh, or a while if an image is due but has not arrived
+		int waitMs = DISPLAY_EVENT_WAIT_MS;
+		if (nextPresent > now.QuadPart) {
+			waitMs = max(1, min(DISPLAY_EVENT_WAIT_MS, (int)((nextPresent - now.QuadPart) / ticksPerMs)));
+		}
+		HandleKeys(waitMs);
+		return shown;
 	}
 
-	if (i < 224) {
-		return (unsigned char)0xff;
+	bool Bypass() {
+		// The window still has to respond while nothing is displayed
+		bool dropped = in.Drain();
+		HandleKeys(DISPLAY_EVENT_WAIT_MS);
+		return dropped;
 	}
-	return 0;
-}
-
-/*
-An overrided function for GetColorAR
-This function accepts an input of new_alpha based on which it will construct the AR value
-*/
-unsigned char GetColorAR(unsigned char i, int new_alpha) {
-	char a = (new_alpha & 0xff) << 4;
-	return GetColorAR(i) & (0x0f) + a;
-}
 
-/*
-* Breaking i into sections and getting G 8 bit
-*/
-unsigned char getG(unsigned char i)
-{
-	if (i < 32 || i > 222) {
-		return 0;
-	}
-	if (i < 64) {
-		return ((unsigned char)(i - 31) * 4);
-	}
-	if (i < 95) {
-		return ((unsigned char)((i - 64) * 4) + 131);
-	}
-	if (i < 160) {
-		return (unsigned char)(0xff);
+	bool HasDemand() const {
+		// Nothing to display while the window is minimized (or has been closed)
+		HWND window = FindWindow(NULL, windowName.c_str());
+		return window != NULL && IsWindowVisible(window) && !IsIconic(window);
 	}
 
-	unsigned char tmp = 0;
-	if (i < 191) {
-		tmp = 0xff;
-		tmp -= (i - 159) * 4;
-		return tmp;
+	bool Idle() {
+		// Keep the window responding, otherwise it could never be restored
+		in.Drain();
+		HandleKeys(DISPLAY_EVENT_WAIT_MS);
+		return false;
 	}
-	if (i < 223) {
-		tmp = 128;
-		tmp -= (i - 191) * 4;
-		return tmp;
+
+private:
+	InputPort<FrameRef> in;
+
+	// Using OpenCV window
+	cv::String windowName;
+
+	double ticksPerMs;
+	INT64 presentPeriod;		// One refresh of the monitor in QPC ticks
+	INT64 nextPresent;			// QPC time of the next refresh an image may be shown at
+
+	void HandleKeys(int waitMs) {
+		// waitKey runs the HighGUI event loop (and shows the image of imshow), it returns early on a key
+		char key_pressed = waitKey(waitMs);
+
+		// If User press q, then exist
+		if (key_pressed == 'q') {
+			SetEvent(quit_event);
+		}
 	}
+};
 
-	return 0;
-}
+// ----------- Network Stage -----------
+
+// How the encode stage halves the image: every other pixel (as before) or the mean of every 2x2 block (smoother, no aliasing)
+enum HoloDownsampleMode { HOLO_DOWNSAMPLE_NEAREST, HOLO_DOWNSAMPLE_BOX };
+volatile HoloDownsampleMode HoloDownsample = HOLO_DOWNSAMPLE_NEAREST;
 
 /*
-* Breaking i into sections and getting B 8 bit
+Get data from the warp stage, encode it and send it to HoloLens
 */
-unsigned char getB(unsigned char i)
-{
-	if (i > 158) {
-		return 0;
+class EncodeStage : public PipelineStage {
+public:
+	EncodeStage() : PipelineStage("encode"), in("in"),
+		holo_network("192.168.1.2", 27015, 4, 10) {		// ip_addr, port, worker_thread_num, client_num
+		AddInput(&in);
+		serving = false;
 	}
 
-	unsigned char tmp = 0;
-	if (i <= 30) {
-		tmp = 131;
-		tmp += (i) * 4;
-		return tmp;
-	}
-	if (i < 96) {
-		return 0xff;
-	}
-	if (i < 127) {
-		tmp = 0xff;
-		tmp -= (i - 95) * 4;
-		return tmp;
+	void Start() {
+		// Run the server, the data is updated by Process()
+		holo_network.RunServer();
+		serving = true;
 	}
 
-	if (i < 159) {
-		tmp = 128;
-		tmp -= (i - 127) * 4;
-		return tmp;
+	void Stop() {
+		serving = false;
+		holo_network.CloseServer();
 	}
-	return 0;
-}
 
-/*
-* Breaking i into sections and getting GB value (8 Bits in total)
-* Use 2 helper functions
-*/
-unsigned char GetColorGB(unsigned char i)
-{
-	unsigned char gr = getG(i);
-	unsigned char bl = getB(i);
-	gr /= 16;
-	bl /= 16;
-	unsigned char temp = gr << 4;
-	temp += bl;
-	return temp;
-}
-
-/*
-Get data from ProcessImage thread and send it to HoloLens
-*/
-void RunNetwork() {
-	// Constant parameters for this thread
-	int DOWN_FACTOR = 2;
-	int NETWORK_DATA_LEN = IMAGE_HEIGHT / DOWN_FACTOR * IMAGE_WIDTH / DOWN_FACTOR * 2;
+	bool HasDemand() const {
+		// Only encode while a HoloLens is connected
+		return serving && holo_network.GetClientCount() > 0;
+	}
 
-	// Create a network object
-	string ip_addr = "192.168.1.2";
-	int port = 27015;
-	int worker_thread_num = 4;
-	int client_num = 10;
-	HoloNetwork holo_network(ip_addr, port, worker_thread_num, client_num);
-
-	// Run the server and update the data
-	holo_network.RunServer();
-	while (!stop_running) {
+	bool Process() {
 		// If new image is available, update the network's buffer
-		cuda::GpuMat *InputImage = Networktq->pop(NULL);
-
-		if (InputImage != NULL) {
-			// Down Sample Image Variable (8 bit per element)
-			Mat DownSample(IMAGE_HEIGHT / DOWN_FACTOR, IMAGE_WIDTH / DOWN_FACTOR, CV_8UC1);
-			cuda::GpuMat DownSampleGpu(IMAGE_HEIGHT / DOWN_FACTOR, IMAGE_WIDTH / DOWN_FACTOR, CV_8UC1);
-			cuda::resize(*InputImage, DownSampleGpu, cv::Size(0, 0), 1.0 / DOWN_FACTOR, 1.0 / DOWN_FACTOR, INTER_NEAREST);
-			DownSampleGpu.download(DownSample);
-
-			char *SendData = new char[NETWORK_DATA_LEN];
-			for (int i = 0; i < (IMAGE_HEIGHT / DOWN_FACTOR * IMAGE_WIDTH / DOWN_FACTOR); i++) {
-				int index = i * 2;
-				SendData[index] = (char)GetColorGB(DownSample.data[i]);
-				SendData[index + 1] = (char)GetColorAR(DownSample.data[i], rgba_alpha_slider);
-			}
-
-			// Update the data
-			holo_network.UpdateBuffer(SendData, NETWORK_DATA_LEN);
+		FrameRef input;
+		if (!in.Pop(input)) {
+			return false;
+		}
 
-			delete[] SendData;
+		// The full image is read from the host frame of the warp stage and downsampled while it is encoded,
+		// straight into the pooled send buffers (no GPU transfer, no intermediate image)
+		const UINT8 *FullImage = input->Ptr<UINT8>();
+		const size_t fullStride = input->stride;
+
+		const int width = input->width / DOWN_FACTOR;
+		const int height = input->height / DOWN_FACTOR;
+		const bool contiguous = input->width == IMAGE_WIDTH && fullStride == IMAGE_WIDTH;
+		// The same transparency for the whole frame
+		const UINT16 *holoTable = HoloColorTable::Shared().ForAlpha(rgba_alpha_slider);
+		const bool box = HoloDownsample == HOLO_DOWNSAMPLE_BOX;
+
+		// Only the formats that are streamed right now
+		StreamFrame frame;
+		if (holo_network.GetStreamClientCount(STREAM_FORMAT_HOLO16) > 0) {
+			FrameRef encoded = FramePool::Shared().Acquire(FRAME_FORMAT_HOLO16, width, height, FRAME_STORAGE_HOST);
+			encoded->CopyMetadata(*input);
+
+			UINT8 *SendData = encoded->Ptr<UINT8>();
+			ThreadPool::Shared().ParallelRows(width, height, [&](int firstRow, int lastRow) {
+				if (contiguous && encoded->stride == (size_t)width * 2) {
+					EncodeHolo16Down2Rows<IMAGE_WIDTH / DOWN_FACTOR>(FullImage, fullStride, SendData, encoded->stride, holoTable,
+						width, firstRow, lastRow, box);
+				}
+				else {
+					EncodeHolo16Down2Rows<PIXEL_KERNEL_GENERIC>(FullImage, fullStride, SendData, encoded->stride, holoTable,
+						width, firstRow, lastRow, box);
+				}
+			});
+			frame.holo16 = encoded;
+		}
+		if (holo_network.GetStreamClientCount(STREAM_FORMAT_INDEXED) > 0) {
+			// The clients color the values with the palette, it is only sent again when the transparency changes
+			FrameRef indexed = FramePool::Shared().Acquire(FRAME_FORMAT_GRAY8, width, height, FRAME_STORAGE_HOST);
+			indexed->CopyMetadata(*input);
+
+			UINT8 *SendData = indexed->Ptr<UINT8>();
+			ThreadPool::Shared().ParallelRows(width, height, [&](int firstRow, int lastRow) {
+				if (contiguous && indexed->stride == (size_t)width) {
+					Downsample2Rows<IMAGE_WIDTH / DOWN_FACTOR>(FullImage, fullStride, SendData, indexed->stride,
+						width, firstRow, lastRow, box);
+				}
+				else {
+					Downsample2Rows<PIXEL_KERNEL_GENERIC>(FullImage, fullStride, SendData, indexed->stride,
+						width, firstRow, lastRow, box);
+				}
+			});
+			frame.indexed = indexed;
+			frame.palette = holoTable;
 		}
 
-		delete InputImage;
+		// Update the data, the parked connections send it right away
+		holo_network.UpdateBuffer(frame);
+		return true;
 	}
 
-	holo_network.CloseServer();
-}
+private:
+	// Constant parameters for this stage
+	enum { DOWN_FACTOR = 2 };
+	static_assert(DOWN_FACTOR == 2, "the encode kernels halve the image");
+
+	InputPort<FrameRef> in;
+
+	// Create a network object
+	HoloNetwork holo_network;
+	atomic<bool> serving;		// The connections of holo_network exist
+};
 
-// ----------- Save Image Thread -----------
+// ----------- Save Stage -----------
 
 //global variables for HDF5
 #define SAVE_VIDEO_LENGTH 255
@@ -783,92 +1143,352 @@ void SaveHDF5(UINT16 *buffer) {
 }
 
 /*
-The thread function for saving the data into HDF5
+Save the raw frames into HDF5
 */
-void SaveData() {
-	while (!stop_running) {
-		UINT16 *ImageData = Savetq->pop(NULL);
+class SaveStage : public PipelineStage {
+public:
+	SaveStage() : PipelineStage("save"), in("in") {
+		AddInput(&in);
+	}
 
-		if (ImageData != NULL) {
-			// ImageData contains FRAMES_PER_TRANSFER frames of picture, go through each of them
-			for (int i = 0; i < FRAMES_PER_TRANSFER; i++) {
-				int offset = i * IMAGE_HEIGHT * IMAGE_WIDTH;
-				UINT16 *SingleFrameData = ImageData + offset;
-				SaveHDF5(SingleFrameData);
-			}
-			delete[] ImageData;
+	bool Process() {
+		FrameRef frame;
+		if (!in.Pop(frame)) {
+			return false;
+		}
+		SaveHDF5(frame->Ptr<UINT16>());
+		return true;
+	}
+
+	bool HasDemand() const {
+		// The file is also created and closed when a frame arrives
+		return saveState != Idle;
+	}
+
+	void Stop() {
+		// Close the file when the program quits while saving
+		if (saveState == Complete) {
+			SaveHDF5(NULL);
 		}
 	}
+
+private:
+	InputPort<FrameRef> in;
+};
+
+// ----------- Control Commands -----------
+
+/*
+Stands in for the display stage in headless mode: takes the images and never asks for any,
+so that the stages that only feed the display stay idle
+*/
+class DiscardStage : public PipelineStage {
+public:
+	DiscardStage(const string &name) : PipelineStage(name), in("in") {
+		AddInput(&in);
+	}
+
+	bool Process() {
+		return in.Drain();
+	}
+
+private:
+	InputPort<FrameRef> in;
+};
+
+/*
+The argument of a switch command: "on", "off", or none to toggle current
+*/
+bool ParseSwitch(const vector<string> &args, bool current, bool &value, string &result) {
+	if (args.empty()) {
+		value = !current;
+		return true;
+	}
+	if (args.size() == 1 && (args[0] == "on" || args[0] == "off")) {
+		value = args[0] == "on";
+		return true;
+	}
+	result = "expected on or off";
+	return false;
 }
 
-// ----------- Main Thread -----------
+/*
+args[index] as an integer in [minValue, maxValue]
+*/
+bool ParseInt(const vector<string> &args, size_t index, int minValue, int maxValue, int &value, string &result) {
+	char *end = NULL;
+	long parsed = index < args.size() ? strtol(args[index].c_str(), &end, 10) : 0;
+	if (index >= args.size() || end == args[index].c_str() || *end != '\0' || parsed < minValue || parsed > maxValue) {
+		result = "expected a number from " + to_string(minValue) + " to " + to_string(maxValue);
+		return false;
+	}
+	value = (int)parsed;
+	return true;
+}
+
+/*
+FALSE if the stage is disabled or not in the pipeline
+*/
+bool IsStageEnabled(const string &stageName) {
+	PipelineStage *stage = pipeline->FindStage(stageName);
+	return stage != NULL && stage->IsEnabled();
+}
 
 /*
-TQueue delete function for UINT16 array
+Enable/disable a stage by a switch command
 */
-void delete_fun_UINT16_ptr(UINT16* input) {
-	delete[] input;
-	input = NULL;
+bool SwitchStage(const string &stageName, const vector<string> &args, string &result) {
+	bool value;
+	if (!ParseSwitch(args, IsStageEnabled(stageName), value, result)) {
+		return false;
+	}
+	if (!pipeline->SetStageEnabled(stageName, value)) {
+		result = "there is no " + stageName + " stage in the pipeline";
+		return false;
+	}
+	return true;
+}
+
+const char *OnOff(bool value) {
+	return value ? "on" : "off";
+}
+
+/*
+The controls of the GUI (buttons and trackbars) as commands of the ControlServer. They set the same variables
+and call the same click handlers, so the pipeline cannot tell where a change comes from.
+*/
+void AddControlCommands(ControlServer &control) {
+	control.AddCommand("exposure", "exposure <ms>", [](const vector<string> &args, string &result) {
+		int exposure;
+		if (!ParseInt(args, 0, 1, exposure_slider_max, exposure, result)) {
+			return false;
+		}
+		exposure_slider = exposure;
+		SetExposureClick(0, NULL);
+		return true;
+	});
+	control.AddCommand("auto_exposure", "auto_exposure [on|off]", [](const vector<string> &args, string &result) {
+		bool value;
+		if (!ParseSwitch(args, AutoExposureEnabled != FALSE, value, result)) {
+			return false;
+		}
+		AutoExposureEnabled = value;
+		return true;
+	});
+	control.AddCommand("threshold", "threshold <low> <high>", [](const vector<string> &args, string &result) {
+		int low, high;
+		if (!ParseInt(args, 0, 0, threshold_slider_max, low, result) || !ParseInt(args, 1, 0, threshold_slider_max, high, result)) {
+			return false;
+		}
+		threshold_low_slider = low;
+		threshold_high_slider = high;
+		return true;
+	});
+	control.AddCommand("auto_contrast", "auto_contrast [on|off]", [](const vector<string> &args, string &result) {
+		bool value;
+		if (!ParseSwitch(args, AutoContrastEnabled != FALSE, value, result)) {
+			return false;
+		}
+		AutoContrastEnabled = value;
+		return true;
+	});
+	control.AddCommand("auto_threshold", "auto_threshold <percentile 0-100>", [](const vector<string> &args, string &result) {
+		int percentile;
+		if (!ParseInt(args, 0, 0, 100, percentile, result)) {
+			return false;
+		}
+		histogram->SetThresholdPercentile(percentile / 100.0);
+		return true;
+	});
+	control.AddCommand("transparency", "transparency <0-15>", [](const vector<string> &args, string &result) {
+		return ParseInt(args, 0, 0, rgba_alpha_slider_max, rgba_alpha_slider, result);
+	});
+
+	control.AddCommand("stream_downsample", "stream_downsample nearest|box", [](const vector<string> &args, string &result) {
+		if (args.size() != 1 || (args[0] != "nearest" && args[0] != "box")) {
+			result = "expected nearest or box";
+			return false;
+		}
+		HoloDownsample = args[0] == "box" ? HOLO_DOWNSAMPLE_BOX : HOLO_DOWNSAMPLE_NEAREST;
+		return true;
+	});
+
+	control.AddCommand("calibrate", "calibrate", [](const vector<string> &args, string &result) {
+		CalibrationClick(0, NULL);
+		return true;
+	});
+	control.AddCommand("restore_calibration", "restore_calibration", [](const vector<string> &args, string &result) {
+		RestoreCalibrationClick(0, NULL);
+		return true;
+	});
+	control.AddCommand("reset_calibration", "reset_calibration", [](const vector<string> &args, string &result) {
+		ResetCalibrationClick(0, NULL);
+		return true;
+	});
+	control.AddCommand("track_markers", "track_markers [on|off]", [](const vector<string> &args, string &result) {
+		bool value;
+		if (!ParseSwitch(args, TrackMarkers != FALSE, value, result)) {
+			return false;
+		}
+		TrackMarkers = value;
+		return true;
+	});
+
+	control.AddCommand("sensor_correction", "sensor_correction [on|off]", [](const vector<string> &args, string &result) {
+		return SwitchStage("correct", args, result);
+	});
+	control.AddCommand("capture_dark", "capture_dark", [](const vector<string> &args, string &result) {
+		CaptureDarkClick(0, NULL);
+		return true;
+	});
+	control.AddCommand("capture_flat", "capture_flat", [](const vector<string> &args, string &result) {
+		CaptureFlatClick(0, NULL);
+		return true;
+	});
+	control.AddCommand("temporal_filter", "temporal_filter [on|off]", [](const vector<string> &args, string &result) {
+		return SwitchStage("denoise", args, result);
+	});
+	control.AddCommand("despeckle", "despeckle off|median|clamp", [](const vector<string> &args, string &result) {
+		if (args.size() != 1 || (args[0] != "off" && args[0] != "median" && args[0] != "clamp")) {
+			result = "expected off, median or clamp";
+			return false;
+		}
+		despeckleMode = args[0] == "clamp" ? DESPECKLE_CLAMP : DESPECKLE_MEDIAN;
+		return SwitchStage("despeckle", vector<string>(1, args[0] == "off" ? "off" : "on"), result);
+	});
+
+	control.AddCommand("record", "record", [](const vector<string> &args, string &result) {
+		// Starts a recording, or stops the running one
+		SaveDataClick(0, NULL);
+		result = saveState == Setup ? "started" : "stopping";
+		return true;
+	});
+	control.AddCommand("connect_fpga", "connect_fpga", [](const vector<string> &args, string &result) {
+		if (readState != Connect) {
+			result = "the FPGA is connected";
+			return false;
+		}
+		FPGAConnectClick(0, NULL);
+		return true;
+	});
+	control.AddCommand("status", "status", [](const vector<string> &args, string &result) {
+		result = "fpga=" + string(readState == Working ? "connected" : "disconnected") +
+			" exposure=" + to_string(exposure_slider) + " auto_exposure=" + OnOff(AutoExposureEnabled != FALSE) +
+			" threshold=" + to_string(threshold_low_slider) + "," + to_string(threshold_high_slider) +
+			" auto_contrast=" + OnOff(AutoContrastEnabled != FALSE) +
+			" auto_threshold=" + to_string((int)(histogram->GetThresholdPercentile() * 100 + 0.5)) +
+			" transparency=" + to_string(rgba_alpha_slider) +
+			" stream_downsample=" + (HoloDownsample == HOLO_DOWNSAMPLE_BOX ? "box" : "nearest") +
+			" calibration=" + OnOff(RequestCalibration != FALSE) + " track_markers=" + OnOff(TrackMarkers != FALSE) +
+			" sensor_correction=" + OnOff(IsStageEnabled("correct")) +
+			" temporal_filter=" + OnOff(IsStageEnabled("denoise")) +
+			" despeckle=" + (!IsStageEnabled("despeckle") ? "off" : despeckleMode == DESPECKLE_CLAMP ? "clamp" : "median") +
+			" recording=" + OnOff(saveState != Idle) +
+			" processing=" + OnOff(pipeline->FindStage("warp") != NULL && pipeline->FindStage("warp")->IsActive());
+		return true;
+	});
+	control.AddCommand("quit", "quit", [](const vector<string> &args, string &result) {
+		SetEvent(quit_event);
+		return true;
+	});
 }
 
 /*
-TQueue delete function for GpuMat
+Ctrl+C (or closing the console) quits like the 'q' key of the window
 */
-void delete_fun_GpuMat_ptr(cuda::GpuMat* input) {
-	delete input;
+BOOL WINAPI ConsoleCtrlHandler(DWORD ctrlType) {
+	if (ctrlType == CTRL_C_EVENT || ctrlType == CTRL_BREAK_EVENT || ctrlType == CTRL_CLOSE_EVENT) {
+		SetEvent(quit_event);
+		return TRUE;
+	}
+	return FALSE;
 }
 
-int main() {
+// ----------- Main Thread -----------
+
+int main(int argc, char *argv[]) {
 	_logger = spdlog::stdout_color_mt("Main");
 
+	// Compare the pixel kernels for the sensor geometry with the generic ones, then quit
+	if (argc > 1 && string(argv[1]) == "--benchmark") {
+		BenchmarkPixelKernels<IMAGE_WIDTH>(IMAGE_HEIGHT, BENCHMARK_FRAMES);
+		return 0;
+	}
+
+	// Pick (and log) the SIMD level of the pixel kernels before the stages use them
+	CpuDispatch::Level();
+
+	// Without the window (on a rack machine): the controls are the commands of the ControlServer
+	bool headless = argc > 1 && string(argv[1]) == "--headless";
+
 	// Set the delay time before exit the program (in ms)
 	int ExitDelay = 1500;
 
 	// A event that connects with the read thread 
 	// This event is set to be auto-reset (i.e. 2nd input is set as false). Therefore, every time a waitSingleObject() catch the event, this event will be automatically reset to unsignaled.
 	connect_FPGA_event = CreateEvent(NULL, FALSE, FALSE, NULL);
-
-	// Create tqueue for each thread
-	int tqCapacity = 10;
-	ProcessDatatq = new TQueue<UINT16*>(tqCapacity, delete_fun_UINT16_ptr);
-	Savetq = new TQueue<UINT16*>(tqCapacity, delete_fun_UINT16_ptr);
-	Displaytq = new TQueue<cuda::GpuMat*>(tqCapacity, delete_fun_GpuMat_ptr);
-	Networktq = new TQueue<cuda::GpuMat*>(tqCapacity, delete_fun_GpuMat_ptr);
-	
-
-	// Spawn threads
-	thread ReadThread(ReadData);
-	thread ProcessImageThread(ProcessImage);
-	thread DisplayThread(DisplayData);
-	thread NetworkThread(RunNetwork);
-	thread SaveDataThread(SaveData);
-
-	// Join Display Thread
-	DisplayThread.join();
-
-	// Close data saving process (if any)
-	if (saveState != Idle) {
-		saveState = Complete;
+	quit_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+
+	histogram = new HistogramEngine(IMAGE_WIDTH, IMAGE_HEIGHT);
+
+	// Build the pipeline from the config file
+	pipeline = new Pipeline();
+	pipeline->RegisterStage("acquire", []() { return new AcquireStage(); });
+	pipeline->RegisterStage("correct", []() { return new CorrectStage(); });
+	pipeline->RegisterStage("denoise", []() { return new DenoiseStage(); });
+	pipeline->RegisterStage("scale", []() { return new ScaleStage(); });
+	pipeline->RegisterStage("warp", []() { return new WarpStage(); });
+	pipeline->RegisterStage("despeckle", []() { return new DespeckleStage(); });
+	pipeline->RegisterStage("colorize", []() { return new ColorizeStage(); });
+	if (headless) {
+		pipeline->RegisterStage("display", []() { return new DiscardStage("display"); });
+	}
+	else {
+		pipeline->RegisterStage("display", []() { return new DisplayStage(); });
 	}
+	pipeline->RegisterStage("encode", []() { return new EncodeStage(); });
+	pipeline->RegisterStage("save", []() { return new SaveStage(); });
+
+	if (pipeline->Load(ExecutableFilePath(PIPELINE_CONFIG_FILE))) {
+		// Spawn threads
+		pipeline->Start();
+
+		// The commands also work next to the window. Headless, they are the only way to control the camera
+		ControlServer control;
+		AddControlCommands(control);
+		if (!control.Start() && headless) {
+			_logger->error("Cannot open the control port, headless mode can only be stopped with Ctrl+C.");
+		}
+
+		// Report the cost of the stages until the user quits
+		while (WaitForSingleObject(quit_event, PIPELINE_REPORT_INTERVAL_MS) == WAIT_TIMEOUT) {
+			pipeline->ReportTiming();
+			FramePool::Shared().ReportStats();
+		}
 
-	stop_running = 1;
+		control.Stop();
 
-	// In case ReadThread is still waiting for the connect_FPGA_event
-	SetEvent(connect_FPGA_event);
+		// Close data saving process (if any)
+		if (saveState != Idle) {
+			saveState = Complete;
+		}
 
-	// Join the rest of threads
-	ReadThread.join();
-	ProcessImageThread.join();
-	NetworkThread.join();
-	SaveDataThread.join();
+		pipeline->Stop();
+	}
+	else {
+		_logger->error("Invalid pipeline config.");
+	}
 
-	delete ProcessDatatq;
-	delete Displaytq;
-	delete Networktq;
-	delete Savetq;
+	delete pipeline;
+	pipeline = NULL;
+	delete histogram;
+	histogram = NULL;
 
 	CloseHandle(connect_FPGA_event);
 	connect_FPGA_event = INVALID_HANDLE_VALUE;
+	CloseHandle(quit_event);
+	quit_event = INVALID_HANDLE_VALUE;
 
 	// Exist the program
 	_logger->info("Existing Main...");
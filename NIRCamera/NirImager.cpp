@@ -391,6 +391,16 @@ Return:
 */
 unsigned char* NirImager::readImagerData() {
 	unsigned char *dataIn = new unsigned char[READ_SIZE]();
+
+	if (!readImagerData(dataIn)) {
+		delete[] dataIn;
+		dataIn = NULL;
+	}
+
+	return dataIn;
+}
+
+BOOL NirImager::readImagerData(unsigned char *dataIn) {
 	int rlen = dev->ReadFromBlockPipeOut(0xA0, BLOCK_SIZE, READ_SIZE, dataIn);
 
 	if (rlen != READ_SIZE) {
@@ -402,11 +412,10 @@ unsigned char* NirImager::readImagerData() {
 			_logger->warn("Fail to read a complete frame of data.");
 			//cout << "Fail to read a complete frame of data.\n";
 		}
-		delete[] dataIn;
-		dataIn = NULL;
+		return FALSE;
 	}
 
-	return dataIn;
+	return TRUE;
 }
 
 void NirImager::resetFIFO() {
@@ -70,5 +70,11 @@ public:
 
 	unsigned char *readImagerData();
 
+	/*
+	Read READ_SIZE bytes from the imager into dataIn (allocated by the caller)
+	Return FALSE if a complete transfer could not be read
+	*/
+	BOOL readImagerData(unsigned char *dataIn);
+
 	void changeExposure(double exposure);
 };
\ No newline at end of file
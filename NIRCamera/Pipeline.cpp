@@ -0,0 +1,565 @@
+#include "Pipeline.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+// ----------- ThreadSignal -----------
+
+void ThreadSignal::Notify() {
+	{
+		lock_guard<mutex> guard(lock);
+		pending = true;
+	}
+	ready.notify_one();
+}
+
+void ThreadSignal::Wait(int timeoutMs) {
+	unique_lock<mutex> guard(lock);
+	ready.wait_for(guard, chrono::milliseconds(timeoutMs), [this]() { return pending; });
+	pending = false;
+}
+
+// ----------- ChannelBase -----------
+
+ChannelBase::ChannelBase()
+{
+	producer = NULL;
+	consumer = NULL;
+	consumerSignal = NULL;
+	active = true;
+	decimate = 1;
+	rate = 0;
+	period = 0;
+	nextDue = 0;
+	lastOffered = 0;
+	interval = 0;
+}
+
+bool ChannelBase::Accept(UINT64 index) {
+	if (decimate > 1 && index % decimate != 0) {
+		return false;
+	}
+	if (rate <= 0) {
+		return true;
+	}
+
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	if (period == 0) {
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		period = (INT64)(frequency.QuadPart / rate);
+	}
+
+	// Keep track of how often the producer offers an item
+	if (lastOffered != 0) {
+		INT64 elapsed = now.QuadPart - lastOffered;
+		interval = interval == 0 ? elapsed : (interval * 7 + elapsed) / 8;
+	}
+	lastOffered = now.QuadPart;
+
+	// Pass the item if it is closer to the grid point than the next one will be
+	if (nextDue != 0 && now.QuadPart < nextDue - interval / 2) {
+		return false;
+	}
+
+	// Stay on the grid, unless the producer has stalled for more than a period
+	nextDue = nextDue == 0 ? now.QuadPart + period : nextDue + period;
+	if (nextDue <= now.QuadPart) {
+		nextDue = now.QuadPart + period;
+	}
+	return true;
+}
+
+// ----------- PipelineStage -----------
+
+PipelineStage::PipelineStage(const string &stageName)
+{
+	name = stageName;
+	enabled = true;
+	active = true;
+	timing.processed = 0;
+	timing.totalMs = 0;
+	timing.maxMs = 0;
+}
+
+PipelineStage::~PipelineStage()
+{
+}
+
+const string &PipelineStage::GetName() const {
+	return name;
+}
+
+bool PipelineStage::Bypass() {
+	if (inputs.size() == 1 && outputs.size() == 1 && inputs[0]->GetType() == outputs[0]->GetType()) {
+		return inputs[0]->ForwardTo(outputs[0]);
+	}
+
+	// Drop the input so that the producers are not held up by a disabled consumer
+	return DrainInputs();
+}
+
+bool PipelineStage::Idle() {
+	// Only what was queued before the stage went idle
+	DrainInputs();
+	return false;
+}
+
+void PipelineStage::SetEnabled(bool enable) {
+	enabled = enable;
+}
+
+bool PipelineStage::IsEnabled() const {
+	return enabled;
+}
+
+bool PipelineStage::IsActive() const {
+	return active;
+}
+
+PortBase *PipelineStage::FindInput(const string &portName) const {
+	for (size_t i = 0; i < inputs.size(); i++) {
+		if (inputs[i]->name == portName) {
+			return inputs[i];
+		}
+	}
+	return NULL;
+}
+
+PortBase *PipelineStage::FindOutput(const string &portName) const {
+	for (size_t i = 0; i < outputs.size(); i++) {
+		if (outputs[i]->name == portName) {
+			return outputs[i];
+		}
+	}
+	return NULL;
+}
+
+StageTiming PipelineStage::TakeTiming() {
+	lock_guard<mutex> lock(timingLock);
+	StageTiming result = timing;
+	timing.processed = 0;
+	timing.totalMs = 0;
+	timing.maxMs = 0;
+	return result;
+}
+
+void PipelineStage::AddInput(PortBase *port) {
+	inputs.push_back(port);
+}
+
+void PipelineStage::AddOutput(PortBase *port) {
+	outputs.push_back(port);
+}
+
+bool PipelineStage::DrainInputs() {
+	bool dropped = false;
+	for (size_t i = 0; i < inputs.size(); i++) {
+		dropped |= inputs[i]->Drain();
+	}
+	return dropped;
+}
+
+void PipelineStage::RecordTiming(double ms) {
+	lock_guard<mutex> lock(timingLock);
+	timing.processed++;
+	timing.totalMs += ms;
+	if (ms > timing.maxMs) {
+		timing.maxMs = ms;
+	}
+}
+
+// ----------- Pipeline -----------
+
+Pipeline::Pipeline()
+{
+	running = false;
+	lastDemandUpdate = 0;
+	_logger = spdlog::stdout_color_mt("Pipeline");
+}
+
+Pipeline::~Pipeline()
+{
+	Stop();
+
+	for (size_t i = 0; i < threads.size(); i++) {
+		delete threads[i];
+	}
+	for (size_t i = 0; i < stages.size(); i++) {
+		delete stages[i];
+	}
+	for (size_t i = 0; i < channels.size(); i++) {
+		delete channels[i];
+	}
+}
+
+void Pipeline::RegisterStage(const string &stageName, StageFactory factory) {
+	factories[stageName] = factory;
+}
+
+bool Pipeline::Load(const string &configFile) {
+	ifstream file(configFile);
+	if (!file.is_open()) {
+		_logger->error("Cannot open {0}", configFile);
+		return false;
+	}
+
+	_logger->info("Loading the pipeline from {0}", configFile);
+	return Parse(file) && Validate();
+}
+
+void Pipeline::Start() {
+	if (running) {
+		return;
+	}
+	running = true;
+
+	// A push wakes the thread of the consumer
+	for (size_t i = 0; i < channels.size(); i++) {
+		for (size_t j = 0; j < threads.size(); j++) {
+			vector<PipelineStage*> &threadStages = threads[j]->stages;
+			if (find(threadStages.begin(), threadStages.end(), channels[i]->consumer) != threadStages.end()) {
+				channels[i]->consumerSignal = &threads[j]->signal;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i]->worker = thread(&Pipeline::ThreadFunction, this, threads[i]);
+	}
+}
+
+void Pipeline::Stop() {
+	running = false;
+	for (size_t i = 0; i < stages.size(); i++) {
+		stages[i]->Wake();
+	}
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i]->signal.Notify();
+	}
+	for (size_t i = 0; i < threads.size(); i++) {
+		if (threads[i]->worker.joinable()) {
+			threads[i]->worker.join();
+		}
+	}
+}
+
+PipelineStage *Pipeline::FindStage(const string &stageName) const {
+	for (size_t i = 0; i < stages.size(); i++) {
+		if (stages[i]->GetName() == stageName) {
+			return stages[i];
+		}
+	}
+	return NULL;
+}
+
+bool Pipeline::SetStageEnabled(const string &stageName, bool enable) {
+	PipelineStage *stage = FindStage(stageName);
+	if (stage == NULL) {
+		return false;
+	}
+	stage->SetEnabled(enable);
+	_logger->info("Stage {0} {1}", stageName, enable ? "enabled" : "disabled");
+	return true;
+}
+
+void Pipeline::ReportTiming() {
+	for (size_t i = 0; i < stages.size(); i++) {
+		StageTiming timing = stages[i]->TakeTiming();
+		string state;
+		if (!stages[i]->IsActive()) {
+			state += " (no demand)";
+		}
+		if (!stages[i]->IsEnabled()) {
+			state += " (disabled)";
+		}
+
+		if (timing.processed == 0) {
+			_logger->info("{0:<10} idle{1}", stages[i]->GetName(), state);
+			continue;
+		}
+		_logger->info("{0:<10} {1:>6} calls, avg {2:.3f} ms, max {3:.3f} ms{4}", stages[i]->GetName(), timing.processed,
+			timing.totalMs / timing.processed, timing.maxMs, state);
+	}
+}
+
+bool Pipeline::Parse(istream &config) {
+	string line;
+	int lineNum = 0;
+	while (getline(config, line)) {
+		lineNum++;
+
+		// Strip the comment
+		size_t comment = line.find('#');
+		if (comment != string::npos) {
+			line = line.substr(0, comment);
+		}
+
+		istringstream lineStream(line);
+		vector<string> tokens;
+		string token;
+		while (lineStream >> token) {
+			tokens.push_back(token);
+		}
+		if (tokens.empty()) {
+			continue;
+		}
+
+		bool success;
+		if (tokens[0] == "stage") {
+			success = ParseStage(tokens, lineNum);
+		}
+		else if (tokens[0] == "connect") {
+			success = ParseConnect(tokens, lineNum);
+		}
+		else {
+			_logger->error("Line {0}: unknown statement \"{1}\"", lineNum, tokens[0]);
+			success = false;
+		}
+
+		if (!success) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Pipeline::ParseStage(vector<string> &tokens, int lineNum) {
+	if (tokens.size() < 2) {
+		_logger->error("Line {0}: missing stage name", lineNum);
+		return false;
+	}
+
+	const string &stageName = tokens[1];
+	map<string, StageFactory>::iterator factory = factories.find(stageName);
+	if (factory == factories.end()) {
+		_logger->error("Line {0}: unknown stage \"{1}\"", lineNum, stageName);
+		return false;
+	}
+	if (FindStage(stageName) != NULL) {
+		_logger->error("Line {0}: stage \"{1}\" is declared twice", lineNum, stageName);
+		return false;
+	}
+
+	// A stage without a thread gets a thread of its own
+	string threadName = stageName;
+	bool enable = true;
+	for (size_t i = 2; i < tokens.size(); i++) {
+		size_t equal = tokens[i].find('=');
+		string key = tokens[i].substr(0, equal);
+		string value = equal == string::npos ? "" : tokens[i].substr(equal + 1);
+		if (key == "thread" && !value.empty()) {
+			threadName = value;
+		}
+		else if (key == "enabled" && (value == "0" || value == "1")) {
+			enable = value == "1";
+		}
+		else {
+			_logger->error("Line {0}: invalid stage option \"{1}\"", lineNum, tokens[i]);
+			return false;
+		}
+	}
+
+	PipelineStage *stage = factory->second();
+	stage->SetEnabled(enable);
+	stages.push_back(stage);
+	FindThread(threadName)->stages.push_back(stage);
+	return true;
+}
+
+bool Pipeline::ParseConnect(vector<string> &tokens, int lineNum) {
+	if (tokens.size() < 4 || tokens[2] != "->") {
+		_logger->error("Line {0}: expected \"connect <stage>.<port> -> <stage>.<port>\"", lineNum);
+		return false;
+	}
+
+	// Split "stage.port"
+	size_t fromDot = tokens[1].find('.');
+	size_t toDot = tokens[3].find('.');
+	if (fromDot == string::npos || toDot == string::npos) {
+		_logger->error("Line {0}: ports are written as <stage>.<port>", lineNum);
+		return false;
+	}
+
+	PipelineStage *producer = FindStage(tokens[1].substr(0, fromDot));
+	PipelineStage *consumer = FindStage(tokens[3].substr(0, toDot));
+	if (producer == NULL || consumer == NULL) {
+		_logger->error("Line {0}: stages must be declared before they are connected", lineNum);
+		return false;
+	}
+
+	PortBase *output = producer->FindOutput(tokens[1].substr(fromDot + 1));
+	PortBase *input = consumer->FindInput(tokens[3].substr(toDot + 1));
+	if (output == NULL || input == NULL) {
+		_logger->error("Line {0}: unknown port", lineNum);
+		return false;
+	}
+	if (output->GetType() != input->GetType()) {
+		_logger->error("Line {0}: {1} and {2} carry different data", lineNum, tokens[1], tokens[3]);
+		return false;
+	}
+	if (input->IsConnected()) {
+		_logger->error("Line {0}: {1} is already connected", lineNum, tokens[3]);
+		return false;
+	}
+
+	int capacity = 10;
+	int tolerance = 0;
+	int decimate = 1;
+	double rate = 0;
+	for (size_t i = 4; i < tokens.size(); i++) {
+		size_t equal = tokens[i].find('=');
+		string key = tokens[i].substr(0, equal);
+		int value = equal == string::npos ? -1 : atoi(tokens[i].c_str() + equal + 1);
+		if (key == "capacity" && value > 0) {
+			capacity = value;
+		}
+		else if (key == "tolerance" && value >= 0) {
+			tolerance = value;
+		}
+		else if (key == "decimate" && value > 0) {
+			decimate = value;
+		}
+		else if (key == "rate" && equal != string::npos && atof(tokens[i].c_str() + equal + 1) > 0) {
+			rate = atof(tokens[i].c_str() + equal + 1);
+		}
+		else {
+			_logger->error("Line {0}: invalid connect option \"{1}\"", lineNum, tokens[i]);
+			return false;
+		}
+	}
+
+	ChannelBase *channel = output->CreateChannel(capacity, tolerance);
+	channel->name = tokens[1] + " -> " + tokens[3];
+	channel->producer = producer;
+	channel->consumer = consumer;
+	channel->decimate = decimate;
+	channel->rate = rate;
+	output->Attach(channel);
+	input->Attach(channel);
+	channels.push_back(channel);
+	return true;
+}
+
+bool Pipeline::Validate() {
+	if (stages.empty()) {
+		_logger->error("The pipeline has no stage");
+		return false;
+	}
+
+	// Unconnected ports are allowed (e.g. no network stage), but worth a warning
+	for (size_t i = 0; i < stages.size(); i++) {
+		for (size_t j = 0; j < stages[i]->inputs.size(); j++) {
+			if (!stages[i]->inputs[j]->IsConnected()) {
+				_logger->warn("{0}.{1} is not connected", stages[i]->GetName(), stages[i]->inputs[j]->name);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < threads.size(); i++) {
+		string names;
+		for (size_t j = 0; j < threads[i]->stages.size(); j++) {
+			names += " " + threads[i]->stages[j]->GetName();
+		}
+		_logger->info("Thread {0}:{1}", threads[i]->name, names);
+	}
+	return true;
+}
+
+Pipeline::StageThread *Pipeline::FindThread(const string &threadName) {
+	for (size_t i = 0; i < threads.size(); i++) {
+		if (threads[i]->name == threadName) {
+			return threads[i];
+		}
+	}
+	StageThread *stageThread = new StageThread();
+	stageThread->name = threadName;
+	threads.push_back(stageThread);
+	return stageThread;
+}
+
+void Pipeline::UpdateDemand() {
+	// Start from the stages that want the data themselves and walk up the channels to their producers
+	map<PipelineStage*, bool> demand;
+	for (size_t i = 0; i < stages.size(); i++) {
+		demand[stages[i]] = stages[i]->HasDemand();
+	}
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t i = 0; i < channels.size(); i++) {
+			if (demand[channels[i]->consumer] && !demand[channels[i]->producer]) {
+				demand[channels[i]->producer] = true;
+				changed = true;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < stages.size(); i++) {
+		bool active = demand[stages[i]];
+		if (stages[i]->active != active) {
+			stages[i]->active = active;
+			_logger->info("Stage {0} {1}", stages[i]->GetName(), active ? "active" : "idle");
+		}
+	}
+	for (size_t i = 0; i < channels.size(); i++) {
+		channels[i]->active = demand[channels[i]->consumer];
+	}
+}
+
+void Pipeline::ThreadFunction(StageThread *stageThread) {
+	vector<PipelineStage*> &threadStages = stageThread->stages;
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	double ticksToMs = 1000.0 / frequency.QuadPart;
+	INT64 demandInterval = frequency.QuadPart * PIPELINE_DEMAND_INTERVAL_MS / 1000;
+
+	for (size_t i = 0; i < threadStages.size(); i++) {
+		threadStages[i]->Start();
+	}
+
+	while (running) {
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		if (now.QuadPart - lastDemandUpdate >= demandInterval && demandLock.try_lock()) {
+			lastDemandUpdate = now.QuadPart;
+			UpdateDemand();
+			demandLock.unlock();
+		}
+
+		// Give every stage of this thread one turn
+		bool busy = false;
+		for (size_t i = 0; i < threadStages.size(); i++) {
+			PipelineStage *stage = threadStages[i];
+
+			if (!stage->IsActive()) {
+				stage->Idle();
+				continue;
+			}
+
+			LARGE_INTEGER begin, end;
+			QueryPerformanceCounter(&begin);
+			bool processed = stage->IsEnabled() ? stage->Process() : stage->Bypass();
+			QueryPerformanceCounter(&end);
+
+			if (processed) {
+				stage->RecordTiming((end.QuadPart - begin.QuadPart) * ticksToMs);
+				busy = true;
+			}
+		}
+
+		// Nothing to do, sleep until a producer pushes data (or the demand is due again)
+		if (!busy) {
+			stageThread->signal.Wait(PIPELINE_DEMAND_INTERVAL_MS);
+		}
+	}
+
+	for (size_t i = 0; i < threadStages.size(); i++) {
+		threadStages[i]->Stop();
+	}
+}
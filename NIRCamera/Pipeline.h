@@ -0,0 +1,386 @@
+#pragma once
+
+#include <Windows.h>
+#include "spdlog/spdlog.h"
+
+#include "TQueue.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <istream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+
+using namespace std;
+
+// How often the demand of the stages is looked at (ms)
+#define PIPELINE_DEMAND_INTERVAL_MS 100
+
+class PipelineStage;
+
+// ----------- Channels -----------
+
+/*
+Wakes a pipeline thread that has nothing to do when data arrives for one of its stages
+*/
+class ThreadSignal {
+public:
+	ThreadSignal() { pending = false; }
+
+	void Notify();
+
+	// Wait until Notify() is called or timeoutMs has passed. Return at once if Notify() has been called since the last Wait()
+	void Wait(int timeoutMs);
+
+private:
+	mutex lock;
+	condition_variable ready;
+	bool pending;
+};
+
+/*
+A channel carries the data from an output port of one stage to an input port of another stage.
+It is a TQueue, so it keeps the single writer/single reader and latest-data semantics of TQueue.
+A channel may pass only part of the data: every <decimate>th item and/or at most <rate> items per second.
+*/
+class ChannelBase {
+public:
+	ChannelBase();
+	virtual ~ChannelBase() {}
+
+	virtual const type_info &GetType() const = 0;
+
+	/*
+	Decide whether the item number index of the producer's port goes through (called by the producer only).
+	With a rate, the items are picked on a fixed grid of 1/rate s: the item that is closest to a grid point
+	is passed on right away, so the consumer gets evenly spaced items without waiting for them.
+	*/
+	bool Accept(UINT64 index);
+
+	string name;					// "producer.port -> consumer.port"
+	PipelineStage *producer;
+	PipelineStage *consumer;
+	ThreadSignal *consumerSignal;	// Signal of the consumer's thread, NULL until the pipeline starts
+	atomic<bool> active;			// FALSE while the consumer is idle, nothing is pushed then
+
+	int decimate;					// Pass every <decimate>th item (1: all of them)
+	double rate;					// Pass at most this many items per second (0: no limit)
+
+private:
+	INT64 period;					// 1/rate in QueryPerformanceCounter ticks
+	INT64 nextDue;					// Next grid point
+	INT64 lastOffered;				// When the last item was offered
+	INT64 interval;					// Average time between two items of the producer
+};
+
+template<class T>
+class Channel : public ChannelBase {
+public:
+	Channel(int capacity, unsigned long tolerance) : queue(capacity) {
+		queue.set_tolerance(tolerance);
+	}
+
+	const type_info &GetType() const { return typeid(T); }
+
+	void Push(T &data) {
+		queue.push(data);
+		if (consumerSignal != NULL) {
+			consumerSignal->Notify();
+		}
+	}
+
+	// Return FALSE if there is no data
+	bool Pop(T &data) {
+		T invalid = T();
+		T popped = queue.pop(invalid);
+		if (IsEmpty(popped)) {
+			return false;
+		}
+		data = popped;
+		return true;
+	}
+
+private:
+	TQueue<T> queue;
+
+	// TQueue returns a default constructed T when it is empty
+	template<class U> static bool IsEmpty(const U &data) { return data.empty(); }
+	template<class U> static bool IsEmpty(U *data) { return data == NULL; }
+};
+
+// ----------- Ports -----------
+
+/*
+A named, typed connection point of a stage. Channels are attached to the ports by the Pipeline.
+*/
+class PortBase {
+public:
+	PortBase(const string &portName) { name = portName; }
+	virtual ~PortBase() {}
+
+	virtual const type_info &GetType() const = 0;
+
+	// Create a channel that fits this port (only called on output ports)
+	virtual ChannelBase *CreateChannel(int capacity, unsigned long tolerance) = 0;
+
+	virtual void Attach(ChannelBase *channel) = 0;
+	virtual bool IsConnected() const = 0;
+
+	/*
+	Input ports only: move one item to out (an output port of the same type) without touching it.
+	Return FALSE if there is no data.
+	*/
+	virtual bool ForwardTo(PortBase *out) = 0;
+
+	/*
+	Input ports only: drop the pending data. Return FALSE if there is no data.
+	*/
+	virtual bool Drain() = 0;
+
+	string name;
+};
+
+template<class T>
+class OutputPort : public PortBase {
+public:
+	OutputPort(const string &portName) : PortBase(portName) { pushed = 0; }
+
+	const type_info &GetType() const { return typeid(T); }
+
+	ChannelBase *CreateChannel(int capacity, unsigned long tolerance) {
+		return new Channel<T>(capacity, tolerance);
+	}
+
+	void Attach(ChannelBase *channel) { channels.push_back(static_cast<Channel<T>*>(channel)); }
+	bool IsConnected() const { return !channels.empty(); }
+
+	bool ForwardTo(PortBase *out) { return false; }
+	bool Drain() { return false; }
+
+	// Send data to every connected consumer that is active and wants this item
+	void Push(T &data) {
+		// All the channels count the same items, so consumers with the same decimation get the same items
+		for (size_t i = 0; i < channels.size(); i++) {
+			if (channels[i]->active && channels[i]->Accept(pushed)) {
+				channels[i]->Push(data);
+			}
+		}
+		pushed++;
+	}
+
+private:
+	vector<Channel<T>*> channels;
+	UINT64 pushed;					// Items pushed so far
+};
+
+template<class T>
+class InputPort : public PortBase {
+public:
+	InputPort(const string &portName) : PortBase(portName) { channel = NULL; }
+
+	const type_info &GetType() const { return typeid(T); }
+
+	ChannelBase *CreateChannel(int capacity, unsigned long tolerance) { return NULL; }
+
+	void Attach(ChannelBase *newChannel) { channel = static_cast<Channel<T>*>(newChannel); }
+	bool IsConnected() const { return channel != NULL; }
+
+	bool ForwardTo(PortBase *out) {
+		T data;
+		if (!Pop(data)) {
+			return false;
+		}
+		static_cast<OutputPort<T>*>(out)->Push(data);
+		return true;
+	}
+
+	bool Drain() {
+		T data;
+		return Pop(data);
+	}
+
+	// Get the next data. Return FALSE if there is none (or the port is not connected)
+	bool Pop(T &data) {
+		if (channel == NULL) {
+			return false;
+		}
+		return channel->Pop(data);
+	}
+
+private:
+	Channel<T> *channel;
+};
+
+// ----------- Stages -----------
+
+// Timing of a stage since the last report
+class StageTiming {
+public:
+	int processed;			// Number of Process() calls that did some work
+	double totalMs;
+	double maxMs;
+};
+
+/*
+A stage is one step of the processing pipeline (acquire, correct, scale, ...).
+It declares its input/output ports in the constructor, and the Pipeline connects them as the config file says.
+The Pipeline calls Process() in a loop on the thread the stage is placed on; stages that share a thread
+run one after the other, so a stage that blocks should get a thread of its own.
+
+The pipeline is demand driven: a stage is active if it has a demand of its own (HasDemand()) or if one of
+the stages it feeds is active. Idle stages are not processed at all and nothing is pushed to them.
+*/
+class PipelineStage {
+public:
+	PipelineStage(const string &stageName);
+	virtual ~PipelineStage();
+
+	const string &GetName() const;
+
+	// Called on the stage's thread before the first Process()
+	virtual void Start() {}
+
+	// Called on the stage's thread after the last Process()
+	virtual void Stop() {}
+
+	// Called by Pipeline::Stop() from another thread. A stage that blocks in Process() has to return from it.
+	virtual void Wake() {}
+
+	/*
+	Do one unit of work. Return TRUE if something has been processed, FALSE if the stage is idle
+	*/
+	virtual bool Process() = 0;
+
+	/*
+	Called instead of Process() while the stage is disabled.
+	By default a stage with one input and one output of the same type passes its data through unchanged,
+	any other stage drops its input.
+	*/
+	virtual bool Bypass();
+
+	/*
+	TRUE if the stage needs its input for itself, e.g. a sink that someone is listening to (recording on,
+	clients streaming, window visible). Called from any pipeline thread, so it must be cheap and thread safe.
+	*/
+	virtual bool HasDemand() const { return false; }
+
+	/*
+	Called instead of Process() while the stage is idle. By default it drops what is left in the inputs.
+	*/
+	virtual bool Idle();
+
+	void SetEnabled(bool enable);
+	bool IsEnabled() const;
+
+	// FALSE while no one downstream wants the output of the stage
+	bool IsActive() const;
+
+	PortBase *FindInput(const string &portName) const;
+	PortBase *FindOutput(const string &portName) const;
+
+	// Get the timing since the last call and restart it
+	StageTiming TakeTiming();
+
+protected:
+	void AddInput(PortBase *port);
+	void AddOutput(PortBase *port);
+
+private:
+	friend class Pipeline;
+
+	string name;
+	atomic<bool> enabled;
+	atomic<bool> active;
+	vector<PortBase*> inputs;
+	vector<PortBase*> outputs;
+
+	mutex timingLock;
+	StageTiming timing;
+
+	void RecordTiming(double ms);
+
+	bool DrainInputs();
+};
+
+// ----------- Pipeline -----------
+
+/*
+The Pipeline builds the stages and channels from a config file, places the stages on threads and runs them.
+
+Config file format (one statement per line, '#' starts a comment):
+	stage <name> thread=<thread name> [enabled=0|1]
+	connect <stage>.<output port> -> <stage>.<input port> [capacity=N] [tolerance=N] [decimate=N] [rate=Hz]
+<name> must be a stage type that has been registered with RegisterStage(). capacity and tolerance
+are the TQueue parameters of the channel, decimate and rate thin out the data (see ChannelBase).
+*/
+class Pipeline
+{
+public:
+	typedef function<PipelineStage*()> StageFactory;
+
+	Pipeline();
+	~Pipeline();
+
+	/*
+	Make a stage type available to the config file
+	*/
+	void RegisterStage(const string &stageName, StageFactory factory);
+
+	/*
+	Build the pipeline from the config file. Return FALSE if the file cannot be opened or the config is invalid.
+	*/
+	bool Load(const string &configFile);
+
+	// Start one thread per thread name of the config
+	void Start();
+
+	// Stop and join all the threads
+	void Stop();
+
+	// Return NULL if there is no stage with this name
+	PipelineStage *FindStage(const string &stageName) const;
+
+	// Enable/disable a stage at runtime. Return FALSE if the stage does not exist
+	bool SetStageEnabled(const string &stageName, bool enable);
+
+	// Print the timing and the state of each stage since the last report
+	void ReportTiming();
+
+private:
+	class StageThread {
+	public:
+		string name;
+		vector<PipelineStage*> stages;
+		thread worker;
+		ThreadSignal signal;		// Set when data is pushed to one of the stages
+	};
+
+	map<string, StageFactory> factories;
+	vector<PipelineStage*> stages;
+	vector<ChannelBase*> channels;
+	vector<StageThread*> threads;
+	atomic<bool> running;
+
+	// The demand is updated by whichever thread gets the lock
+	mutex demandLock;
+	atomic<INT64> lastDemandUpdate;
+
+	std::shared_ptr<spdlog::logger> _logger;
+
+	bool Parse(istream &config);
+	bool ParseStage(vector<string> &tokens, int lineNum);
+	bool ParseConnect(vector<string> &tokens, int lineNum);
+	bool Validate();
+
+	StageThread *FindThread(const string &threadName);
+
+	// Work out which stages are active (see PipelineStage) and switch the channels of the idle ones off
+	void UpdateDemand();
+
+	void ThreadFunction(StageThread *stageThread);
+};
@@ -0,0 +1,562 @@
+#include "PixelKernels.h"
+
+#include <intrin.h>
+#include <cmath>
+
+// The AVX-512 intrinsics need Visual Studio 2017 15.3 or newer, older compilers run the AVX2 versions on such CPUs
+#if (defined(_MSC_VER) && _MSC_VER >= 1911) || defined(__AVX512BW__)
+#define PIXEL_KERNELS_AVX512
+#endif
+
+// ----------- Scalar -----------
+
+/*
+The 16 to 8 bit scaling of every level: clamp to [0, 255] in float, then round to nearest even (the rounding mode
+of the FPU and of cvtps2dq). Multiply and add stay separate operations, an FMA would round differently.
+*/
+static inline UINT8 Scale16To8Pixel(UINT16 value, float scale, float offset) {
+	float scaled = (float)value * scale + offset;
+	scaled = scaled < 0.0f ? 0.0f : (scaled > 255.0f ? 255.0f : scaled);
+	return (UINT8)lrintf(scaled);
+}
+
+static void Scale16To8Scalar(const UINT16 *src, UINT8 *dst, float scale, float offset, int count) {
+	for (int i = 0; i < count; i++) {
+		dst[i] = Scale16To8Pixel(src[i], scale, offset);
+	}
+}
+
+static void Colorize3Scalar(const UINT8 *src, UINT8 *dst, const UINT32 *table, int count) {
+	if (count <= 0) {
+		return;
+	}
+	// A 4 byte store per pixel, the 4th byte is overwritten by the next pixel
+	int x = 0;
+	for (; x < count - 1; x++) {
+		memcpy(dst + 3 * x, table + src[x], 4);
+	}
+	memcpy(dst + 3 * x, table + src[x], 3);
+}
+
+static void EncodeHolo16Scalar(const UINT8 *src, UINT8 *dst, const UINT16 *table, int count) {
+	for (int x = 0; x < count; x++) {
+		UINT16 value = table[src[x]];
+		memcpy(dst + 2 * x, &value, 2);
+	}
+}
+
+static void EncodeHolo16Nearest2Scalar(const UINT8 *row0, const UINT8 *row1, UINT8 *dst, const UINT16 *table, int count) {
+	for (int x = 0; x < count; x++) {
+		UINT16 value = table[row0[2 * x]];
+		memcpy(dst + 2 * x, &value, 2);
+	}
+}
+
+static void EncodeHolo16Box2Scalar(const UINT8 *row0, const UINT8 *row1, UINT8 *dst, const UINT16 *table, int count) {
+	for (int x = 0; x < count; x++) {
+		UINT16 value = table[(row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2];
+		memcpy(dst + 2 * x, &value, 2);
+	}
+}
+
+static void Downsample2NearestScalar(const UINT8 *row0, const UINT8 *row1, UINT8 *dst, int count) {
+	for (int x = 0; x < count; x++) {
+		dst[x] = row0[2 * x];
+	}
+}
+
+static void Downsample2BoxScalar(const UINT8 *row0, const UINT8 *row1, UINT8 *dst, int count) {
+	for (int x = 0; x < count; x++) {
+		dst[x] = (UINT8)((row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2);
+	}
+}
+
+static UINT64 Sum8Scalar(const UINT8 *src, int count) {
+	UINT64 sum = 0;
+	for (int i = 0; i < count; i++) {
+		sum += src[i];
+	}
+	return sum;
+}
+
+// Minimum and maximum per pixel of the 3x3 filters
+static inline UINT8 VMin(UINT8 a, UINT8 b) { return a < b ? a : b; }
+static inline UINT8 VMax(UINT8 a, UINT8 b) { return a > b ? a : b; }
+static inline __m128i VMin(__m128i a, __m128i b) { return _mm_min_epu8(a, b); }
+static inline __m128i VMax(__m128i a, __m128i b) { return _mm_max_epu8(a, b); }
+static inline __m256i VMin(__m256i a, __m256i b) { return _mm256_min_epu8(a, b); }
+static inline __m256i VMax(__m256i a, __m256i b) { return _mm256_max_epu8(a, b); }
+#ifdef PIXEL_KERNELS_AVX512
+static inline __m512i VMin(__m512i a, __m512i b) { return _mm512_min_epu8(a, b); }
+static inline __m512i VMax(__m512i a, __m512i b) { return _mm512_max_epu8(a, b); }
+#endif
+
+/*
+The 3x3 median is the median of (the largest column minimum, the median of the column medians, the smallest
+column maximum) once each column of the neighbourhood is sorted: 3 sorts of 3 and 3 medians/extrema of 3 instead
+of a full sort of 9. The same network runs on single pixels and on SIMD vectors of pixels (V).
+*/
+template<class V>
+static inline void Sort3(V &a, V &b, V &c) {
+	V t = VMin(a, b); b = VMax(a, b); a = t;
+	t = VMin(b, c); c = VMax(b, c); b = t;
+	t = VMin(a, b); b = VMax(a, b); a = t;
+}
+
+template<class V>
+static inline V Median3(V a, V b, V c) {
+	return VMax(VMin(a, b), VMin(VMax(a, b), c));
+}
+
+template<class V>
+static inline V Median3x3(V a0, V a1, V a2, V b0, V b1, V b2, V c0, V c1, V c2) {
+	// Columns 0, 1 and 2, top to bottom
+	Sort3(a0, b0, c0);
+	Sort3(a1, b1, c1);
+	Sort3(a2, b2, c2);
+	V low = VMax(VMax(a0, a1), a2);
+	V high = VMin(VMin(c0, c1), c2);
+	return Median3(low, Median3(b0, b1, b2), high);
+}
+
+/*
+A speckle is a pixel outside the range of all of its 8 neighbours: pull it to the nearest end of that range.
+An edge always has neighbours on both sides, so it passes unchanged.
+*/
+template<class V>
+static inline V ClampSpeckle3x3(V a0, V a1, V a2, V b0, V b1, V b2, V c0, V c1, V c2) {
+	V low = VMin(VMin(VMin(a0, a1), VMin(a2, b0)), VMin(VMin(b2, c0), VMin(c1, c2)));
+	V high = VMax(VMax(VMax(a0, a1), VMax(a2, b0)), VMax(VMax(b2, c0), VMax(c1, c2)));
+	return VMin(VMax(b1, low), high);
+}
+
+// The pixels [begin, end) of a row, 0 < begin and end < row length
+template<bool MEDIAN>
+static void Filter3x3Pixels(const UINT8 *above, const UINT8 *row, const UINT8 *below, UINT8 *dst, int begin, int end) {
+	for (int x = begin; x < end; x++) {
+		if (MEDIAN) {
+			dst[x] = Median3x3<UINT8>(above[x - 1], above[x], above[x + 1], row[x - 1], row[x], row[x + 1], below[x - 1], below[x], below[x + 1]);
+		}
+		else {
+			dst[x] = ClampSpeckle3x3<UINT8>(above[x - 1], above[x], above[x + 1], row[x - 1], row[x], row[x + 1], below[x - 1], below[x], below[x + 1]);
+		}
+	}
+}
+
+/*
+One row of a 3x3 filter with the vectors of VECTOR (Load, Store and the type V of N pixels). The pixels that
+do not fill a vector at the end of the row get a last vector that overlaps the one before (src and dst are
+different rows, so these pixels are just written twice), only rows shorter than a vector run one by one.
+The first and the last pixel of the row are copied.
+*/
+template<bool MEDIAN, class VECTOR>
+static void Filter3x3Row(const UINT8 *above, const UINT8 *row, const UINT8 *below, UINT8 *dst, int count) {
+	typedef typename VECTOR::V V;
+	if (count < 3) {
+		memcpy(dst, row, count);
+		return;
+	}
+	dst[0] = row[0];
+	dst[count - 1] = row[count - 1];
+
+	const int end = count - 1;
+	if (end - 1 < VECTOR::N) {
+		Filter3x3Pixels<MEDIAN>(above, row, below, dst, 1, end);
+		return;
+	}
+	for (int x = 1; x < end; x += VECTOR::N) {
+		if (x + VECTOR::N > end) {
+			x = end - VECTOR::N;
+		}
+		V a0 = VECTOR::Load(above + x - 1), a1 = VECTOR::Load(above + x), a2 = VECTOR::Load(above + x + 1);
+		V b0 = VECTOR::Load(row + x - 1), b1 = VECTOR::Load(row + x), b2 = VECTOR::Load(row + x + 1);
+		V c0 = VECTOR::Load(below + x - 1), c1 = VECTOR::Load(below + x), c2 = VECTOR::Load(below + x + 1);
+		VECTOR::Store(dst + x, MEDIAN ? Median3x3(a0, a1, a2, b0, b1, b2, c0, c1, c2) : ClampSpeckle3x3(a0, a1, a2, b0, b1, b2, c0, c1, c2));
+	}
+}
+
+struct ScalarVector {
+	typedef UINT8 V;
+	enum { N = 1 };
+	static inline V Load(const UINT8 *p) { return *p; }
+	static inline void Store(UINT8 *p, V v) { *p = v; }
+};
+
+static void Median3x3Scalar(const UINT8 *above, const UINT8 *row, const UINT8 *below, UINT8 *dst, int count) {
+	Filter3x3Row<true, ScalarVector>(above, row, below, dst, count);
+}
+
+static void ClampSpeckle3x3Scalar(const UINT8 *above, const UINT8 *row, const UINT8 *below, UINT8 *dst, int count) {
+	Filter3x3Row<false, ScalarVector>(above, row, below, dst, count);
+}
+
+// ----------- SSE4.1 -----------
+
+// 4 pixels (in the 32 bit lanes) scaled as Scale16To8Pixel, in the 32 bit lanes
+static inline __m128i Scale4SSE41(__m128i values, __m128 scale, __m128 offset) {
+	__m128 scaled = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(values), scale), offset);
+	scaled = _mm_min_ps(_mm_max_ps(scaled, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+	return _mm_cvtps_epi32(scaled);
+}
+
+static void Scale16To8SSE41(const UINT16 *src, UINT8 *dst, float scale, float offset, int count) {
+	const __m128 vscale = _mm_set1_ps(scale);
+	const __m128 voffset = _mm_set1_ps(offset);
+	const __m128i zero = _mm_setzero_si128();
+	int x = 0;
+	for (; x + 16 <= count; x += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(src + x));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + x + 8));
+		__m128i low = _mm_packs_epi32(Scale4SSE41(_mm_unpacklo_epi16(a, zero), vscale, voffset), Scale4SSE41(_mm_unpackhi_epi16(a, zero), vscale, voffset));
+		__m128i high = _mm_packs_epi32(Scale4SSE41(_mm_unpacklo_epi16(b, zero), vscale, voffset), Scale4SSE41(_mm_unpackhi_epi16(b, zero), vscale, voffset));
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(low, high));
+	}
+	Scale16To8Scalar(src + x, dst + x, scale, offset, count - x);
+}
+
+// The rounded means of the 2x2 blocks of 16 bytes of row0 and row1, in the 16 bit lanes (as Box2Mean16 of AVX2)
+static inline __m128i Box2Mean8(const UINT8 *row0, const UINT8 *row1) {
+	const __m128i ones = _mm_set1_epi8(1);
+	__m128i sum0 = _mm_maddubs_epi16(_mm_loadu_si128((const __m128i*)row0), ones);
+	__m128i sum1 = _mm_maddubs_epi16(_mm_loadu_si128((const __m128i*)row1), ones);
+	return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(sum0, sum1), _mm_set1_epi16(2)), 2);
+}
+
+static void Downsample2NearestSSE41(const UINT8 *row0, const UINT8 *row1, UINT8 *dst, int count) {
+	// The even pixels are the low bytes of the 16 bit lanes
+	const __m128i evenBytes = _mm_set1_epi16(0x00ff);
+	int x = 0;
+	for (; x + 16 <= count; x += 16) {
+		__m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(row0 + 2 * x)), evenBytes);
+		__m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(row0 + 2 * x + 16)), evenBytes);
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(a, b));
+	}
+	Downsample2NearestScalar(row0 + 2 * x, row1 + 2 * x, dst + x, count - x);
+}
+
+static void Downsample2BoxSSE41(const UINT8 *row0, const UINT8 *row1, UINT8 *dst, int count) {
+	int x = 0;
+	for (; x + 16 <= count; x += 16) {
+		__m128i a = Box2Mean8(row0 + 2 * x, row1 + 2 * x);
+		__m128i b = Box2Mean8(row0 + 2 * x + 16, row1 + 2 * x + 16);
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(a, b));
+	}
+	Downsample2BoxScalar(row0 + 2 * x, row1 + 2 * x, dst + x, count - x);
+}
+
+static UINT64 Sum8SSE41(const UINT8 *src, int count) {
+	// psadbw against 0 adds up 8 bytes into each 64 bit half
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sums = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		sums = _mm_add_epi64(sums, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(src + i)), zero));
+	}
+	UINT64 sum = (UINT64)_mm_cvtsi128_si64(sums) + (UINT64)_mm_extract_epi64(sums, 1);
+	return sum + Sum8Scalar(src + i, count - i);
+}
+
+struct SSEVector {
+	typedef __m128i V;
+	enum { N = 16 };
+	static inline V Load(const UINT8 *p) { return _mm_loadu_si128((const __m128i*)p); }
+	static inline void Store(UINT8 *p, V v) { _mm_storeu_si128((__m128i*)p, v); }
+};
+
+static void Median3x3SSE41(const UINT8 *above, const UINT8 *row, const UINT8 *below, UINT8 *dst, int count) {
+	Filter3x3Row<true, SSEVector>(above, row, below, dst, count);
+}
+
+static void ClampSpeckle3x3SSE41(const UINT8 *above, const UINT8 *row, const UINT8 *below, UINT8 *dst, int count) {
+	Filter3x3Row<false, SSEVector>(above, row, below, dst, count);
+}
+
+// ----------- AVX2 -----------
+
+// 8 pixels (in the 32 bit lanes) scaled as Scale16To8Pixel, in the 32 bit lanes
+static inline __m256i Scale8AVX2(__m256i values, __m256 scale, __m256 offset) {
+	__m256 scaled = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(values), scale), offset);
+	scaled = _mm256_min_ps(_mm256_max_ps(scaled, _mm256_setzero_ps()), _mm256_set1_ps(255.0f));
+	return _mm256_cvtps_epi32(scaled);
+}
+
+static void Scale16To8AVX2(const UINT16 *src, UINT8 *dst, float scale, float offset, int count) {
+	const __m256 vscale = _mm256_set1_ps(scale);
+	const __m256 voffset = _mm256_set1_ps(offset);
+	// The packs work per 128 bit lane, which leaves the 4 byte groups of a, b, c and d interleaved
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	int x = 0;
+	for (; x + 32 <= count; x += 32) {
+		__m256i a = Scale8AVX2(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + x))), vscale, voffset);
+		__m256i b = Scale8AVX2(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + x + 8))), vscale, voffset);
+		__m256i c = Scale8AVX2(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + x + 16))), vscale, voffset);
+		__m256i d = Scale8AVX2(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + x + 24))), vscale, voffset);
+		__m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+		_mm256_storeu_si256((__m256i*)(dst + x), _mm256_permutevar8x32_epi32(packed, order));
+	}
+	_mm256_zeroupper();
+	Scale16To8SSE41(src + x, dst + x, scale, offset, count - x);
+}
+
+static void Colorize3AVX2(const UINT8 *src, UINT8 *dst, const UINT32 *table, int count) {
+	// Gather 8 table entries at a time and drop their 4th bytes: 8 BGR pixels in the low 12 bytes of each lane
+	const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	int x = 0;
+	// The 16 byte stores write 4 bytes past the 12 of the last 4 pixels, that stay within the run up to count - 2
+	for (; x + 8 + 2 <= count; x += 8) {
+		__m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + x)));
+		__m256i bgr = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int*)table, index, 4), pack);
+		_mm_storeu_si128((__m128i*)(dst + 3 * x), _mm256_castsi256_si128(bgr));
+		_mm_storeu_si128((__m128i*)(dst + 3 * x + 12), _mm256_extracti128_si256(bgr, 1));
+	}
+	_mm256_zeroupper();
+	Colorize3Scalar(src + x, dst + 3 * x, table, count - x);
+}
+
+static void EncodeHolo16AVX2(const UINT8 *src, UINT8 *dst, const UINT16 *table, int count) {
+	// 4 byte gathers at table + 2 * value: the low 2 bytes are the entry (the table has one entry of padding)
+	const __m256i low16 = _mm256_set1_epi32(0xffff);
+	int x = 0;
+	for (; x + 16 <= count; x += 16) {
+		__m128i values = _mm_loadu_si128((const __m128i*)(src + x));
+		__m256i a = _mm256_and_si256(_mm256_i32gather_epi32((const int*)table, _mm256_cvtepu8_epi32(values), 2), low16);
+		__m256i b = _mm256_and_si256(_mm256_i32gather_epi32((const int*)table, _mm256_cvtepu8_epi32(_mm_srli_si128(values, 8)), 2), low16);
+		// packus works per 128 bit lane: a0-3 b0-3 a4-7 b4-7, put the quarters back in order
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+		_mm256_storeu_si256((__m256i*)(dst + 2 * x), packed);
+	}
+	_mm256_zeroupper();
+	EncodeHolo16Scalar(src + x, dst + 2 * x, table, count - x);
+}
+
+/*
+The rounded means of the 2x2 blocks of 32 bytes of row0 and row1, in the 16 bit lanes
+(maddubs with 1 adds the horizontal pairs)
+*/
+static inline __m256i Box2Mean16(const UINT8 *row0, const UINT8 *row1) {
+	const __m256i ones = _mm256_set1_epi8(1);
+	__m256i sum0 = _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)row0), ones);
+	__m256i sum1 = _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)row1), ones);
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(sum0, sum1), _mm256_set1_epi16(2)), 2);
+}
+
+/*
+16 table entries (the 16 bit values of indices) to dst, with 4 byte gathers at table + 2 * index as in EncodeHolo16AVX2
+*/
+static inline void EncodeHolo16Block16(__m256i indices, UINT8 *dst, const UINT16 *table) {
+	const __m256i low16 = _mm256_set1_epi32(0xffff);
+	__m256i a = _mm256_and_si256(_mm256_i32gather_epi32((const int*)table, _mm256_cvtepu16_epi32(_mm256_castsi256_si128(indices)), 2), low16);
+	__m256i b = _mm256_and_si256(_mm256_i32gather_epi32((const int*)table, _mm256_cvtepu16_epi32(_mm256_extracti128_si256(indices, 1)), 2), low16);
+	_mm256_storeu_si256((__m256i*)dst, _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+static void EncodeHolo16Nearest2AVX2(const UINT8 *row0, const UINT8 *row1, UINT8 *dst, const UINT16 *table, int count) {
+	// The even pixels are the low bytes of the 16 bit lanes
+	const __m256i evenBytes = _mm256_set1_epi16(0x00ff);
+	int x = 0;
+	for (; x + 16 <= count; x += 16) {
+		__m256i pixels = _mm256_loadu_si256((const __m256i*)(row0 + 2 * x));
+		EncodeHolo16Block16(_mm256_and_si256(pixels, evenBytes), dst + 2 * x, table);
+	}
+	_mm256_zeroupper();
+	EncodeHolo16Nearest2Scalar(row0 + 2 * x, row1 + 2 * x, dst + 2 * x, table, count - x);
+}
+
+static void EncodeHolo16Box2AVX2(const UINT8 *row0, const UINT8 *row1, UINT8 *dst, const UINT16 *table, int count) {
+	int x = 0;
+	for (; x + 16 <= count; x += 16) {
+		EncodeHolo16Block16(Box2Mean16(row0 + 2 * x, row1 + 2 * x), dst + 2 * x, table);
+	}
+	_mm256_zeroupper();
+	EncodeHolo16Box2Scalar(row0 + 2 * x, row1 + 2 * x, dst + 2 * x, table, count - x);
+}
+
+static void Downsample2NearestAVX2(const UINT8 *row0, const UINT8 *row1, UINT8 *dst, int count) {
+	const __m256i evenBytes = _mm256_set1_epi16(0x00ff);
+	int x = 0;
+	for (; x + 32 <= count; x += 32) {
+		__m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(row0 + 2 * x)), evenBytes);
+		__m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(row0 + 2 * x + 32)), evenBytes);
+		// packus works per 128 bit lane, as in EncodeHolo16AVX2
+		_mm256_storeu_si256((__m256i*)(dst + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), _MM_SHUFFLE(3, 1, 2, 0)));
+	}
+	_mm256_zeroupper();
+	Downsample2NearestScalar(row0 + 2 * x, row1 + 2 * x, dst + x, count - x);
+}
+
+static void Downsample2BoxAVX2(const UINT8 *row0, const UINT8 *row1, UINT8 *dst, int count) {
+	int x = 0;
+	for (; x + 32 <= count; x += 32) {
+		__m256i a = Box2Mean16(row0 + 2 * x, row1 + 2 * x);
+		__m256i b = Box2Mean16(row0 + 2 * x + 32, row1 + 2 * x + 32);
+		_mm256_storeu_si256((__m256i*)(dst + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), _MM_SHUFFLE(3, 1, 2, 0)));
+	}
+	_mm256_zeroupper();
+	Downsample2BoxScalar(row0 + 2 * x, row1 + 2 * x, dst + x, count - x);
+}
+
+static UINT64 Sum8AVX2(const UINT8 *src, int count) {
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i sums = _mm256_setzero_si256();
+	int i = 0;
+	for (; i + 32 <= count; i += 32) {
+		sums = _mm256_add_epi64(sums, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(src + i)), zero));
+	}
+	__m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+	_mm256_zeroupper();
+	UINT64 sum = (UINT64)_mm_cvtsi128_si64(half) + (UINT64)_mm_extract_epi64(half, 1);
+	return sum + Sum8SSE41(src + i, count - i);
+}
+
+struct AVX2Vector {
+	typedef __m256i V;
+	enum { N = 32 };
+	static inline V Load(const UINT8 *p) { return _mm256_loadu_si256((const __m256i*)p); }
+	static inline void Store(UINT8 *p, V v) { _mm256_storeu_si256((__m256i*)p, v); }
+};
+
+static void Median3x3AVX2(const UINT8 *above, const UINT8 *row, const UINT8 *below, UINT8 *dst, int count) {
+	Filter3x3Row<true, AVX2Vector>(above, row, below, dst, count);
+	_mm256_zeroupper();
+}
+
+static void ClampSpeckle3x3AVX2(const UINT8 *above, const UINT8 *row, const UINT8 *below, UINT8 *dst, int count) {
+	Filter3x3Row<false, AVX2Vector>(above, row, below, dst, count);
+	_mm256_zeroupper();
+}
+
+// ----------- AVX-512 -----------
+
+#ifdef PIXEL_KERNELS_AVX512
+static void Scale16To8AVX512(const UINT16 *src, UINT8 *dst, float scale, float offset, int count) {
+	const __m512 vscale = _mm512_set1_ps(scale);
+	const __m512 voffset = _mm512_set1_ps(offset);
+	const __m512 zero = _mm512_setzero_ps();
+	const __m512 max = _mm512_set1_ps(255.0f);
+	int x = 0;
+	for (; x + 16 <= count; x += 16) {
+		__m512 scaled = _mm512_add_ps(_mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(src + x)))), vscale), voffset);
+		scaled = _mm512_min_ps(_mm512_max_ps(scaled, zero), max);
+		// The values are in [0, 255] already, vpmovdb only has to drop the upper bytes
+		_mm_storeu_si128((__m128i*)(dst + x), _mm512_cvtepi32_epi8(_mm512_cvtps_epi32(scaled)));
+	}
+	_mm256_zeroupper();
+	Scale16To8AVX2(src + x, dst + x, scale, offset, count - x);
+}
+
+static void Downsample2NearestAVX512(const UINT8 *row0, const UINT8 *row1, UINT8 *dst, int count) {
+	// vpmovwb keeps the low byte of every 16 bit lane: the even pixels
+	int x = 0;
+	for (; x + 32 <= count; x += 32) {
+		_mm256_storeu_si256((__m256i*)(dst + x), _mm512_cvtepi16_epi8(_mm512_loadu_si512((const void*)(row0 + 2 * x))));
+	}
+	_mm256_zeroupper();
+	Downsample2NearestAVX2(row0 + 2 * x, row1 + 2 * x, dst + x, count - x);
+}
+
+static void Downsample2BoxAVX512(const UINT8 *row0, const UINT8 *row1, UINT8 *dst, int count) {
+	const __m512i ones = _mm512_set1_epi8(1);
+	const __m512i two = _mm512_set1_epi16(2);
+	int x = 0;
+	for (; x + 32 <= count; x += 32) {
+		__m512i sum0 = _mm512_maddubs_epi16(_mm512_loadu_si512((const void*)(row0 + 2 * x)), ones);
+		__m512i sum1 = _mm512_maddubs_epi16(_mm512_loadu_si512((const void*)(row1 + 2 * x)), ones);
+		__m512i mean = _mm512_srli_epi16(_mm512_add_epi16(_mm512_add_epi16(sum0, sum1), two), 2);
+		_mm256_storeu_si256((__m256i*)(dst + x), _mm512_cvtepi16_epi8(mean));
+	}
+	_mm256_zeroupper();
+	Downsample2BoxAVX2(row0 + 2 * x, row1 + 2 * x, dst + x, count - x);
+}
+
+static UINT64 Sum8AVX512(const UINT8 *src, int count) {
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i sums = _mm512_setzero_si512();
+	int i = 0;
+	for (; i + 64 <= count; i += 64) {
+		sums = _mm512_add_epi64(sums, _mm512_sad_epu8(_mm512_loadu_si512((const void*)(src + i)), zero));
+	}
+	__m256i quarter = _mm256_add_epi64(_mm512_castsi512_si256(sums), _mm512_extracti64x4_epi64(sums, 1));
+	__m128i half = _mm_add_epi64(_mm256_castsi256_si128(quarter), _mm256_extracti128_si256(quarter, 1));
+	_mm256_zeroupper();
+	UINT64 sum = (UINT64)_mm_cvtsi128_si64(half) + (UINT64)_mm_extract_epi64(half, 1);
+	return sum + Sum8AVX2(src + i, count - i);
+}
+
+struct AVX512Vector {
+	typedef __m512i V;
+	enum { N = 64 };
+	static inline V Load(const UINT8 *p) { return _mm512_loadu_si512((const void*)p); }
+	static inline void Store(UINT8 *p, V v) { _mm512_storeu_si512((void*)p, v); }
+};
+
+static void Median3x3AVX512(const UINT8 *above, const UINT8 *row, const UINT8 *below, UINT8 *dst, int count) {
+	Filter3x3Row<true, AVX512Vector>(above, row, below, dst, count);
+	_mm256_zeroupper();
+}
+
+static void ClampSpeckle3x3AVX512(const UINT8 *above, const UINT8 *row, const UINT8 *below, UINT8 *dst, int count) {
+	Filter3x3Row<false, AVX512Vector>(above, row, below, dst, count);
+	_mm256_zeroupper();
+}
+#endif
+
+// ----------- PixelKernelTable -----------
+
+PixelKernelTable PixelKernelTable::ForLevel(SimdLevel level) {
+	PixelKernelTable kernels;
+	kernels.level = level;
+	kernels.scale16To8 = Scale16To8Scalar;
+	kernels.colorize3 = Colorize3Scalar;
+	kernels.median3x3 = Median3x3Scalar;
+	kernels.clampSpeckle3x3 = ClampSpeckle3x3Scalar;
+
+	kernels.encodeHolo16 = EncodeHolo16Scalar;
+	kernels.encodeHolo16Nearest2 = EncodeHolo16Nearest2Scalar;
+	kernels.encodeHolo16Box2 = EncodeHolo16Box2Scalar;
+	kernels.downsample2Nearest = Downsample2NearestScalar;
+	kernels.downsample2Box = Downsample2BoxScalar;
+	kernels.sum8 = Sum8Scalar;
+
+	// The colormap and the HoloLens encoding are table lookups, they need the gathers of AVX2 (the AVX-512 gathers are not faster)
+	if (level >= SIMD_SSE41) {
+		kernels.scale16To8 = Scale16To8SSE41;
+		kernels.downsample2Nearest = Downsample2NearestSSE41;
+		kernels.downsample2Box = Downsample2BoxSSE41;
+		kernels.sum8 = Sum8SSE41;
+		kernels.median3x3 = Median3x3SSE41;
+		kernels.clampSpeckle3x3 = ClampSpeckle3x3SSE41;
+	}
+	if (level >= SIMD_AVX2) {
+		kernels.scale16To8 = Scale16To8AVX2;
+		kernels.colorize3 = Colorize3AVX2;
+		kernels.encodeHolo16 = EncodeHolo16AVX2;
+		kernels.encodeHolo16Nearest2 = EncodeHolo16Nearest2AVX2;
+		kernels.encodeHolo16Box2 = EncodeHolo16Box2AVX2;
+		kernels.downsample2Nearest = Downsample2NearestAVX2;
+		kernels.downsample2Box = Downsample2BoxAVX2;
+		kernels.sum8 = Sum8AVX2;
+		kernels.median3x3 = Median3x3AVX2;
+		kernels.clampSpeckle3x3 = ClampSpeckle3x3AVX2;
+	}
+#ifdef PIXEL_KERNELS_AVX512
+	if (level >= SIMD_AVX512) {
+		kernels.scale16To8 = Scale16To8AVX512;
+		kernels.downsample2Nearest = Downsample2NearestAVX512;
+		kernels.downsample2Box = Downsample2BoxAVX512;
+		kernels.sum8 = Sum8AVX512;
+		kernels.median3x3 = Median3x3AVX512;
+		kernels.clampSpeckle3x3 = ClampSpeckle3x3AVX512;
+	}
+#else
+	if (level >= SIMD_AVX512) {
+		kernels.level = SIMD_AVX2;
+	}
+#endif
+	return kernels;
+}
+
+const PixelKernelTable &PixelKernelTable::Selected() {
+	static PixelKernelTable kernels = ForLevel(CpuDispatch::Level());
+	return kernels;
+}
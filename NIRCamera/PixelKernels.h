@@ -0,0 +1,372 @@
+#pragma once
+
+#include <Windows.h>
+#include "spdlog/spdlog.h"
+
+#include "CpuDispatch.h"
+#include "HoloColorTable.h"
+
+#include <malloc.h>
+#include <cstring>
+
+using namespace std;
+
+// Instantiate a kernel with this width to get the version that takes the width at runtime
+#define PIXEL_KERNEL_GENERIC 0
+
+/*
+The inner loops of the pixel kernels, one run of count contiguous pixels, in one version per SIMD level.
+A level that has no version of its own for a kernel uses the one of the next lower level.
+*/
+class PixelKernelTable {
+public:
+	SimdLevel level;
+
+	// 16 bit pixels to 8 bit, dst = saturate(round(src * scale + offset)) (as GpuMat::convertTo to CV_8UC1)
+	void (*scale16To8)(const UINT16 *src, UINT8 *dst, float scale, float offset, int count);
+
+	// 8 bit pixels to 3 byte (BGR) pixels through a 256 entry table, dst = first 3 bytes of table[src]
+	void (*colorize3)(const UINT8 *src, UINT8 *dst, const UINT32 *table, int count);
+
+	// 8 bit pixels to the 2 bytes per pixel sent to the HoloLens, dst = table[src] (GB | AR << 8).
+	// table has 257 entries (a row of the HoloColorTable), the last one is only read, not used
+	void (*encodeHolo16)(const UINT8 *src, UINT8 *dst, const UINT16 *table, int count);
+
+	// encodeHolo16 of a row downsampled by 2: count output pixels from 2 * count pixels of row0 (nearest)
+	// or of row0 and row1 (2x2 box average, rounded)
+	void (*encodeHolo16Nearest2)(const UINT8 *row0, const UINT8 *row1, UINT8 *dst, const UINT16 *table, int count);
+	void (*encodeHolo16Box2)(const UINT8 *row0, const UINT8 *row1, UINT8 *dst, const UINT16 *table, int count);
+
+	// The same downsampling without the encoding, to 8 bit pixels
+	void (*downsample2Nearest)(const UINT8 *row0, const UINT8 *row1, UINT8 *dst, int count);
+	void (*downsample2Box)(const UINT8 *row0, const UINT8 *row1, UINT8 *dst, int count);
+
+	// Sum of 8 bit pixels (the saturation detection)
+	UINT64 (*sum8)(const UINT8 *src, int count);
+
+	// 3x3 filters of one row of 8 bit pixels, above and below are the neighbouring rows. The first and the last pixel are copied
+	void (*median3x3)(const UINT8 *above, const UINT8 *row, const UINT8 *below, UINT8 *dst, int count);
+	// Clamp every pixel to the range of its 8 neighbours
+	void (*clampSpeckle3x3)(const UINT8 *above, const UINT8 *row, const UINT8 *below, UINT8 *dst, int count);
+
+	// The versions for level
+	static PixelKernelTable ForLevel(SimdLevel level);
+
+	// The versions for CpuDispatch::Level()
+	static const PixelKernelTable &Selected();
+};
+
+/*
+The per-pixel loops of the pipeline. Every kernel works on the rows [firstRow, lastRow) of a frame (so that it can
+be run in row bands by the ThreadPool) and is templated on the frame width and on the pixel format:
+- WIDTH > 0: the width is a compile-time constant and the rows have no padding (stride = width * bytes per pixel),
+  so the whole band is one run of the SIMD loop, without a partial vector at the end of every row.
+- WIDTH = PIXEL_KERNEL_GENERIC: the width argument and the strides are used, for ROIs and other frame sizes.
+The caller picks the instantiation, e.g.
+	if (width == IMAGE_WIDTH && continuous) Kernel<IMAGE_WIDTH>(...); else Kernel<PIXEL_KERNEL_GENERIC>(...);
+The SIMD level comes from the PixelKernelTable (CpuDispatch::Level() by default).
+All the frame buffers of the FramePool are FRAME_ALIGNMENT aligned, so the first row always is.
+The buffers of one call must not overlap.
+*/
+
+/*
+Raw FPGA data to 16 bit pixels. The rows of src and dst are contiguous, so every band is one run.
+The FPGA sends the low byte first, which is the byte order of the PC (x86): the unpacking is a copy,
+memcpy is as fast as it gets on every SIMD level, so it is not in the PixelKernelTable.
+*/
+template<int WIDTH>
+inline void UnpackLE16Rows(const UINT8 *src, UINT16 *dst, int width, int firstRow, int lastRow) {
+	const int w = WIDTH > 0 ? WIDTH : width;
+	memcpy(dst + (size_t)firstRow * w, src + (size_t)firstRow * w * 2, (size_t)(lastRow - firstRow) * w * 2);
+}
+
+/*
+16 bit pixels to 8 bit, dst = saturate(round(src * scale + offset)). srcStride and dstStride are in bytes.
+*/
+template<int WIDTH>
+inline void Scale16To8Rows(const UINT16 *src, size_t srcStride, UINT8 *dst, size_t dstStride, float scale, float offset,
+	int width, int firstRow, int lastRow, const PixelKernelTable &kernels = PixelKernelTable::Selected()) {
+	if (WIDTH > 0) {
+		kernels.scale16To8(src + (size_t)firstRow * WIDTH, dst + (size_t)firstRow * WIDTH, scale, offset, WIDTH * (lastRow - firstRow));
+		return;
+	}
+	for (int row = firstRow; row < lastRow; row++) {
+		kernels.scale16To8((const UINT16*)((const UINT8*)src + row * srcStride), dst + row * dstStride, scale, offset, width);
+	}
+}
+
+/*
+8 bit pixels to BGR through a 256 entry colormap table (see ColorTable). The rows of a WIDTH instantiation
+are contiguous, so every band is one run.
+*/
+template<int WIDTH>
+inline void ColorizeRows(const UINT8 *src, size_t srcStride, UINT8 *dst, size_t dstStride, const UINT32 *table,
+	int width, int firstRow, int lastRow, const PixelKernelTable &kernels = PixelKernelTable::Selected()) {
+	if (WIDTH > 0) {
+		kernels.colorize3(src + (size_t)firstRow * WIDTH, dst + (size_t)firstRow * WIDTH * 3, table, WIDTH * (lastRow - firstRow));
+		return;
+	}
+	for (int row = firstRow; row < lastRow; row++) {
+		kernels.colorize3(src + row * srcStride, dst + row * dstStride, table, width);
+	}
+}
+
+/*
+8 bit pixels to the 2 bytes per pixel (GB, AR) sent to the HoloLens through a row of the HoloColorTable
+(table[value] = GB | AR << 8)
+*/
+template<int WIDTH>
+inline void EncodeHolo16Rows(const UINT8 *src, size_t srcStride, UINT8 *dst, size_t dstStride, const UINT16 *table,
+	int width, int firstRow, int lastRow, const PixelKernelTable &kernels = PixelKernelTable::Selected()) {
+	if (WIDTH > 0) {
+		kernels.encodeHolo16(src + (size_t)firstRow * WIDTH, dst + (size_t)firstRow * WIDTH * 2, table, WIDTH * (lastRow - firstRow));
+		return;
+	}
+	for (int row = firstRow; row < lastRow; row++) {
+		kernels.encodeHolo16(src + row * srcStride, dst + row * dstStride, table, width);
+	}
+}
+
+/*
+Downsample by 2 and encode for the HoloLens in one pass, straight from the full size 8 bit image.
+[firstRow, lastRow) and width are rows and width of the output, WIDTH is the width of the output too.
+box: average every 2x2 block instead of taking its top left pixel (as INTER_NEAREST does).
+*/
+template<int WIDTH>
+inline void EncodeHolo16Down2Rows(const UINT8 *src, size_t srcStride, UINT8 *dst, size_t dstStride, const UINT16 *table,
+	int width, int firstRow, int lastRow, bool box, const PixelKernelTable &kernels = PixelKernelTable::Selected()) {
+	void (*encode)(const UINT8*, const UINT8*, UINT8*, const UINT16*, int) = box ? kernels.encodeHolo16Box2 : kernels.encodeHolo16Nearest2;
+	const int w = WIDTH > 0 ? WIDTH : width;
+	if (WIDTH > 0) {
+		srcStride = 2 * WIDTH;
+		dstStride = 2 * WIDTH;
+	}
+	for (int row = firstRow; row < lastRow; row++) {
+		const UINT8 *row0 = src + 2 * row * srcStride;
+		encode(row0, row0 + srcStride, dst + row * dstStride, table, w);
+	}
+}
+
+/*
+Downsample an 8 bit image by 2 (as EncodeHolo16Down2Rows, without the encoding)
+*/
+template<int WIDTH>
+inline void Downsample2Rows(const UINT8 *src, size_t srcStride, UINT8 *dst, size_t dstStride,
+	int width, int firstRow, int lastRow, bool box, const PixelKernelTable &kernels = PixelKernelTable::Selected()) {
+	void (*downsample)(const UINT8*, const UINT8*, UINT8*, int) = box ? kernels.downsample2Box : kernels.downsample2Nearest;
+	const int w = WIDTH > 0 ? WIDTH : width;
+	if (WIDTH > 0) {
+		srcStride = 2 * WIDTH;
+		dstStride = WIDTH;
+	}
+	for (int row = firstRow; row < lastRow; row++) {
+		const UINT8 *row0 = src + 2 * row * srcStride;
+		downsample(row0, row0 + srcStride, dst + row * dstStride, w);
+	}
+}
+
+/*
+Sum of the 8 bit pixels of the rows [firstRow, lastRow)
+*/
+template<int WIDTH>
+inline UINT64 SumRows(const UINT8 *src, size_t srcStride, int width, int firstRow, int lastRow,
+	const PixelKernelTable &kernels = PixelKernelTable::Selected()) {
+	if (WIDTH > 0) {
+		return kernels.sum8(src + (size_t)firstRow * WIDTH, WIDTH * (lastRow - firstRow));
+	}
+	UINT64 sum = 0;
+	for (int row = firstRow; row < lastRow; row++) {
+		sum += kernels.sum8(src + row * srcStride, width);
+	}
+	return sum;
+}
+
+/*
+A 3x3 filter (PixelKernelTable::median3x3 or clampSpeckle3x3) over the rows [firstRow, lastRow) of a frame
+that is height rows high. A band reads one row above and below itself, the first and the last row of the frame
+are copied. src and dst must be different frames.
+*/
+template<int WIDTH>
+inline void Filter3x3Rows(void (*filter)(const UINT8*, const UINT8*, const UINT8*, UINT8*, int),
+	const UINT8 *src, size_t srcStride, UINT8 *dst, size_t dstStride, int width, int height, int firstRow, int lastRow) {
+	const int w = WIDTH > 0 ? WIDTH : width;
+	if (WIDTH > 0) {
+		srcStride = WIDTH;
+		dstStride = WIDTH;
+	}
+	for (int row = firstRow; row < lastRow; row++) {
+		const UINT8 *line = src + row * srcStride;
+		if (row == 0 || row == height - 1) {
+			memcpy(dst + row * dstStride, line, w);
+			continue;
+		}
+		filter(line - srcStride, line, line + srcStride, dst + row * dstStride, w);
+	}
+}
+
+/*
+3x3 median: removes hot pixels and speckles up to 2x2 pixels, rounds corners
+*/
+template<int WIDTH>
+inline void Median3x3Rows(const UINT8 *src, size_t srcStride, UINT8 *dst, size_t dstStride, int width, int height,
+	int firstRow, int lastRow, const PixelKernelTable &kernels = PixelKernelTable::Selected()) {
+	Filter3x3Rows<WIDTH>(kernels.median3x3, src, srcStride, dst, dstStride, width, height, firstRow, lastRow);
+}
+
+/*
+Clamp to the range of the 8 neighbours: removes single hot/dead pixels only, edges and corners stay as they are
+*/
+template<int WIDTH>
+inline void ClampSpeckle3x3Rows(const UINT8 *src, size_t srcStride, UINT8 *dst, size_t dstStride, int width, int height,
+	int firstRow, int lastRow, const PixelKernelTable &kernels = PixelKernelTable::Selected()) {
+	Filter3x3Rows<WIDTH>(kernels.clampSpeckle3x3, src, srcStride, dst, dstStride, width, height, firstRow, lastRow);
+}
+
+/*
+Time the kernels on a WIDTH x height frame (single thread, iterations frames each) for every SIMD level
+this CPU supports, the WIDTH instantiation and the generic one, and print the result.
+Started by "NIRCamera --benchmark".
+*/
+template<int WIDTH>
+void BenchmarkPixelKernels(int height, int iterations) {
+	std::shared_ptr<spdlog::logger> logger = spdlog::stdout_color_mt("Benchmark");
+
+	size_t pixels = (size_t)WIDTH * height;
+	UINT8 *raw = (UINT8*)_aligned_malloc(pixels * 2, 64);
+	UINT16 *gray16 = (UINT16*)_aligned_malloc(pixels * 2, 64);
+	UINT8 *gray8 = (UINT8*)_aligned_malloc(pixels, 64);
+	UINT8 *bgr = (UINT8*)_aligned_malloc(pixels * 3, 64);
+	UINT8 *holo = (UINT8*)_aligned_malloc(pixels * 2, 64);
+	UINT8 *filtered = (UINT8*)_aligned_malloc(pixels, 64);
+	const UINT16 *table = HoloColorTable::Shared().ForAlpha(HOLO_ALPHA_LEVELS - 1);
+	UINT32 colors[256];
+
+	// Raw frames with values all over the 16 bit range, and a thresholded image: round blobs on a black background
+	for (size_t i = 0; i < pixels * 2; i++) {
+		raw[i] = (UINT8)(i * 7 + (i >> 9));
+	}
+	UnpackLE16Rows<WIDTH>(raw, gray16, WIDTH, 0, height);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < WIDTH; x++) {
+			int dx = x % 128 - 64;
+			int dy = y % 128 - 64;
+			gray8[y * WIDTH + x] = dx * dx + dy * dy < 40 * 40 ? (UINT8)(255 - dx * dx / 16) : 0;
+		}
+	}
+	for (int i = 0; i < 256; i++) {
+		colors[i] = i == 0 ? 0 : (UINT32)(i * 0x010203);
+	}
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	double ticksToUs = 1000000.0 / frequency.QuadPart / iterations;
+
+	logger->info("{0}x{1}, {2} frames per kernel, us per frame (fixed width / generic)", WIDTH, height, iterations);
+	for (int l = SIMD_SCALAR; l <= CpuDispatch::Detect(); l++) {
+		PixelKernelTable kernels = PixelKernelTable::ForLevel((SimdLevel)l);
+		volatile UINT64 sum = 0;
+
+		// [kernel][0: fixed, 1: generic]
+		double us[7][2];
+		for (int variant = 0; variant < 2; variant++) {
+			bool fixed = variant == 0;
+			LARGE_INTEGER begin, end;
+
+			QueryPerformanceCounter(&begin);
+			for (int i = 0; i < iterations; i++) {
+				if (fixed) {
+					Scale16To8Rows<WIDTH>(gray16, WIDTH * 2, filtered, WIDTH, 24.0f / 256.0f, 0.0f, WIDTH, 0, height, kernels);
+				}
+				else {
+					Scale16To8Rows<PIXEL_KERNEL_GENERIC>(gray16, WIDTH * 2, filtered, WIDTH, 24.0f / 256.0f, 0.0f, WIDTH, 0, height, kernels);
+				}
+			}
+			QueryPerformanceCounter(&end);
+			us[0][variant] = (end.QuadPart - begin.QuadPart) * ticksToUs;
+
+			QueryPerformanceCounter(&begin);
+			for (int i = 0; i < iterations; i++) {
+				if (fixed) {
+					ColorizeRows<WIDTH>(gray8, WIDTH, bgr, WIDTH * 3, colors, WIDTH, 0, height, kernels);
+				}
+				else {
+					ColorizeRows<PIXEL_KERNEL_GENERIC>(gray8, WIDTH, bgr, WIDTH * 3, colors, WIDTH, 0, height, kernels);
+				}
+			}
+			QueryPerformanceCounter(&end);
+			us[1][variant] = (end.QuadPart - begin.QuadPart) * ticksToUs;
+
+			QueryPerformanceCounter(&begin);
+			for (int i = 0; i < iterations; i++) {
+				if (fixed) {
+					Downsample2Rows<WIDTH / 2>(gray8, WIDTH, filtered, WIDTH / 2, WIDTH / 2, 0, height / 2, true, kernels);
+				}
+				else {
+					Downsample2Rows<PIXEL_KERNEL_GENERIC>(gray8, WIDTH, filtered, WIDTH / 2, WIDTH / 2, 0, height / 2, true, kernels);
+				}
+			}
+			QueryPerformanceCounter(&end);
+			us[2][variant] = (end.QuadPart - begin.QuadPart) * ticksToUs;
+
+			QueryPerformanceCounter(&begin);
+			for (int i = 0; i < iterations; i++) {
+				if (fixed) {
+					EncodeHolo16Down2Rows<WIDTH / 2>(gray8, WIDTH, holo, WIDTH, table, WIDTH / 2, 0, height / 2, true, kernels);
+				}
+				else {
+					EncodeHolo16Down2Rows<PIXEL_KERNEL_GENERIC>(gray8, WIDTH, holo, WIDTH, table, WIDTH / 2, 0, height / 2, true, kernels);
+				}
+			}
+			QueryPerformanceCounter(&end);
+			us[3][variant] = (end.QuadPart - begin.QuadPart) * ticksToUs;
+
+			QueryPerformanceCounter(&begin);
+			for (int i = 0; i < iterations; i++) {
+				if (fixed) {
+					sum = sum + SumRows<WIDTH>(gray8, WIDTH, WIDTH, 0, height, kernels);
+				}
+				else {
+					sum = sum + SumRows<PIXEL_KERNEL_GENERIC>(gray8, WIDTH, WIDTH, 0, height, kernels);
+				}
+			}
+			QueryPerformanceCounter(&end);
+			us[4][variant] = (end.QuadPart - begin.QuadPart) * ticksToUs;
+
+			QueryPerformanceCounter(&begin);
+			for (int i = 0; i < iterations; i++) {
+				if (fixed) {
+					Median3x3Rows<WIDTH>(gray8, WIDTH, filtered, WIDTH, WIDTH, height, 0, height, kernels);
+				}
+				else {
+					Median3x3Rows<PIXEL_KERNEL_GENERIC>(gray8, WIDTH, filtered, WIDTH, WIDTH, height, 0, height, kernels);
+				}
+			}
+			QueryPerformanceCounter(&end);
+			us[5][variant] = (end.QuadPart - begin.QuadPart) * ticksToUs;
+
+			QueryPerformanceCounter(&begin);
+			for (int i = 0; i < iterations; i++) {
+				if (fixed) {
+					ClampSpeckle3x3Rows<WIDTH>(gray8, WIDTH, filtered, WIDTH, WIDTH, height, 0, height, kernels);
+				}
+				else {
+					ClampSpeckle3x3Rows<PIXEL_KERNEL_GENERIC>(gray8, WIDTH, filtered, WIDTH, WIDTH, height, 0, height, kernels);
+				}
+			}
+			QueryPerformanceCounter(&end);
+			us[6][variant] = (end.QuadPart - begin.QuadPart) * ticksToUs;
+		}
+
+		logger->info("{0:<7} scale {1:>7.1f} / {2:>7.1f}, colorize {3:>7.1f} / {4:>7.1f}, downsample {5:>7.1f} / {6:>7.1f}, "
+			"encode {7:>7.1f} / {8:>7.1f}, sum {9:>7.1f} / {10:>7.1f}, median {11:>7.1f} / {12:>7.1f}, clamp {13:>7.1f} / {14:>7.1f}",
+			CpuDispatch::Name(kernels.level), us[0][0], us[0][1], us[1][0], us[1][1], us[2][0], us[2][1],
+			us[3][0], us[3][1], us[4][0], us[4][1], us[5][0], us[5][1], us[6][0], us[6][1]);
+	}
+
+	_aligned_free(raw);
+	_aligned_free(gray16);
+	_aligned_free(gray8);
+	_aligned_free(bgr);
+	_aligned_free(holo);
+	_aligned_free(filtered);
+}
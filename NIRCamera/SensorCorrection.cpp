@@ -0,0 +1,272 @@
+#include "SensorCorrection.h"
+#include "ThreadPool.h"
+
+#include <emmintrin.h>		// SSE2
+
+using namespace cv;
+
+// Bits of DefectMask
+#define DEFECT_HOT 0x01			// Found in the dark frame
+#define DEFECT_FLAT 0x02		// Found in the flat field
+
+SensorCorrection::SensorCorrection(int width, int height)
+{
+	Width = width;
+	Height = height;
+	PixelCount = width * height;
+	FileName = "sensorCorrection.xml.gz";
+
+	// Start with an identity correction
+	DarkFrame = Mat::zeros(Height, Width, CV_16UC1);
+	GainMap = Mat(Height, Width, CV_16UC1, Scalar(1 << SENSOR_GAIN_SHIFT));
+	DefectMask = Mat::zeros(Height, Width, CV_8UC1);
+
+	captureMode = SENSOR_CAPTURE_NONE;
+	captureTarget = 0;
+	captureCount = 0;
+
+	_logger = spdlog::stdout_color_mt("SensorCorrection");
+
+	if (!Load()) {
+		_logger->info("No sensor correction file is found. Capture a dark frame and a flat field to create one.");
+	}
+}
+
+SensorCorrection::~SensorCorrection()
+{
+}
+
+void SensorCorrection::BeginCapture(SensorCaptureMode mode, int frameCount) {
+	if (mode == SENSOR_CAPTURE_NONE || frameCount <= 0) {
+		return;
+	}
+
+	captureMode = mode;
+	captureTarget = frameCount;
+	captureCount = 0;
+	captureSum.assign(PixelCount, 0);
+
+	_logger->info("Capturing {0} frames for the {1}...", frameCount, mode == SENSOR_CAPTURE_DARK ? "dark frame" : "flat field");
+}
+
+bool SensorCorrection::IsCapturing() const {
+	return captureMode != SENSOR_CAPTURE_NONE;
+}
+
+void SensorCorrection::Accumulate(const UINT16 *frame) {
+	if (captureMode == SENSOR_CAPTURE_NONE) {
+		return;
+	}
+
+	UINT32 *sum = captureSum.data();
+	for (int i = 0; i < PixelCount; i++) {
+		sum[i] += frame[i];
+	}
+
+	captureCount++;
+	if (captureCount >= captureTarget) {
+		FinishCapture();
+	}
+}
+
+void SensorCorrection::Apply(const UINT16 *src, UINT16 *dst) {
+	// The dark frame and the gain map work on every pixel on its own, so the rows are split over the thread pool
+	ThreadPool::Shared().ParallelRows(Width, Height, [&](int firstRow, int lastRow) {
+		CorrectRange(src, dst, firstRow * Width, lastRow * Width);
+	});
+
+	// Replace the defective pixels (after their neighbours are corrected)
+	for (size_t k = 0; k < Defects.size(); k++) {
+		const DefectPixel &p = Defects[k];
+		dst[p.index] = (UINT16)((dst[p.left] + dst[p.right] + 1) >> 1);
+	}
+}
+
+void SensorCorrection::CorrectRange(const UINT16 *src, UINT16 *dst, int begin, int end) {
+	const UINT16 *dark = DarkFrame.ptr<UINT16>();
+	const UINT16 *gain = GainMap.ptr<UINT16>();
+
+	// corrected = ((raw - dark) * gain) >> SENSOR_GAIN_SHIFT, saturated to 16 bit
+	// The 32 bit product is split in a high and a low half by mulhi/mullo, then shifted back together
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi16(-1);
+	const __m128i maxHigh = _mm_set1_epi16((1 << SENSOR_GAIN_SHIFT) - 1);	// A larger high half overflows 16 bit after the shift
+
+	int i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i*)(dark + i));
+		__m128i g = _mm_loadu_si128((const __m128i*)(gain + i));
+
+		__m128i v = _mm_subs_epu16(x, d);
+		__m128i lo = _mm_mullo_epi16(v, g);
+		__m128i hi = _mm_mulhi_epu16(v, g);
+		__m128i r = _mm_or_si128(_mm_slli_epi16(hi, 16 - SENSOR_GAIN_SHIFT), _mm_srli_epi16(lo, SENSOR_GAIN_SHIFT));
+
+		__m128i inRange = _mm_cmpeq_epi16(_mm_subs_epu16(hi, maxHigh), zero);
+		r = _mm_or_si128(_mm_and_si128(r, inRange), _mm_andnot_si128(inRange, ones));
+
+		_mm_storeu_si128((__m128i*)(dst + i), r);
+	}
+	for (; i < end; i++) {
+		int v = src[i] > dark[i] ? src[i] - dark[i] : 0;
+		UINT32 r = ((UINT32)v * gain[i]) >> SENSOR_GAIN_SHIFT;
+		dst[i] = (UINT16)(r > 0xFFFF ? 0xFFFF : r);
+	}
+}
+
+void SensorCorrection::FinishCapture() {
+	Mat average(Height, Width, CV_16UC1);
+	UINT16 *avg = average.ptr<UINT16>();
+	for (int i = 0; i < PixelCount; i++) {
+		avg[i] = (UINT16)((captureSum[i] + captureCount / 2) / captureCount);
+	}
+
+	UINT8 *mask = DefectMask.ptr<UINT8>();
+
+	if (captureMode == SENSOR_CAPTURE_DARK) {
+		average.copyTo(DarkFrame);
+
+		// Hot pixels stand out of the dark frame
+		Scalar mean, stddev;
+		meanStdDev(DarkFrame, mean, stddev);
+		double hotLevel = mean[0] + SENSOR_HOT_PIXEL_SIGMA * (stddev[0] < 1.0 ? 1.0 : stddev[0]);
+
+		int hotCount = 0;
+		for (int i = 0; i < PixelCount; i++) {
+			if (avg[i] > hotLevel) {
+				mask[i] |= DEFECT_HOT;
+				hotCount++;
+			}
+			else {
+				mask[i] &= ~DEFECT_HOT;
+			}
+		}
+
+		_logger->info("Dark frame captured. Mean level: {0:.1f}, hot pixels: {1}", mean[0], hotCount);
+	}
+	else {
+		// The response of each pixel to the uniform illumination
+		Mat response;
+		subtract(average, DarkFrame, response);		// Saturates at 0
+		double meanResponse = cv::mean(response)[0];
+
+		if (meanResponse < 1.0) {
+			_logger->warn("Flat field capture failed: the image is too dark.");
+		}
+		else {
+			const UINT16 *r = response.ptr<UINT16>();
+			UINT16 *gain = GainMap.ptr<UINT16>();
+			int deadCount = 0;
+			for (int i = 0; i < PixelCount; i++) {
+				double ratio = r[i] / meanResponse;
+				if (ratio < SENSOR_FLAT_RESPONSE_MIN || ratio > SENSOR_FLAT_RESPONSE_MAX) {
+					// Dead or stuck pixel, it is replaced anyway
+					mask[i] |= DEFECT_FLAT;
+					gain[i] = 1 << SENSOR_GAIN_SHIFT;
+					deadCount++;
+				}
+				else {
+					mask[i] &= ~DEFECT_FLAT;
+					double g = (1 << SENSOR_GAIN_SHIFT) / ratio + 0.5;
+					gain[i] = (UINT16)(g > 0xFFFF ? 0xFFFF : g);
+				}
+			}
+
+			_logger->info("Flat field captured. Mean response: {0:.1f}, defective pixels: {1}", meanResponse, deadCount);
+		}
+	}
+
+	captureMode = SENSOR_CAPTURE_NONE;
+	captureSum.clear();
+	captureSum.shrink_to_fit();
+
+	BuildDefectList();
+	Save();
+}
+
+void SensorCorrection::BuildDefectList() {
+	Defects.clear();
+
+	const UINT8 *mask = DefectMask.ptr<UINT8>();
+	for (int y = 0; y < Height; y++) {
+		for (int x = 0; x < Width; x++) {
+			int index = y * Width + x;
+			if (mask[index] == 0) {
+				continue;
+			}
+
+			DefectPixel p;
+			p.index = index;
+			p.left = FindGoodNeighbour(x, y, -1);
+			p.right = FindGoodNeighbour(x, y, 1);
+
+			// If one side has no good pixel, use the other side twice
+			if (p.left < 0) {
+				p.left = p.right;
+			}
+			if (p.right < 0) {
+				p.right = p.left;
+			}
+			if (p.left < 0) {
+				// The whole row is defective, leave it as it is
+				continue;
+			}
+
+			Defects.push_back(p);
+		}
+	}
+}
+
+int SensorCorrection::FindGoodNeighbour(int x, int y, int step) {
+	const UINT8 *mask = DefectMask.ptr<UINT8>(y);
+	for (int nx = x + step; nx >= 0 && nx < Width; nx += step) {
+		if (mask[nx] == 0) {
+			return y * Width + nx;
+		}
+	}
+	return -1;
+}
+
+bool SensorCorrection::Save() {
+	FileStorage file(FileName, FileStorage::WRITE);
+	if (!file.isOpened()) {
+		_logger->warn("Cannot write the sensor correction file {0}", FileName);
+		return false;
+	}
+
+	file << "DarkFrame" << DarkFrame;
+	file << "GainMap" << GainMap;
+	file << "DefectMask" << DefectMask;
+	file.release();
+	return true;
+}
+
+bool SensorCorrection::Load() {
+	FileStorage file;
+	if (!file.open(FileName, FileStorage::READ)) {
+		return false;
+	}
+
+	Mat dark, gain, defects;
+	file["DarkFrame"] >> dark;
+	file["GainMap"] >> gain;
+	file["DefectMask"] >> defects;
+	file.release();
+
+	// Reject maps that do not match the sensor
+	if (dark.rows != Height || dark.cols != Width || dark.type() != CV_16UC1 ||
+		gain.rows != Height || gain.cols != Width || gain.type() != CV_16UC1 ||
+		defects.rows != Height || defects.cols != Width || defects.type() != CV_8UC1) {
+		_logger->warn("The sensor correction file {0} does not match the sensor and is ignored.", FileName);
+		return false;
+	}
+
+	DarkFrame = dark;
+	GainMap = gain;
+	DefectMask = defects;
+	BuildDefectList();
+
+	_logger->info("Sensor correction loaded, {0} defective pixels.", Defects.size());
+	return true;
+}
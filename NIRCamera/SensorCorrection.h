@@ -0,0 +1,104 @@
+#pragma once
+
+#include <Windows.h>
+#include "opencv2/core.hpp"
+#include "spdlog/spdlog.h"
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// The gain map is stored in fixed point, (1 << SENSOR_GAIN_SHIFT) means a gain of 1.0
+#define SENSOR_GAIN_SHIFT 12
+// A pixel of the dark frame is hot when it exceeds the mean by this many standard deviations
+#define SENSOR_HOT_PIXEL_SIGMA 6.0
+// A pixel of the flat field is defective when its response is outside [MIN, MAX] x the mean response
+#define SENSOR_FLAT_RESPONSE_MIN 0.5
+#define SENSOR_FLAT_RESPONSE_MAX 1.5
+
+// What the frames of a running capture are averaged into
+enum SensorCaptureMode {
+	SENSOR_CAPTURE_NONE = 0,
+	SENSOR_CAPTURE_DARK = 1,		// Lens covered: builds the dark frame and the hot pixel map
+	SENSOR_CAPTURE_FLAT = 2,		// Uniform illumination: builds the gain map and the dead pixel map
+};
+
+/*
+SensorCorrection removes the fixed-pattern noise of the sensor from the raw 16 bit frames:
+	corrected = (raw - dark) * gain, then defective pixels are replaced by their horizontal neighbours.
+The dark frame, the gain map and the defect map are built by averaging frames in a capture mode
+and are kept in a file so they survive a restart.
+
+Not thread-safe: every function has to be called from the processing thread.
+*/
+class SensorCorrection
+{
+public:
+	SensorCorrection(int width, int height);
+	~SensorCorrection();
+
+	/*
+	Average the next frameCount frames passed to Accumulate() into a dark frame or a flat field.
+	The maps are rebuilt and saved once the capture completes.
+	*/
+	void BeginCapture(SensorCaptureMode mode, int frameCount);
+
+	bool IsCapturing() const;
+
+	/*
+	Feed a raw (uncorrected) frame into the running capture. Does nothing if no capture is running.
+	*/
+	void Accumulate(const UINT16 *frame);
+
+	/*
+	Apply the dark frame, the gain map and the defect map to src and write the result to dst.
+	src and dst may be the same buffer.
+	*/
+	void Apply(const UINT16 *src, UINT16 *dst);
+
+	/*
+	Save/Load the maps to/from the correction file. Return FALSE if it fails.
+	*/
+	bool Save();
+	bool Load();
+
+private:
+	// A defective pixel and the two pixels whose average replaces it
+	class DefectPixel {
+	public:
+		int index;
+		int left;
+		int right;
+	};
+
+	int Width;
+	int Height;
+	int PixelCount;
+	string FileName;
+
+	cv::Mat DarkFrame;			// CV_16UC1
+	cv::Mat GainMap;			// CV_16UC1, fixed point gain
+	cv::Mat DefectMask;			// CV_8UC1, non-zero for defective pixels
+	vector<DefectPixel> Defects;
+
+	// Capture state
+	SensorCaptureMode captureMode;
+	int captureTarget;
+	int captureCount;
+	vector<UINT32> captureSum;
+
+	std::shared_ptr<spdlog::logger> _logger;
+
+	// Turn the accumulated frames into maps
+	void FinishCapture();
+
+	// Apply the dark frame and the gain map to the pixels [begin, end)
+	void CorrectRange(const UINT16 *src, UINT16 *dst, int begin, int end);
+
+	// Rebuild the Defects list from DefectMask
+	void BuildDefectList();
+
+	// Find the closest good pixel in the same row, searching in direction step (-1 or 1)
+	int FindGoodNeighbour(int x, int y, int step);
+};
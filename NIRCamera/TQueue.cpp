@@ -37,6 +37,14 @@ TQueue<T>::~TQueue(){
 	delete[] cell_array;
 	cell_array = NULL;
 
+	// Delete the recycled cells (their data is cleaned already)
+	Cell *free_cell = free_cells.exchange(NULL);
+	while (free_cell != NULL){
+		Cell *next_cell = free_cell->next;
+		delete free_cell;
+		free_cell = next_cell;
+	}
+
 	T_delete_fun = NULL;
 }
 
@@ -67,6 +75,8 @@ void TQueue<T>::general_constructor(int cap, void(*delete_fun)(T)){
 		cell_array[i] = NULL; 
 	}
 
+	free_cells = NULL;
+
 	global_timeStamp = 0;	// Set the global_timeStamp to zero
 	write_idx = 0;
 	read_idx = 0; 
@@ -86,7 +96,7 @@ void TQueue<T>::push(T &input){
 	global_timeStamp++;
 
 	// Build a new cell
-	Cell *new_cell = new Cell();
+	Cell *new_cell = take_cell();
 	new_cell->my_timeStamp = global_timeStamp;
 	new_cell->my_t = input;
 
@@ -96,7 +106,7 @@ void TQueue<T>::push(T &input){
 	// Clean up the old_cell
 	if (old_cell != NULL){
 		clean_cell(*old_cell);
-		delete old_cell;
+		recycle_cell(old_cell);
 		old_cell = NULL;
 	}
 
@@ -129,7 +139,7 @@ T TQueue<T>::pop(const T &invalid_output){
 			else{
 				// current cell is not acceptable, delete it
 				clean_cell(*my_cell);
-				delete my_cell;
+				recycle_cell(my_cell);
 				my_cell = NULL;
 
 				// Increment the read_idx
@@ -143,7 +153,7 @@ T TQueue<T>::pop(const T &invalid_output){
 
 	// my_cell is the valid data
 	T retval = my_cell->my_t;
-	delete my_cell;		// clean my_cell except my_t
+	recycle_cell(my_cell);		// clean my_cell except my_t
 	my_cell = NULL;
 	return retval;
 }
@@ -155,6 +165,27 @@ void TQueue<T>::clean_cell(Cell &input){
 	}
 }
 
+template<class T>
+typename TQueue<T>::Cell *TQueue<T>::take_cell(){
+	Cell *cell = free_cells.load();
+	while (cell != NULL && !free_cells.compare_exchange_weak(cell, cell->next)){
+		// cell has been reloaded by compare_exchange_weak, try again
+	}
+	if (cell == NULL){
+		cell = new Cell();
+	}
+	return cell;
+}
+
+template<class T>
+void TQueue<T>::recycle_cell(Cell *cell){
+	cell->my_t = T();		// Release the data (the delete function has been called if needed)
+	cell->next = free_cells.load();
+	while (!free_cells.compare_exchange_weak(cell->next, cell)){
+		// cell->next has been reloaded by compare_exchange_weak, try again
+	}
+}
+
 template<class T>
 int TQueue<T>::get_capacity() const {
 	return capacity;
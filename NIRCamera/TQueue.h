@@ -78,6 +78,7 @@ private:
 	public:
 		unsigned long my_timeStamp;
 		T my_t;
+		Cell *next;		// Link in free_cells
 	};
 
 	atomic<Cell*> *cell_array;					// An array of atomic<Cell*>, it should be atomic<Cell*> so that writer and reader cannot access to the same data at same time. Using Cell* then every operation of atomic.exchange is just 8 bytes, a very small and constant number
@@ -89,6 +90,11 @@ private:
 	unsigned long tolerance = 0; 				// The max amount of delayed frame that pop() can tolerate
 												// For example, if frame = 3 and current frame = 11. Then the acceptable frames are 11, 10, 9, 8
 
+	// Cells that are no longer in cell_array are kept here and reused by push(), so that push() does not allocate
+	// once the queue is warmed up. Both threads put cells back, but only the writer takes them out, hence the
+	// lock-free stack does not suffer from the ABA problem.
+	atomic<Cell*> free_cells;
+
 	// Create the delete function of T, by default it is NULL
 	// The required format is:
 	// void function_name(T input){...}
@@ -103,6 +109,12 @@ private:
 	// Clean the cell
 	void clean_cell(Cell &input);
 
+	// Get a cell from free_cells, or a new one if it is empty (writer only)
+	Cell *take_cell();
+
+	// Put a cell back to free_cells. Its data is released
+	void recycle_cell(Cell *cell);
+
 };
 
 #include "TQueue.cpp"
@@ -0,0 +1,137 @@
+#include "TemporalFilter.h"
+#include "ThreadPool.h"
+
+#include "opencv2/core.hpp"
+#include <emmintrin.h>		// SSE2
+
+// Number of frames between two cost summaries in the log (about 10 s at 120 fps)
+#define TEMPORAL_FILTER_REPORT_FRAMES 1200
+
+TemporalFilter::TemporalFilter(int width, int height)
+{
+	Width = width;
+	Height = height;
+	PixelCount = width * height;
+	accumulator.assign(PixelCount, 0);
+	seeded = false;
+
+	lastCost = 0;
+	costSum = 0;
+	costCount = 0;
+
+	_logger = spdlog::stdout_color_mt("TemporalFilter");
+}
+
+TemporalFilter::~TemporalFilter()
+{
+}
+
+void TemporalFilter::Apply(const UINT16 *src, UINT16 *dst) {
+	INT64 startTick = cv::getTickCount();
+
+	if (!seeded) {
+		Seed(src, dst);
+		UpdateCost(startTick);
+		return;
+	}
+
+	// Every pixel is filtered on its own, so the rows are split over the thread pool
+	ThreadPool::Shared().ParallelRows(Width, Height, [&](int firstRow, int lastRow) {
+		FilterRange(src, dst, firstRow * Width, lastRow * Width);
+	});
+
+	UpdateCost(startTick);
+}
+
+void TemporalFilter::Reset() {
+	seeded = false;
+}
+
+double TemporalFilter::GetLastCost() const {
+	return lastCost;
+}
+
+void TemporalFilter::Seed(const UINT16 *src, UINT16 *dst) {
+	for (int i = 0; i < PixelCount; i++) {
+		UINT16 x = src[i];
+		accumulator[i] = (UINT32)x << TEMPORAL_FILTER_FRACTION_BITS;
+		dst[i] = x;
+	}
+	seeded = true;
+}
+
+void TemporalFilter::UpdateCost(INT64 startTick) {
+	lastCost = (cv::getTickCount() - startTick) * 1000.0 / cv::getTickFrequency();
+	_logger->debug("Frame filtered in {0:.3f} ms", lastCost);
+
+	costSum += lastCost;
+	costCount++;
+	if (costCount == TEMPORAL_FILTER_REPORT_FRAMES) {
+		_logger->info("Average cost: {0:.3f} ms per frame", costSum / costCount);
+		costSum = 0;
+		costCount = 0;
+	}
+}
+
+/*
+Low 32 bits of the products of the 32 bit lanes (SSE2 has no _mm_mullo_epi32). They are the same for signed lanes
+*/
+static inline __m128i MulLo32(__m128i a, __m128i b) {
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+/*
+Filter 4 pixels: x the new values, a the accumulator (both 32 bit lanes). Return the new accumulator
+*/
+static inline __m128i FilterLanes(__m128i x, __m128i a) {
+	const __m128i baseWeight = _mm_set1_epi32(TEMPORAL_FILTER_BASE_WEIGHT);
+	const __m128i fullWeight = _mm_set1_epi32(256);
+
+	// Difference to the accumulator in raw counts
+	__m128i d = _mm_sub_epi32(x, _mm_srli_epi32(a, TEMPORAL_FILTER_FRACTION_BITS));
+	__m128i sign = _mm_srai_epi32(d, 31);
+	__m128i absD = _mm_sub_epi32(_mm_xor_si128(d, sign), sign);
+
+	// Motion adaptive weight (8 fractional bits), min(BASE + |d| * SLOPE, 256)
+	__m128i w = _mm_add_epi32(baseWeight, MulLo32(absD, _mm_set1_epi32(TEMPORAL_FILTER_MOTION_SLOPE)));
+	__m128i full = _mm_cmpgt_epi32(w, fullWeight);
+	w = _mm_or_si128(_mm_andnot_si128(full, w), _mm_and_si128(full, fullWeight));
+
+	// |d * w| < 2^24. The result always lies between the accumulator and x << FRACTION_BITS
+	__m128i update = _mm_srai_epi32(MulLo32(d, w), 8 - TEMPORAL_FILTER_FRACTION_BITS);
+	return _mm_add_epi32(a, update);
+}
+
+void TemporalFilter::FilterRange(const UINT16 *src, UINT16 *dst, int begin, int end) {
+	UINT32 *acc = accumulator.data();
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bias = _mm_set1_epi32(0x8000);
+	const __m128i sign16 = _mm_set1_epi16((short)0x8000);
+
+	int i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i a0 = FilterLanes(_mm_unpacklo_epi16(x, zero), _mm_loadu_si128((const __m128i*)(acc + i)));
+		__m128i a1 = FilterLanes(_mm_unpackhi_epi16(x, zero), _mm_loadu_si128((const __m128i*)(acc + i + 4)));
+		_mm_storeu_si128((__m128i*)(acc + i), a0);
+		_mm_storeu_si128((__m128i*)(acc + i + 4), a1);
+
+		// The values are at most 0xFFFF: biased by 0x8000 they fit the signed saturation of _mm_packs_epi32
+		__m128i v0 = _mm_sub_epi32(_mm_srli_epi32(a0, TEMPORAL_FILTER_FRACTION_BITS), bias);
+		__m128i v1 = _mm_sub_epi32(_mm_srli_epi32(a1, TEMPORAL_FILTER_FRACTION_BITS), bias);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(_mm_packs_epi32(v0, v1), sign16));
+	}
+	for (; i < end; i++) {
+		int x = src[i];
+		int d = x - (int)(acc[i] >> TEMPORAL_FILTER_FRACTION_BITS);
+		int w = TEMPORAL_FILTER_BASE_WEIGHT + (d < 0 ? -d : d) * TEMPORAL_FILTER_MOTION_SLOPE;
+		if (w > 256) {
+			w = 256;
+		}
+		acc[i] = (UINT32)((int)acc[i] + ((d * w) >> (8 - TEMPORAL_FILTER_FRACTION_BITS)));
+		dst[i] = (UINT16)(acc[i] >> TEMPORAL_FILTER_FRACTION_BITS);
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <Windows.h>
+#include "spdlog/spdlog.h"
+
+#include <vector>
+
+using namespace std;
+
+// Number of fractional bits kept in the accumulator. The filter works on the full 16 bit values (the sensor
+// correction in front of it can produce values above the 12 bits of the sensor), 0xFFFF << 4 fits in 32 bit
+#define TEMPORAL_FILTER_FRACTION_BITS 4
+// Weight of the new frame in a static area, 256 == 1.0 (64 averages about 7 frames)
+#define TEMPORAL_FILTER_BASE_WEIGHT 64
+// Additional weight per raw count of difference between the new frame and the accumulator,
+// so that moving edges follow the new frame instead of leaving a trail
+#define TEMPORAL_FILTER_MOTION_SLOPE 3
+
+/*
+TemporalFilter is a recursive (exponential moving average) filter over the raw frames:
+	acc += (frame - acc) * w,	w = min(1, BASE + |frame - acc| * SLOPE)
+It keeps a single accumulator frame in 32 bit fixed point and runs as an SSE2 kernel (4 pixels per 32 bit vector).
+
+The accumulator is allocated once. Disabling the filter only marks the accumulator as stale,
+the next frame after enabling it again re-seeds the accumulator.
+*/
+class TemporalFilter
+{
+public:
+	TemporalFilter(int width, int height);
+	~TemporalFilter();
+
+	/*
+	Filter src into dst. src and dst may be the same buffer.
+	*/
+	void Apply(const UINT16 *src, UINT16 *dst);
+
+	/*
+	Forget the history, the next Apply() starts from its input frame
+	*/
+	void Reset();
+
+	// Cost of the last Apply() in ms
+	double GetLastCost() const;
+
+private:
+	int Width;
+	int Height;
+	int PixelCount;
+	vector<UINT32> accumulator;		// Filtered frame << TEMPORAL_FILTER_FRACTION_BITS
+	bool seeded;
+
+	double lastCost;
+	double costSum;
+	int costCount;
+
+	std::shared_ptr<spdlog::logger> _logger;
+
+	void Seed(const UINT16 *src, UINT16 *dst);
+
+	// Filter the pixels [begin, end)
+	void FilterRange(const UINT16 *src, UINT16 *dst, int begin, int end);
+
+	void UpdateCost(INT64 startTick);
+};
@@ -0,0 +1,210 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+
+// The pool and the index of the worker the current thread is (NULL/-1 for threads that are not workers)
+static thread_local ThreadPool *currentPool = NULL;
+static thread_local int currentIndex = -1;
+
+ThreadPool::ThreadPool(int threadCount)
+{
+	_logger = spdlog::stdout_color_mt("ThreadPool");
+
+	running = true;
+	nextWorker = 0;
+	pendingTasks = 0;
+
+	// Room for the bands of THREAD_POOL_QUEUED_CALLS calls of ParallelFor() in every queue
+	int capacity = (threadCount + 1) * THREAD_POOL_BANDS_PER_THREAD * THREAD_POOL_QUEUED_CALLS;
+	for (int i = 0; i < threadCount; i++) {
+		workers.push_back(new Worker(capacity));
+	}
+	for (int i = 0; i < threadCount; i++) {
+		workers[i]->handle = thread(&ThreadPool::WorkerFunction, this, i);
+	}
+
+	_logger->info("{0} worker threads", threadCount);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> lock(idleLock);
+		running = false;
+	}
+	idleCondition.notify_all();
+
+	for (size_t i = 0; i < workers.size(); i++) {
+		workers[i]->handle.join();
+		delete workers[i];
+	}
+}
+
+ThreadPool &ThreadPool::Shared() {
+	static ThreadPool pool(max((int)thread::hardware_concurrency() - 1, 1));
+	return pool;
+}
+
+void ThreadPool::ParallelFor(int begin, int end, int grain, const RangeFunction &body) {
+	int count = end - begin;
+	if (grain < 1) {
+		grain = 1;
+	}
+
+	int bands = min(count / grain, (int)(workers.size() + 1) * THREAD_POOL_BANDS_PER_THREAD);
+	if (bands <= 1 || workers.empty()) {
+		body(begin, end);
+		return;
+	}
+
+	atomic<int> remaining(bands);
+	int self = CurrentWorker();
+
+	// Band 0 is kept for this thread, the others go to the workers
+	Task first;
+	first.body = &body;
+	first.begin = begin;
+	first.end = begin + count / bands;
+	first.remaining = &remaining;
+
+	for (int b = 1; b < bands; b++) {
+		Task task;
+		task.body = &body;
+		task.begin = begin + (int)((INT64)count * b / bands);
+		task.end = begin + (int)((INT64)count * (b + 1) / bands);
+		task.remaining = &remaining;
+
+		// A worker queues its own bands (the others steal them), other threads spread them.
+		// If the queue is full the next one is tried, and if all of them are full the band runs right here
+		int firstTarget = self >= 0 ? self : (int)(nextWorker++ % workers.size());
+		bool queued = false;
+		for (size_t i = 0; i < workers.size() && !queued; i++) {
+			Worker *target = workers[(firstTarget + i) % workers.size()];
+			lock_guard<mutex> lock(target->lock);
+			if (target->tasks.PushBack(task)) {
+				pendingTasks++;
+				queued = true;
+			}
+		}
+		if (!queued) {
+			RunTask(task);
+		}
+	}
+
+	// Taking the lock makes sure no worker is between its last check and the wait
+	{
+		lock_guard<mutex> lock(idleLock);
+	}
+	idleCondition.notify_all();
+
+	RunTask(first);
+
+	// Help with whatever is queued until all the bands are done
+	while (remaining > 0) {
+		Task task;
+		if (FindTask(self, task)) {
+			RunTask(task);
+		}
+		else {
+			this_thread::yield();
+		}
+	}
+}
+
+void ThreadPool::ParallelRows(int width, int height, const RangeFunction &body) {
+	int grain = (THREAD_POOL_MIN_BAND_PIXELS + width - 1) / max(width, 1);
+	ParallelFor(0, height, grain, body);
+}
+
+int ThreadPool::GetThreadCount() const {
+	return (int)workers.size();
+}
+
+void ThreadPool::WorkerFunction(int index) {
+	currentPool = this;
+	currentIndex = index;
+
+	while (running) {
+		Task task;
+		if (FindTask(index, task)) {
+			RunTask(task);
+			continue;
+		}
+
+		unique_lock<mutex> lock(idleLock);
+		idleCondition.wait_for(lock, chrono::milliseconds(THREAD_POOL_IDLE_WAIT_MS), [this] { return !running || pendingTasks > 0; });
+	}
+}
+
+bool ThreadPool::FindTask(int index, Task &task) {
+	if (pendingTasks == 0) {
+		return false;
+	}
+
+	// Own work first, newest first (its data is most likely still in the cache)
+	if (index >= 0) {
+		Worker *own = workers[index];
+		lock_guard<mutex> lock(own->lock);
+		if (own->tasks.PopBack(task)) {
+			pendingTasks--;
+			return true;
+		}
+	}
+
+	// Steal the oldest task of another worker
+	int n = (int)workers.size();
+	int start = index >= 0 ? index + 1 : 0;
+	for (int i = 0; i < n; i++) {
+		Worker *victim = workers[(start + i) % n];
+		lock_guard<mutex> lock(victim->lock);
+		if (victim->tasks.PopFront(task)) {
+			pendingTasks--;
+			return true;
+		}
+	}
+	return false;
+}
+
+int ThreadPool::CurrentWorker() const {
+	return currentPool == this ? currentIndex : -1;
+}
+
+void ThreadPool::RunTask(Task &task) {
+	(*task.body)(task.begin, task.end);
+	task.remaining->fetch_sub(1);
+}
+
+ThreadPool::TaskRing::TaskRing(int capacity) : slots(max(capacity, 1))
+{
+	head = 0;
+	count = 0;
+}
+
+bool ThreadPool::TaskRing::PushBack(const Task &task) {
+	if (count == (int)slots.size()) {
+		return false;
+	}
+	slots[(head + count) % slots.size()] = task;
+	count++;
+	return true;
+}
+
+bool ThreadPool::TaskRing::PopBack(Task &task) {
+	if (count == 0) {
+		return false;
+	}
+	count--;
+	task = slots[(head + count) % slots.size()];
+	return true;
+}
+
+bool ThreadPool::TaskRing::PopFront(Task &task) {
+	if (count == 0) {
+		return false;
+	}
+	task = slots[head];
+	head = (head + 1) % slots.size();
+	count--;
+	return true;
+}
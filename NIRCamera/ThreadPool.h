@@ -0,0 +1,115 @@
+#pragma once
+
+#include <Windows.h>
+#include "spdlog/spdlog.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Bands smaller than this (in pixels) are not worth the scheduling, such frames are processed inline
+#define THREAD_POOL_MIN_BAND_PIXELS 16384
+// A frame is split into at most this many bands per thread, so that stolen bands balance the load
+#define THREAD_POOL_BANDS_PER_THREAD 4
+// An idle worker sleeps at most this long before it looks for work again (ms)
+#define THREAD_POOL_IDLE_WAIT_MS 10
+// The task queue of a worker holds the bands of this many ParallelFor() calls (the stage threads call it concurrently).
+// A band that finds every queue full runs on the calling thread
+#define THREAD_POOL_QUEUED_CALLS 4
+
+/*
+A work-stealing thread pool shared by all the pipeline stages.
+Every worker has its own queue of tasks: it takes its own work from the back and steals from the front of the
+other queues when it runs dry. The thread that calls ParallelFor() does not wait idle, it runs bands as well.
+The queues are rings allocated once in the constructor, scheduling a band does not allocate.
+*/
+class ThreadPool
+{
+public:
+	typedef function<void(int, int)> RangeFunction;		// body(begin, end)
+
+	/*
+	threadCount: number of worker threads, the calling threads come on top of them
+	*/
+	ThreadPool(int threadCount);
+	~ThreadPool();
+
+	/*
+	The pool used by the pixel kernels, one worker per core minus the caller.
+	*/
+	static ThreadPool &Shared();
+
+	/*
+	Run body over [begin, end) split in bands of at least grain items and return when all bands are done.
+	A range that is not larger than grain runs inline on the calling thread.
+	*/
+	void ParallelFor(int begin, int end, int grain, const RangeFunction &body);
+
+	/*
+	Run body over the rows [0, height) of a frame that is width pixels wide, in row bands
+	of at least THREAD_POOL_MIN_BAND_PIXELS pixels
+	*/
+	void ParallelRows(int width, int height, const RangeFunction &body);
+
+	int GetThreadCount() const;
+
+private:
+	class Task {
+	public:
+		const RangeFunction *body;
+		int begin;
+		int end;
+		atomic<int> *remaining;		// Bands of the ParallelFor that are not done yet
+	};
+
+	// A fixed-capacity double-ended queue of tasks
+	class TaskRing {
+	public:
+		TaskRing(int capacity);
+
+		// Return FALSE if the ring is full (or empty)
+		bool PushBack(const Task &task);
+		bool PopBack(Task &task);
+		bool PopFront(Task &task);
+
+	private:
+		vector<Task> slots;
+		int head;					// Index of the front task
+		int count;
+	};
+
+	class Worker {
+	public:
+		Worker(int capacity) : tasks(capacity) {}
+
+		mutex lock;
+		TaskRing tasks;
+		thread handle;
+	};
+
+	vector<Worker*> workers;
+	atomic<bool> running;
+	atomic<unsigned int> nextWorker;		// Round-robin target for the tasks of non-worker threads
+	atomic<int> pendingTasks;				// Tasks in all the queues
+
+	// Idle workers wait here
+	mutex idleLock;
+	condition_variable idleCondition;
+
+	std::shared_ptr<spdlog::logger> _logger;
+
+	void WorkerFunction(int index);
+
+	// Take a task from worker index, or steal one from the others. Return FALSE if there is no work.
+	bool FindTask(int index, Task &task);
+
+	// Index of the worker the calling thread is, -1 for other threads
+	int CurrentWorker() const;
+
+	static void RunTask(Task &task);
+};